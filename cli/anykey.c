@@ -42,15 +42,14 @@ static int received_anykey(int fd, int revents, void *user_data)
 	/* Avoid compiler warnings. */
 	fd = fd;
 	revents = revents;
-	user_data = user_data;
 
-	sr_session_stop();
+	sr_session_stop(user_data);
 
 	return TRUE;
 }
 
 /* Turn off buffering on stdin. */
-void add_anykey(void)
+void add_anykey(struct sr_session *session)
 {
 #ifdef _WIN32
 	stdin_handle = GetStdHandle(STD_INPUT_HANDLE);
@@ -69,7 +68,8 @@ void add_anykey(void)
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &term);
 #endif
 
-	sr_session_source_add(STDIN_FILENO, G_IO_IN, -1, received_anykey, NULL);
+	sr_session_source_add(session, STDIN_FILENO, G_IO_IN, -1,
+			      received_anykey, session);
 
 	printf("Press any key to stop acquisition.\n");
 }
@@ -36,6 +36,13 @@
 
 #define DEFAULT_OUTPUT_FORMAT "bits:width=64"
 
+/* Merge the drivers' small packets into ones of up to 1MB, or 100ms. */
+#define COALESCE_BYTES (1024 * 1024)
+#define COALESCE_MSEC 100
+
+/* Keep the last million events for --trace. */
+#define TRACE_EVENTS (1024 * 1024)
+
 extern struct sr_hwcap_option sr_hwcap_options[];
 
 gboolean debug = 0;
@@ -62,6 +69,11 @@ static gchar *opt_format = NULL;
 static gchar *opt_time = NULL;
 static gchar *opt_samples = NULL;
 static gchar *opt_continuous = NULL;
+static gboolean opt_stats = FALSE;
+static gboolean opt_threaded = FALSE;
+static gchar *opt_trace = NULL;
+static gint opt_compress = -1;
+static gint opt_compress_threads = 0;
 
 static GOptionEntry optargs[] = {
 	{"version", 'V', 0, G_OPTION_ARG_NONE, &opt_version, "Show version and support list", NULL},
@@ -78,6 +90,11 @@ static GOptionEntry optargs[] = {
 	{"time", 0, 0, G_OPTION_ARG_STRING, &opt_time, "How long to sample (ms)", NULL},
 	{"samples", 0, 0, G_OPTION_ARG_STRING, &opt_samples, "Number of samples to acquire", NULL},
 	{"continuous", 0, 0, G_OPTION_ARG_NONE, &opt_continuous, "Sample continuously", NULL},
+	{"stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats, "Show datafeed statistics", NULL},
+	{"threaded", 0, 0, G_OPTION_ARG_NONE, &opt_threaded, "Acquire from each device on its own thread", NULL},
+	{"trace", 0, 0, G_OPTION_ARG_FILENAME, &opt_trace, "Save timeline trace to file (Chrome JSON)", NULL},
+	{"compress", 0, 0, G_OPTION_ARG_INT, &opt_compress, "Session file compression level (0 = store, 1-9)", NULL},
+	{"compress-threads", 0, 0, G_OPTION_ARG_INT, &opt_compress_threads, "Session file compression threads (0 = one per CPU)", NULL},
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -264,12 +281,19 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 	static int unitsize = 0;
 	static int triggered = 0;
 	static FILE *outfile = NULL;
+	static struct sr_filter *filter = NULL;
+	static int filter_unitsize = 0;
+	static char *filter_out = NULL;
+	static uint64_t filter_out_size = 0;
+	static struct sr_session_writer *writer = NULL;
 	struct sr_probe *probe;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_overflow *overflow;
 	int num_enabled_probes, sample_size, ret, i;
 	uint64_t output_len, filter_out_len, dec_out_size;
-	char *output_buf, *filter_out;
+	uint64_t overflows, samples_lost;
+	char *output_buf;
 	uint8_t *dec_out;
 
 	/* If the first packet to come in isn't a header, don't even try. */
@@ -302,19 +326,31 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 			if (probe->enabled)
 				probelist[num_enabled_probes++] = probe->index;
 		}
+		probelist[num_enabled_probes] = 0;
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
 
+		/* Compile the probe filter once, for all packets to come. */
+		filter_unitsize = (header->num_logic_probes + 7) / 8;
+		if (filter)
+			sr_filter_destroy(filter);
+		if (sr_filter_new(filter_unitsize, unitsize, probelist,
+				  &filter) != SR_OK) {
+			printf("Failed to create probe filter.\n");
+			exit(1);
+		}
+
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* output file is in session format, which we
+				 * write as the samples come in, so the session
+				 * file is done as soon as the session is. */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(device->datastore));
+				ret = sr_session_writer_new(device->session,
+						opt_output_file, &writer);
 				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
+					printf("Failed to create session file.\n");
 					exit(1);
 				}
 			} else {
@@ -331,7 +367,11 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 			break;
 		}
 		if (o->format->event) {
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_BEGIN,
+					SR_DF_END);
 			o->format->event(o, SR_DF_END, &output_buf, &output_len);
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_END,
+					SR_DF_END);
 			if (output_len) {
 				if (outfile)
 					fwrite(output_buf, 1, output_len, outfile);
@@ -345,18 +385,39 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 		if (opt_continuous)
 			printf("Device stopped after %" PRIu64 " samples.\n",
 			       received_samples);
-		sr_session_halt();
+		if (sr_session_get_overflows(device->session, &overflows,
+					     &samples_lost) == SR_OK
+		    && overflows > 0)
+			printf("Device lost data %" PRIu64 " times (%" PRIu64
+			       " samples known lost).\n", overflows,
+			       samples_lost);
+		if (writer) {
+			if (sr_session_writer_finish(writer) != SR_OK)
+				printf("Failed to save session.\n");
+			writer = NULL;
+		}
+		sr_session_halt(device->session);
 		if (outfile && outfile != stdout)
 			fclose(outfile);
 		free(o);
 		o = NULL;
+		sr_filter_destroy(filter);
+		filter = NULL;
+		free(filter_out);
+		filter_out = NULL;
+		filter_out_size = 0;
 		break;
 	case SR_DF_TRIGGER:
 		g_message("cli: received SR_DF_TRIGGER at %"PRIu64" ms",
 				packet->timeoffset / 1000000);
-		if (o->format->event)
+		if (o->format->event) {
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_BEGIN,
+					SR_DF_TRIGGER);
 			o->format->event(o, SR_DF_TRIGGER, &output_buf,
 					 &output_len);
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_END,
+					SR_DF_TRIGGER);
+		}
 		triggered = 1;
 		break;
 	case SR_DF_LOGIC:
@@ -368,6 +429,12 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 		break;
 	case SR_DF_ANALOG:
 		break;
+	case SR_DF_OVERFLOW:
+		overflow = packet->payload;
+		g_message("cli: received SR_DF_OVERFLOW at %f ms, %"PRIu64" samples lost",
+				packet->timeoffset / 1000000.0,
+				overflow ? overflow->num_samples : 0);
+		break;
 	}
 
 	/* not supporting anything but SR_DF_LOGIC for now */
@@ -383,9 +450,25 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 		return;
 
 	/* TODO: filters only support SR_DF_LOGIC */
-	ret = sr_filter_probes(sample_size, unitsize, probelist,
-				   logic->data, logic->length,
-				   &filter_out, &filter_out_len);
+	if (sample_size != filter_unitsize) {
+		/* The driver sends wider units than its probes need. */
+		sr_filter_destroy(filter);
+		filter = NULL;
+		filter_unitsize = sample_size;
+		if (sr_filter_new(filter_unitsize, unitsize, probelist,
+				  &filter) != SR_OK)
+			return;
+	}
+	if (logic->length > filter_out_size) {
+		free(filter_out);
+		if (!(filter_out = malloc(logic->length))) {
+			filter_out_size = 0;
+			return;
+		}
+		filter_out_size = logic->length;
+	}
+	ret = sr_filter_run(filter, logic->data, logic->length,
+			    filter_out, &filter_out_len);
 	if (ret != SR_OK)
 		return;
 
@@ -398,9 +481,12 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 			limit_samples * sample_size))
 		filter_out_len = limit_samples * sample_size - received_samples;
 
-	if (device->datastore)
-		sr_datastore_put(device->datastore, filter_out,
-				 filter_out_len, sample_size, probelist);
+	if (writer && sr_session_writer_append(writer, device, filter_out,
+					       filter_out_len, unitsize) != SR_OK) {
+		printf("Failed to save samples.\n");
+		sr_session_writer_finish(writer);
+		writer = NULL;
+	}
 
 	if (opt_output_file && default_output_format)
 		/* saving to a session file, don't need to do anything else
@@ -413,8 +499,12 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 			/* TODO: Error handling. */
 			
 			dec_out_size = 0;
+			sr_trace_record(SR_TRACE_DECODER, SR_TRACE_BEGIN,
+					filter_out_len);
 			ret = srd_run_decoder(d->data, (uint8_t*)filter_out,
 					filter_out_len, &dec_out, &dec_out_size);
+			sr_trace_record(SR_TRACE_DECODER, SR_TRACE_END,
+					filter_out_len);
 
 			if (ret != SRD_OK) {
 				fprintf(stderr, "Decoder runtime error (%d)\n", ret);
@@ -425,8 +515,13 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 		}
 	} else {
 		output_len = 0;
-		if (o->format->data && packet->type == o->format->df_type)
+		if (o->format->data && packet->type == o->format->df_type) {
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_BEGIN,
+					packet->type);
 			o->format->data(o, filter_out, filter_out_len, &output_buf, &output_len);
+			sr_trace_record(SR_TRACE_OUTPUT, SR_TRACE_END,
+					packet->type);
+		}
 		if (output_len) {
 			fwrite(output_buf, 1, output_len, outfile);
 			free(output_buf);
@@ -434,7 +529,6 @@ static void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *pac
 	}
 
 	cleanup:
-	free(filter_out);
 	received_samples += logic->length / sample_size;
 
 }
@@ -520,8 +614,83 @@ static int select_probes(struct sr_device *device)
 	return SR_OK;
 }
 
+/* Names of the datafeed packet types, for show_stats(). */
+static const char *packet_types[] = {
+	"header", "end", "trigger", "logic", "analog", "pd", "overflow",
+};
+
+/* Print the session's datafeed counters to stderr. */
+static void show_stats(struct sr_session *session)
+{
+	struct sr_session_stats *stats;
+	struct sr_device_stats *ds;
+	struct sr_callback_stats *cs;
+	GSList *l;
+	double secs;
+	int i, n;
+
+	if (sr_session_get_stats(session, &stats) != SR_OK) {
+		fprintf(stderr, "Failed to get session statistics.\n");
+		return;
+	}
+
+	secs = stats->elapsed_usec / 1000000.0;
+	fprintf(stderr, "Datafeed statistics, %.3f s:\n", secs);
+	for (l = stats->devices; l; l = l->next) {
+		ds = l->data;
+		fprintf(stderr, "  %s device %d:\n", ds->device->plugin->name,
+			ds->device->plugin_index);
+		for (i = 0; i < SR_DF_NUM_TYPES; i++) {
+			if (!ds->packets[i])
+				continue;
+			fprintf(stderr, "    %s: %" PRIu64 " packets",
+				i < (int)G_N_ELEMENTS(packet_types)
+				? packet_types[i] : "unknown", ds->packets[i]);
+			if (ds->bytes[i])
+				fprintf(stderr, ", %" PRIu64 " bytes", ds->bytes[i]);
+			if (ds->bytes[i] && secs > 0)
+				fprintf(stderr, ", %.2f MB/s",
+					ds->bytes[i] / secs / 1000000.0);
+			fprintf(stderr, "\n");
+		}
+		if (ds->queued)
+			fprintf(stderr, "    queue: %" PRIu64 " packets, mean "
+				"depth %.1f, max %" PRIu64 ", full %" PRIu64
+				" times\n", ds->queued,
+				(double)ds->queue_depth_sum / ds->queued,
+				ds->queue_depth_max, ds->queue_full);
+	}
+	for (l = stats->callbacks, n = 1; l; l = l->next, n++) {
+		cs = l->data;
+		fprintf(stderr, "  callback %d: %" PRIu64 " calls", n, cs->calls);
+		if (!cs->calls) {
+			fprintf(stderr, "\n");
+			continue;
+		}
+		fprintf(stderr, ", %.3f ms total, %.1f us mean, %" PRIu64
+			" us max\n", cs->total_usec / 1000.0,
+			(double)cs->total_usec / cs->calls, cs->max_usec);
+		for (i = 0; i < SR_STATS_BUCKETS; i++) {
+			if (!cs->histogram[i])
+				continue;
+			if (i == SR_STATS_BUCKETS - 1)
+				fprintf(stderr, "    >= %" PRIu64 " us",
+					(uint64_t)1 << (i - 1));
+			else
+				fprintf(stderr, "    < %" PRIu64 " us",
+					(uint64_t)1 << i);
+			fprintf(stderr, ": %" PRIu64 "\n", cs->histogram[i]);
+		}
+	}
+	fprintf(stderr, "  lost data %" PRIu64 " times, %" PRIu64 " samples\n",
+		stats->overflows, stats->samples_lost);
+
+	sr_session_stats_free(stats);
+}
+
 static void load_input_file_format(void)
 {
+	struct sr_session *session;
 	struct stat st;
 	struct sr_input *in;
 	struct sr_input_format **inputs, *input_format;
@@ -563,32 +732,69 @@ static void load_input_file_format(void)
 	if (select_probes(in->vdevice) > 0)
             return;
 
-	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
-	if (sr_session_device_add(in->vdevice) != SR_OK) {
+	if (!(session = sr_session_new())) {
+		printf("Failed to create session.\n");
+		return;
+	}
+	sr_session_datafeed_callback_add(session, datafeed_in);
+	if (sr_session_device_add(session, in->vdevice) != SR_OK) {
 		printf("Failed to use device.\n");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
 	input_format->loadfile(in, opt_input_file);
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			printf("Failed to save session.\n");
-	}
-	sr_session_destroy();
+	if (opt_stats)
+		show_stats(session);
+	sr_session_destroy(session);
 
 }
 
 static void load_input_file(void)
 {
+	struct sr_session *session;
+	GHashTable *devargs;
+	GSList *l;
+	gpointer value;
+	gboolean looping;
+	int ret;
 
-	if (sr_session_load(opt_input_file) == SR_OK) {
+	looping = FALSE;
+	if (sr_session_load(opt_input_file, &session) == SR_OK) {
 		/* sigrok session file */
-		sr_session_datafeed_callback_add(datafeed_in);
-		sr_session_start();
-		sr_session_run();
-		sr_session_stop();
+		if (opt_device) {
+			/* Replay options apply to all devices in the file. */
+			devargs = parse_generic_arg(opt_device);
+			g_hash_table_remove(devargs, "sigrok_key");
+			ret = SR_OK;
+			for (l = session->devices; l && ret == SR_OK; l = l->next)
+				ret = set_device_options(l->data, devargs);
+			/* A looping replay runs until stopped. */
+			if (g_hash_table_lookup_extended(devargs, "loop", NULL,
+							 &value))
+				looping = !value || sr_parse_boolstring(value);
+			g_hash_table_destroy(devargs);
+			if (ret != SR_OK) {
+				sr_session_destroy(session);
+				return;
+			}
+		}
+		sr_session_datafeed_callback_add(session, datafeed_in);
+		/* Protocol decoders must run on the main (Python) thread. */
+		if (opt_threaded && !decoders)
+			sr_session_set_threaded(session, TRUE);
+		sr_session_set_coalescing(session, COALESCE_BYTES,
+					  COALESCE_MSEC);
+		sr_session_start(session);
+		if (looping)
+			add_anykey(session);
+		sr_session_run(session);
+		if (looping)
+			clear_anykey();
+		sr_session_stop(session);
+		if (opt_stats)
+			show_stats(session);
+		sr_session_destroy(session);
 	}
 	else {
 		/* fall back on input modules */
@@ -676,6 +882,7 @@ int set_device_options(struct sr_device *device, GHashTable *args)
 
 static void run_session(void)
 {
+	struct sr_session *session;
 	struct sr_device *device;
 	GHashTable *devargs;
 	int num_devices, max_probes, *capabilities, i;
@@ -707,31 +914,40 @@ static void run_session(void)
 		}
 	}
 
-	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	if (!(session = sr_session_new())) {
+		printf("Failed to create session.\n");
+		return;
+	}
+	sr_session_datafeed_callback_add(session, datafeed_in);
+	/* Protocol decoders must run on the main (Python) thread. */
+	if (opt_threaded && !decoders)
+		sr_session_set_threaded(session, TRUE);
+	sr_session_set_coalescing(session, COALESCE_BYTES, COALESCE_MSEC);
 
-	if (sr_session_device_add(device) != SR_OK) {
+	if (sr_session_device_add(session, device) != SR_OK) {
 		printf("Failed to use device.\n");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
 	if (devargs) {
 		if (set_device_options(device, devargs) != SR_OK) {
-			sr_session_destroy();
+			sr_session_destroy(session);
 			return;
 		}
 		g_hash_table_destroy(devargs);
 	}
 
-	if (select_probes(device) != SR_OK)
-            return;
+	if (select_probes(device) != SR_OK) {
+		sr_session_destroy(session);
+		return;
+	}
 
 	if (opt_continuous) {
 		capabilities = device->plugin->get_capabilities();
 		if (!sr_find_hwcap(capabilities, SR_HWCAP_CONTINUOUS)) {
 			printf("This device does not support continuous sampling.");
-			sr_session_destroy();
+			sr_session_destroy(session);
 			return;
 		}
 	}
@@ -739,7 +955,7 @@ static void run_session(void)
 	if (opt_triggers) {
 		probelist = sr_parse_triggerstring(device, opt_triggers);
 		if (!probelist) {
-			sr_session_destroy();
+			sr_session_destroy(session);
 			return;
 		}
 
@@ -757,7 +973,7 @@ static void run_session(void)
 		time_msec = sr_parse_timestring(opt_time);
 		if (time_msec == 0) {
 			printf("Invalid time '%s'\n", opt_time);
-			sr_session_destroy();
+			sr_session_destroy(session);
 			return;
 		}
 
@@ -766,7 +982,7 @@ static void run_session(void)
 			if (device->plugin->set_configuration(device->plugin_index,
 							  SR_HWCAP_LIMIT_MSEC, &time_msec) != SR_OK) {
 				printf("Failed to configure time limit.\n");
-				sr_session_destroy();
+				sr_session_destroy(session);
 				return;
 			}
 		}
@@ -782,14 +998,14 @@ static void run_session(void)
 			}
 			if (limit_samples == 0) {
 				printf("Not enough time at this samplerate.\n");
-				sr_session_destroy();
+				sr_session_destroy(session);
 				return;
 			}
 
 			if (device->plugin->set_configuration(device->plugin_index,
 						  SR_HWCAP_LIMIT_SAMPLES, &limit_samples) != SR_OK) {
 				printf("Failed to configure time-based sample limit.\n");
-				sr_session_destroy();
+				sr_session_destroy(session);
 				return;
 			}
 		}
@@ -800,7 +1016,7 @@ static void run_session(void)
 		if (device->plugin->set_configuration(device->plugin_index,
 					  SR_HWCAP_LIMIT_SAMPLES, &limit_samples) != SR_OK) {
 			printf("Failed to configure sample limit.\n");
-			sr_session_destroy();
+			sr_session_destroy(session);
 			return;
 		}
 	}
@@ -808,29 +1024,28 @@ static void run_session(void)
 	if (device->plugin->set_configuration(device->plugin_index,
 		  SR_HWCAP_PROBECONFIG, (char *)device->probes) != SR_OK) {
 		printf("Failed to configure probes.\n");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
-	if (sr_session_start() != SR_OK) {
+	if (sr_session_start(session) != SR_OK) {
 		printf("Failed to start session.\n");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
 	if (opt_continuous)
-		add_anykey();
+		add_anykey(session);
 
-	sr_session_run();
+	sr_session_run(session);
 
 	if (opt_continuous)
 		clear_anykey();
 
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			printf("Failed to save session.\n");
-	}
-	sr_session_destroy();
+	if (opt_stats)
+		show_stats(session);
+
+	sr_session_destroy(session);
 
 }
 
@@ -894,6 +1109,12 @@ int main(int argc, char **argv)
 	if (sr_init() != SR_OK)
 		return 1;
 
+	if (sr_session_save_set_compression(opt_compress,
+					    opt_compress_threads) != SR_OK) {
+		printf("Invalid session file compression settings.\n");
+		return 1;
+	}
+
 	if (opt_pds) {
 		/* TODO: Error handling. */
 		srd_init();
@@ -933,6 +1154,11 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (opt_trace && sr_trace_start(TRACE_EVENTS) != SR_OK) {
+		printf("Failed to start tracing.\n");
+		return 1;
+	}
+
 	if (opt_version)
 		show_version();
 	else if (opt_list_devices)
@@ -946,6 +1172,12 @@ int main(int argc, char **argv)
 	else
 		printf("%s", g_option_context_get_help(context, TRUE, NULL));
 
+	if (opt_trace) {
+		sr_trace_stop();
+		if (sr_trace_dump_json(opt_trace) != SR_OK)
+			printf("Failed to save trace to %s.\n", opt_trace);
+	}
+
 	if (opt_pds)
 		srd_exit();
 
@@ -22,6 +22,7 @@
 
 /* sigrok-cli.c */
 int num_real_devices(void);
+int set_device_options(struct sr_device *device, GHashTable *args);
 
 /* parsers.c */
 char **parse_probestring(int max_probes, const char *probestring);
@@ -32,7 +33,7 @@ struct sr_device *parse_devicestring(const char *devicestring);
 uint64_t sr_parse_timestring(const char *timestring);
 
 /* anykey.c */
-void add_anykey(void);
+void add_anykey(struct sr_session *session);
 void clear_anykey(void);
 
 #endif
@@ -38,10 +38,9 @@ static void dev_selected(GtkComboBox *dev, GObject *parent)
 
 	gtk_check_menu_item_set_active(menuitem, TRUE);
 
-	sr_session_device_clear();
-	if (sr_session_device_add(device) != SR_OK) {
+	sr_session_device_clear(session);
+	if (sr_session_device_add(session, device) != SR_OK) {
 		g_critical("Failed to use device.");
-		sr_session_destroy();
 		device = NULL;
 	}
 	g_object_set_data(parent, "device", device);
@@ -26,6 +26,7 @@
 
 #include "sigrok-gtk.h"
 
+struct sr_session *session;
 GtkWidget *sigview;
 
 static const char *colours[8] = {
@@ -38,12 +39,15 @@ datafeed_in(struct sr_device *device, struct sr_datafeed_packet *packet)
 {
 	static int probelist[65] = { 0 };
 	static int unitsize = 0;
+	static struct sr_filter *filter = NULL;
+	static int filter_unitsize = 0;
+	static char *filter_out = NULL;
+	static uint64_t filter_out_size = 0;
 	struct sr_probe *probe;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_logic *logic = NULL;
 	int num_enabled_probes, sample_size, i;
 	uint64_t filter_out_len;
-	char *filter_out;
 	GArray *data;
 
 	switch (packet->type) {
@@ -65,16 +69,31 @@ datafeed_in(struct sr_device *device, struct sr_datafeed_packet *packet)
 						-1);
 			}
 		}
+		probelist[num_enabled_probes] = 0;
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
 		data = g_array_new(FALSE, FALSE, unitsize);
+
+		/* Compile the probe filter once, for all packets to come. */
+		filter_unitsize = (header->num_logic_probes + 7) / 8;
+		if (filter)
+			sr_filter_destroy(filter);
+		if (sr_filter_new(filter_unitsize, unitsize, probelist,
+				  &filter) != SR_OK)
+			filter = NULL;
 		g_object_set_data(G_OBJECT(siglist), "sampledata", data);
 
 		break;
 	case SR_DF_END:
 		sigview_zoom(sigview, 1, 0);
 		g_message("cli: Received SR_DF_END");
-		sr_session_halt();
+		sr_session_halt(device->session);
+		if (filter)
+			sr_filter_destroy(filter);
+		filter = NULL;
+		g_free(filter_out);
+		filter_out = NULL;
+		filter_out_size = 0;
 		break;
 	case SR_DF_TRIGGER:
 		g_message("cli: received SR_DF_TRIGGER at %"PRIu64" ms",
@@ -94,25 +113,43 @@ datafeed_in(struct sr_device *device, struct sr_datafeed_packet *packet)
 	if (!logic)
 		return;
 
-	if (sr_filter_probes(sample_size, unitsize, probelist,
-				   logic->data, logic->length,
-				   &filter_out, &filter_out_len) != SR_OK)
+	if (!filter || sample_size != filter_unitsize) {
+		/* The driver sends wider units than its probes need. */
+		if (filter)
+			sr_filter_destroy(filter);
+		filter_unitsize = sample_size;
+		if (sr_filter_new(filter_unitsize, unitsize, probelist,
+				  &filter) != SR_OK) {
+			filter = NULL;
+			return;
+		}
+	}
+	if (logic->length > filter_out_size) {
+		g_free(filter_out);
+		filter_out = g_malloc(logic->length);
+		filter_out_size = logic->length;
+	}
+	if (sr_filter_run(filter, logic->data, logic->length,
+			  filter_out, &filter_out_len) != SR_OK)
 		return;
 
 	data = g_object_get_data(G_OBJECT(siglist), "sampledata");
 	g_return_if_fail(data != NULL);
 
-	g_array_append_vals(data, filter_out, filter_out_len);
+	g_array_append_vals(data, filter_out, filter_out_len / unitsize);
 }
 
 void load_input_file(const gchar *file)
 {
-	if (sr_session_load(file) == SR_OK) {
+	struct sr_session *file_session;
+
+	if (sr_session_load(file, &file_session) == SR_OK) {
 		/* sigrok session file */
-		sr_session_datafeed_callback_add(datafeed_in);
-		sr_session_start();
-		sr_session_run();
-		sr_session_stop();
+		sr_session_datafeed_callback_add(file_session, datafeed_in);
+		sr_session_start(file_session);
+		sr_session_run(file_session);
+		sr_session_stop(file_session);
+		sr_session_destroy(file_session);
 	}
 }
 
@@ -123,8 +160,8 @@ int main(int argc, char **argv)
 	gtk_init(&argc, &argv);
 	icons_register();
 	sr_init();
-	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	session = sr_session_new();
+	sr_session_datafeed_callback_add(session, datafeed_in);
 
 	window = GTK_WINDOW(gtk_window_new(GTK_WINDOW_TOPLEVEL));
 	gtk_window_set_icon_name(window, "sigrok-logo");
@@ -153,7 +190,7 @@ int main(int argc, char **argv)
 
 	gtk_main();
 
-	sr_session_destroy();
+	sr_session_destroy(session);
 	gtk_exit(0);
 
 	return 0;
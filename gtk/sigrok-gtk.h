@@ -23,6 +23,8 @@
 #include <gtk/gtk.h>
 
 /* main.c */
+extern struct sr_session *session;
+
 void load_input_file(const gchar *file);
 
 /* sigview.c */
@@ -354,7 +354,6 @@ static void capture_run(GtkAction *action, GObject *parent)
 							SR_HWCAP_LIMIT_MSEC,
 							&time_msec) != SR_OK) {
 				g_critical("Failed to configure time limit.");
-				sr_session_destroy();
 				return;
 			}
 		} else {
@@ -394,16 +393,15 @@ static void capture_run(GtkAction *action, GObject *parent)
 	if (device->plugin->set_configuration(device->plugin_index,
 		  SR_HWCAP_PROBECONFIG, (char *)device->probes) != SR_OK) {
 		printf("Failed to configure probes.\n");
-		sr_session_destroy();
 		return;
 	}
 
-	if (sr_session_start() != SR_OK) {
+	if (sr_session_start(device->session) != SR_OK) {
 		g_critical("Failed to start session.");
 		return;
 	}
 
-	sr_session_run();
+	sr_session_run(device->session);
 }
 
 static void dev_file_open(GtkAction *action, GtkWindow *parent)
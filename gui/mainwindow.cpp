@@ -485,7 +485,7 @@ void datafeed_in(struct sr_device *device, struct sr_datafeed_packet *packet)
 	case SR_DF_END:
 		qDebug("SR_DF_END");
 		/* TODO: o */
-		sr_session_halt();
+		sr_session_halt(device->session);
 		progress->setValue(received_samples); /* FIXME */
 		break;
 	case SR_DF_TRIGGER:
@@ -533,6 +533,7 @@ void MainWindow::on_action_Get_samples_triggered()
 	uint64_t samplerate;
 	QString s;
 	int opt_device;
+	struct sr_session *session;
 	struct sr_device *device;
 	QComboBox *n = ui->comboBoxNumSamples;
 
@@ -560,8 +561,12 @@ void MainWindow::on_action_Get_samples_triggered()
 		return;
 	}
 
-	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	if (!(session = sr_session_new())) {
+		qDebug("Failed to create session.");
+		free(sample_buffer);
+		return;
+	}
+	sr_session_datafeed_callback_add(session, datafeed_in);
 
 	device = (struct sr_device *)g_slist_nth_data(devices, opt_device);
 
@@ -569,13 +574,13 @@ void MainWindow::on_action_Get_samples_triggered()
 	if (device->plugin->set_configuration(device->plugin_index,
 	    SR_HWCAP_LIMIT_SAMPLES, &limit_samples) != SR_OK) {
 		qDebug("Failed to set sample limit.");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
-	if (sr_session_device_add(device) != SR_OK) {
+	if (sr_session_device_add(session, device) != SR_OK) {
 		qDebug("Failed to use device.");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
@@ -583,20 +588,20 @@ void MainWindow::on_action_Get_samples_triggered()
 	if (device->plugin->set_configuration(device->plugin_index,
 	    SR_HWCAP_SAMPLERATE, &samplerate) != SR_OK) {
 		qDebug("Failed to set samplerate.");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	};
 
 	if (device->plugin->set_configuration(device->plugin_index,
 	    SR_HWCAP_PROBECONFIG, (char *)device->probes) != SR_OK) {
 		qDebug("Failed to configure probes.");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
-	if (sr_session_start() != SR_OK) {
+	if (sr_session_start(session) != SR_OK) {
 		qDebug("Failed to start session.");
-		sr_session_destroy();
+		sr_session_destroy(session);
 		return;
 	}
 
@@ -605,10 +610,10 @@ void MainWindow::on_action_Get_samples_triggered()
 	progress->setWindowModality(Qt::WindowModal);
 	progress->setMinimumDuration(100);
 
-	sr_session_run();
+	sr_session_run(session);
 
-	sr_session_halt();
-	sr_session_destroy();
+	sr_session_halt(session);
+	sr_session_destroy(session);
 
 	for (int i = 0; i < getNumChannels(); ++i) {
 		channelForms[i]->setNumSamples(limit_samples);
@@ -40,6 +40,7 @@ int sr_exit(void)
 {
 
 	sr_cleanup_hwplugins();
+	pool_cleanup();
 
 	return SR_OK;
 }
@@ -0,0 +1,214 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Reference counted datafeed buffers, drawn from a pool per session.
+ *
+ * Buffer sizes are rounded up to a power of two. When the last reference
+ * to a buffer is dropped, it goes back on its pool's free list for that
+ * size, and the next sr_buffer_new() of that size hands it out again: a
+ * driver which keeps resubmitting transfers of the same size ends up
+ * cycling through the same few buffers. Each pool keeps at most
+ * BUFFER_POOL_CACHE bytes on its free lists.
+ *
+ * Every buffer holds a reference to its pool, so buffers a frontend kept
+ * stay valid after their session was destroyed.
+ */
+
+/* Smallest buffer size, as a power of two. */
+#define BUFFER_MIN_SHIFT	9
+/* Number of size classes; larger buffers are never cached. */
+#define BUFFER_CLASSES		24
+
+struct sr_buffer_pool {
+	GStaticMutex mutex;
+	struct sr_buffer *free[BUFFER_CLASSES];
+	uint64_t cached;
+	/* One for the session, and one for each buffer handed out. */
+	volatile gint refcount;
+};
+
+static int size_class(uint64_t size)
+{
+	int class;
+
+	for (class = 0; class < BUFFER_CLASSES; class++) {
+		if (size <= ((uint64_t)1 << (class + BUFFER_MIN_SHIFT)))
+			return class;
+	}
+
+	return -1;
+}
+
+struct sr_buffer_pool *buffer_pool_new(void)
+{
+	struct sr_buffer_pool *pool;
+
+	if (!(pool = g_try_malloc0(sizeof(struct sr_buffer_pool)))) {
+		sr_err("buffer: %s: pool malloc failed", __func__);
+		return NULL;
+	}
+	g_static_mutex_init(&pool->mutex);
+	pool->refcount = 1;
+
+	return pool;
+}
+
+static void buffer_free(struct sr_buffer *buffer)
+{
+	g_free(buffer->data);
+	g_free(buffer);
+}
+
+/*
+ * Drop a reference to the pool. The session does this when it's
+ * destroyed; the pool itself goes once its last buffer is released.
+ */
+void buffer_pool_unref(struct sr_buffer_pool *pool)
+{
+	struct sr_buffer *buffer;
+	int class;
+
+	if (!pool || !g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+
+	for (class = 0; class < BUFFER_CLASSES; class++) {
+		while ((buffer = pool->free[class])) {
+			pool->free[class] = buffer->next;
+			buffer_free(buffer);
+		}
+	}
+	g_static_mutex_free(&pool->mutex);
+	g_free(pool);
+}
+
+/**
+ * Get a buffer of at least size bytes from a session's buffer pool.
+ *
+ * The buffer starts out with one reference, owned by the caller. It can
+ * be sent on the session bus as the buffer of an SR_DF_LOGIC packet, in
+ * which case the session and the datafeed callbacks take their own
+ * references instead of copying the data.
+ *
+ * @param session The session whose pool to use, or NULL for a buffer
+ *                which isn't pooled.
+ * @param size The number of bytes needed.
+ * @return The buffer, or NULL upon errors.
+ */
+struct sr_buffer *sr_buffer_new(struct sr_session *session, uint64_t size)
+{
+	struct sr_buffer_pool *pool;
+	struct sr_buffer *buffer;
+	int class;
+
+	if (size == 0) {
+		sr_err("buffer: %s: size was 0", __func__);
+		return NULL;
+	}
+
+	pool = session ? session->buffer_pool : NULL;
+	class = size_class(size);
+	if (class >= 0)
+		size = (uint64_t)1 << (class + BUFFER_MIN_SHIFT);
+
+	buffer = NULL;
+	if (pool && class >= 0) {
+		g_static_mutex_lock(&pool->mutex);
+		if ((buffer = pool->free[class])) {
+			pool->free[class] = buffer->next;
+			pool->cached -= buffer->size;
+		}
+		g_static_mutex_unlock(&pool->mutex);
+	}
+
+	if (!buffer) {
+		if (!(buffer = g_try_malloc(sizeof(struct sr_buffer)))) {
+			sr_err("buffer: %s: buffer malloc failed", __func__);
+			return NULL;
+		}
+		if (!(buffer->data = g_try_malloc(size))) {
+			sr_err("buffer: %s: data malloc failed", __func__);
+			g_free(buffer);
+			return NULL;
+		}
+		buffer->size = size;
+	}
+
+	buffer->refcount = 1;
+	buffer->next = NULL;
+	buffer->pool = pool;
+	if (pool)
+		g_atomic_int_inc(&pool->refcount);
+
+	return buffer;
+}
+
+/**
+ * Take another reference to a buffer.
+ *
+ * @param buffer The buffer.
+ * @return The buffer, for convenience.
+ */
+struct sr_buffer *sr_buffer_ref(struct sr_buffer *buffer)
+{
+	if (buffer)
+		g_atomic_int_inc(&buffer->refcount);
+
+	return buffer;
+}
+
+/**
+ * Drop a reference to a buffer. Once the last one is gone, the buffer
+ * goes back to its pool.
+ *
+ * @param buffer The buffer.
+ */
+void sr_buffer_unref(struct sr_buffer *buffer)
+{
+	struct sr_buffer_pool *pool;
+	int class;
+
+	if (!buffer || !g_atomic_int_dec_and_test(&buffer->refcount))
+		return;
+
+	if (!(pool = buffer->pool)) {
+		buffer_free(buffer);
+		return;
+	}
+
+	class = size_class(buffer->size);
+	g_static_mutex_lock(&pool->mutex);
+	if (class >= 0 && pool->cached + buffer->size <= BUFFER_POOL_CACHE) {
+		buffer->next = pool->free[class];
+		pool->free[class] = buffer;
+		pool->cached += buffer->size;
+		buffer = NULL;
+	}
+	g_static_mutex_unlock(&pool->mutex);
+
+	if (buffer)
+		buffer_free(buffer);
+	buffer_pool_unref(pool);
+}
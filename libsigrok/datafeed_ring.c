@@ -0,0 +1,507 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Single-producer/single-consumer ring of datafeed packets.
+ *
+ * The producer (the thread running the drivers) copies each packet into
+ * the next free slot, and its payload data into a byte arena, then
+ * publishes the slot by advancing head. The consumer reads slots up to
+ * head, and releases them (and their arena space) by advancing tail.
+ * Neither side takes a lock on this path; the mutex and condition are
+ * only used to sleep while the ring is full or empty.
+ *
+ * The ring counts as congested once it fills up past the high watermark,
+ * and until the consumer drained it below the low one; drivers which can
+ * slow down or drop data on their own terms check this, rather than run
+ * into a full ring and block.
+ */
+
+/* Number of packet slots, one of which is always kept free. */
+#define RING_SLOTS		1024
+/* Size of the payload arena, in bytes. */
+#define RING_ARENA_SIZE		(16 * 1024 * 1024)
+/* Upper bound on any one sleep, so shutdown never hangs on a wakeup. */
+#define RING_WAIT_USEC		10000
+/* Fill levels for datafeed_ring_congested(), in percent. */
+#define RING_HIGH_WATERMARK	75
+#define RING_LOW_WATERMARK	25
+
+struct ring_slot {
+	struct sr_device *device;
+	struct sr_datafeed_packet packet;
+	union {
+		struct sr_datafeed_header header;
+		struct sr_datafeed_logic logic;
+		struct sr_datafeed_overflow overflow;
+	} payload;
+	/* Arena space to give back once consumed, including padding. */
+	gint arena_bytes;
+	/* Payload data too large for the arena. */
+	void *heap_data;
+	/* Reference to the sender's buffer, if the data is in one. */
+	struct sr_buffer *buffer;
+};
+
+/*
+ * What a thread sleeps on while waiting for a ring. Several rings can
+ * share one, so a consumer can sleep until any of them has a packet.
+ */
+struct ring_waiter {
+	GMutex *mutex;
+	GCond *cond;
+	volatile gint waiting;
+	/* Number of rings using this waiter. */
+	gint users;
+};
+
+struct sr_datafeed_ring {
+	struct ring_slot slots[RING_SLOTS];
+	/* Next slot to fill (written by the producer only). */
+	volatile gint head;
+	/* Next slot to consume (written by the consumer only). */
+	volatile gint tail;
+	uint8_t *arena;
+	/* Next free arena byte (producer only). */
+	gint arena_pos;
+	volatile gint arena_used;
+	volatile gint closed;
+	/* Set once the consumer found the ring closed and empty. */
+	volatile gint drained;
+	volatile gint congested;
+	struct ring_waiter *waiter;
+};
+
+static gboolean ring_empty(struct sr_datafeed_ring *ring);
+
+/*
+ * Create a ring. If share is not NULL, the new ring wakes up the same
+ * sleepers as share, so datafeed_ring_pop_any() can be used on them.
+ */
+struct sr_datafeed_ring *datafeed_ring_new(struct sr_datafeed_ring *share)
+{
+	struct sr_datafeed_ring *ring;
+
+	if (!(ring = g_try_malloc0(sizeof(struct sr_datafeed_ring)))) {
+		sr_err("ring: %s: ring malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(ring->arena = pool_alloc(RING_ARENA_SIZE))) {
+		sr_err("ring: %s: arena malloc failed", __func__);
+		g_free(ring);
+		return NULL;
+	}
+
+	if (share) {
+		ring->waiter = share->waiter;
+	} else {
+		if (!(ring->waiter = g_try_malloc0(sizeof(struct ring_waiter)))) {
+			sr_err("ring: %s: waiter malloc failed", __func__);
+			pool_free(ring->arena);
+			g_free(ring);
+			return NULL;
+		}
+		ring->waiter->mutex = g_mutex_new();
+		ring->waiter->cond = g_cond_new();
+	}
+	ring->waiter->users++;
+
+	return ring;
+}
+
+void datafeed_ring_destroy(struct sr_datafeed_ring *ring)
+{
+	if (!ring)
+		return;
+
+	/* Packets pushed after the consumer was gone. */
+	while (!ring_empty(ring))
+		datafeed_ring_release(ring);
+
+	if (--ring->waiter->users == 0) {
+		g_mutex_free(ring->waiter->mutex);
+		g_cond_free(ring->waiter->cond);
+		g_free(ring->waiter);
+	}
+	pool_free(ring->arena);
+	g_free(ring);
+}
+
+static gboolean ring_empty(struct sr_datafeed_ring *ring)
+{
+	return g_atomic_int_get(&ring->tail) == g_atomic_int_get(&ring->head);
+}
+
+static gboolean ring_full(struct sr_datafeed_ring *ring)
+{
+	return (g_atomic_int_get(&ring->head) + 1) % RING_SLOTS
+		== g_atomic_int_get(&ring->tail);
+}
+
+/* Whether a push can go ahead, or has to give up on a closed ring. */
+static gboolean ring_writable(struct sr_datafeed_ring *ring)
+{
+	return !ring_full(ring) || g_atomic_int_get(&ring->closed);
+}
+
+/* Whether the consumer is done with all packets, or won't read any more. */
+static gboolean ring_consumed(struct sr_datafeed_ring *ring)
+{
+	return ring_empty(ring) || g_atomic_int_get(&ring->drained);
+}
+
+/* How full the slots or the arena are, whichever is fuller, in percent. */
+static int ring_level(struct sr_datafeed_ring *ring)
+{
+	int slots, arena;
+
+	slots = datafeed_ring_depth(ring) * 100 / RING_SLOTS;
+	arena = (int)((int64_t)g_atomic_int_get(&ring->arena_used) * 100
+		      / RING_ARENA_SIZE);
+
+	return MAX(slots, arena);
+}
+
+static gboolean ring_readable(struct sr_datafeed_ring *ring)
+{
+	return !ring_empty(ring) || g_atomic_int_get(&ring->closed);
+}
+
+/*
+ * Sleep until ready() returns TRUE. The waiting count is raised before
+ * ready() is checked again under the mutex, so a wakeup from the other
+ * side can't get lost in between.
+ */
+static void waiter_wait(struct ring_waiter *w,
+			gboolean (*ready)(void *data), void *data)
+{
+	GTimeVal timeout;
+
+	while (!ready(data)) {
+		g_mutex_lock(w->mutex);
+		g_atomic_int_inc(&w->waiting);
+		if (!ready(data)) {
+			g_get_current_time(&timeout);
+			g_time_val_add(&timeout, RING_WAIT_USEC);
+			g_cond_timed_wait(w->cond, w->mutex, &timeout);
+		}
+		g_atomic_int_add(&w->waiting, -1);
+		g_mutex_unlock(w->mutex);
+	}
+}
+
+static void ring_wait(struct sr_datafeed_ring *ring,
+		      gboolean (*ready)(struct sr_datafeed_ring *ring))
+{
+	waiter_wait(ring->waiter, (gboolean (*)(void *))ready, ring);
+}
+
+static void ring_wake(struct sr_datafeed_ring *ring)
+{
+	struct ring_waiter *w;
+
+	w = ring->waiter;
+	if (!g_atomic_int_get(&w->waiting))
+		return;
+
+	g_mutex_lock(w->mutex);
+	g_cond_broadcast(w->cond);
+	g_mutex_unlock(w->mutex);
+}
+
+/* Reserve contiguous arena space, or return NULL if there isn't any. */
+static void *arena_alloc(struct sr_datafeed_ring *ring, gint size,
+			 gint *reserved)
+{
+	gint pad, avail;
+	void *data;
+
+	pad = 0;
+	if (ring->arena_pos + size > RING_ARENA_SIZE)
+		/* Skip the end of the arena, it's too small. */
+		pad = RING_ARENA_SIZE - ring->arena_pos;
+
+	avail = RING_ARENA_SIZE - g_atomic_int_get(&ring->arena_used);
+	if (pad + size > avail)
+		return NULL;
+
+	data = ring->arena + (pad ? 0 : ring->arena_pos);
+	ring->arena_pos = (pad ? 0 : ring->arena_pos) + size;
+	*reserved = pad + size;
+	g_atomic_int_add(&ring->arena_used, *reserved);
+
+	return data;
+}
+
+/* Copy logic data into the arena, or the pool if it's too large. */
+static int logic_copy(struct sr_datafeed_ring *ring, struct ring_slot *slot,
+		      struct sr_datafeed_logic *logic)
+{
+	void *data;
+
+	data = NULL;
+	if (logic->length < RING_ARENA_SIZE / 4)
+		data = arena_alloc(ring, logic->length, &slot->arena_bytes);
+	if (!data) {
+		if (!(data = pool_alloc(logic->length))) {
+			sr_err("ring: %s: data malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		slot->heap_data = data;
+	}
+	memcpy(data, logic->data, logic->length);
+	slot->payload.logic.data = data;
+
+	return SR_OK;
+}
+
+/**
+ * Queue a packet for the consumer. The packet and its payload are copied,
+ * so the caller may reuse them as soon as this returns. This blocks while
+ * the ring is full. Logic data in an sr_buffer isn't copied; the ring
+ * takes a reference to the buffer instead.
+ *
+ * Only SR_DF_HEADER, SR_DF_LOGIC and SR_DF_OVERFLOW payloads can be
+ * copied. Any other
+ * packet with a payload is handed over synchronously: this waits until
+ * the consumer is done with it.
+ *
+ * Once the ring is closed, packets are dropped and this returns SR_ERR,
+ * rather than wait for a consumer which may be gone already.
+ */
+int datafeed_ring_push(struct sr_datafeed_ring *ring,
+		       struct sr_device *device,
+		       struct sr_datafeed_packet *packet)
+{
+	struct ring_slot *slot;
+	struct sr_datafeed_logic *logic;
+	gboolean sync;
+	gint head;
+
+	if (ring_full(ring)) {
+		sr_trace(SR_TRACE_QUEUE_WAIT, SR_TRACE_BEGIN, 0);
+		ring_wait(ring, ring_writable);
+		sr_trace(SR_TRACE_QUEUE_WAIT, SR_TRACE_END, 0);
+	}
+	if (g_atomic_int_get(&ring->closed)) {
+		sr_err("ring: %s: ring closed, packet dropped", __func__);
+		return SR_ERR;
+	}
+
+	head = g_atomic_int_get(&ring->head);
+	slot = &ring->slots[head];
+	slot->device = device;
+	slot->packet = *packet;
+	slot->arena_bytes = 0;
+	slot->heap_data = NULL;
+	slot->buffer = NULL;
+	sync = FALSE;
+
+	if (packet->type == SR_DF_HEADER && packet->payload) {
+		slot->payload.header = *(struct sr_datafeed_header *)
+				       packet->payload;
+		slot->packet.payload = &slot->payload.header;
+	} else if (packet->type == SR_DF_OVERFLOW && packet->payload) {
+		slot->payload.overflow = *(struct sr_datafeed_overflow *)
+					 packet->payload;
+		slot->packet.payload = &slot->payload.overflow;
+	} else if (packet->type == SR_DF_LOGIC) {
+		logic = packet->payload;
+		slot->payload.logic = *logic;
+		slot->packet.payload = &slot->payload.logic;
+		if (logic->buffer)
+			/* No copy, the data stays in the sender's buffer. */
+			slot->buffer = sr_buffer_ref(logic->buffer);
+		else if (logic_copy(ring, slot, logic) != SR_OK)
+			return SR_ERR_MALLOC;
+	} else if (packet->payload) {
+		sync = TRUE;
+	}
+
+	g_atomic_int_set(&ring->head, (head + 1) % RING_SLOTS);
+	if (ring_level(ring) >= RING_HIGH_WATERMARK)
+		g_atomic_int_set(&ring->congested, TRUE);
+	ring_wake(ring);
+
+	if (sync) {
+		ring_wait(ring, ring_consumed);
+		if (!ring_empty(ring))
+			return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get the next packet from the ring, waiting for one if needed. The
+ * device it was sent for is stored in *device.
+ *
+ * @return The packet, or NULL if the ring was closed and is empty. The
+ *         packet stays valid until datafeed_ring_release() is called.
+ */
+struct sr_datafeed_packet *datafeed_ring_pop(struct sr_datafeed_ring *ring,
+					     struct sr_device **device)
+{
+	struct ring_slot *slot;
+
+	ring_wait(ring, ring_readable);
+	if (ring_empty(ring)) {
+		g_atomic_int_set(&ring->drained, TRUE);
+		ring_wake(ring);
+		return NULL;
+	}
+
+	slot = &ring->slots[g_atomic_int_get(&ring->tail)];
+	*device = slot->device;
+
+	return &slot->packet;
+}
+
+struct ring_set {
+	struct sr_datafeed_ring **rings;
+	int num_rings;
+};
+
+static gboolean set_readable(void *data)
+{
+	struct ring_set *set;
+	int i;
+
+	set = data;
+	for (i = 0; i < set->num_rings; i++) {
+		if (!ring_empty(set->rings[i])
+		    || !g_atomic_int_get(&set->rings[i]->closed))
+			break;
+	}
+	if (i == set->num_rings)
+		/* All closed and empty. */
+		return TRUE;
+
+	for (i = 0; i < set->num_rings; i++) {
+		if (!ring_empty(set->rings[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Get the next packet from any of the given rings, which must share their
+ * waiter (see datafeed_ring_new()). The rings are taken in turn, starting
+ * after the one in *index; the ring the packet came from is stored there.
+ *
+ * @return The packet, or NULL if all rings were closed and are empty.
+ *         The packet stays valid until datafeed_ring_release() is called
+ *         on its ring.
+ */
+struct sr_datafeed_packet *datafeed_ring_pop_any(
+		struct sr_datafeed_ring **rings, int num_rings,
+		struct sr_device **device, int *index)
+{
+	struct ring_set set;
+	int i, r;
+
+	if (num_rings == 0)
+		return NULL;
+
+	set.rings = rings;
+	set.num_rings = num_rings;
+	waiter_wait(rings[0]->waiter, set_readable, &set);
+
+	for (i = 1; i <= num_rings; i++) {
+		r = (*index + i) % num_rings;
+		if (!ring_empty(rings[r])) {
+			*index = r;
+			return datafeed_ring_pop(rings[r], device);
+		}
+	}
+	for (r = 0; r < num_rings; r++)
+		g_atomic_int_set(&rings[r]->drained, TRUE);
+	ring_wake(rings[0]);
+
+	return NULL;
+}
+
+/* Release the packet returned by the last datafeed_ring_pop(). */
+void datafeed_ring_release(struct sr_datafeed_ring *ring)
+{
+	struct ring_slot *slot;
+	gint tail;
+
+	tail = g_atomic_int_get(&ring->tail);
+	slot = &ring->slots[tail];
+	pool_free(slot->heap_data);
+	slot->heap_data = NULL;
+	sr_buffer_unref(slot->buffer);
+	slot->buffer = NULL;
+	g_atomic_int_add(&ring->arena_used, -slot->arena_bytes);
+
+	g_atomic_int_set(&ring->tail, (tail + 1) % RING_SLOTS);
+	ring_wake(ring);
+}
+
+/* Make datafeed_ring_pop() return NULL once the ring runs empty. */
+void datafeed_ring_close(struct sr_datafeed_ring *ring)
+{
+	g_atomic_int_set(&ring->closed, TRUE);
+	ring_wake(ring);
+}
+
+/*
+ * Whether the consumer is falling behind: TRUE from when the ring filled
+ * past the high watermark until it drained below the low watermark.
+ * This may be called from any thread.
+ */
+gboolean datafeed_ring_congested(struct sr_datafeed_ring *ring)
+{
+	if (!g_atomic_int_get(&ring->congested))
+		return FALSE;
+	if (ring_level(ring) > RING_LOW_WATERMARK)
+		return TRUE;
+
+	g_atomic_int_compare_and_exchange(&ring->congested, TRUE, FALSE);
+
+	return FALSE;
+}
+
+/* The number of packets in the ring. This may be called from any thread. */
+int datafeed_ring_depth(struct sr_datafeed_ring *ring)
+{
+	int used;
+
+	used = g_atomic_int_get(&ring->head) - g_atomic_int_get(&ring->tail);
+	if (used < 0)
+		used += RING_SLOTS;
+
+	return used;
+}
+
+/* Whether datafeed_ring_push() would block right now. */
+gboolean datafeed_ring_full(struct sr_datafeed_ring *ring)
+{
+	return ring_full(ring);
+}
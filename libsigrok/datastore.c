@@ -16,15 +16,90 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
+#include "config.h"
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <glib.h>
 #include <sigrok.h>
 #include <sigrok-internal.h>
 
-static gpointer new_chunk(struct sr_datastore **ds);
+/*
+ * Datastores start out with their chunks in memory. Once a datastore
+ * holds more than memory_limit bytes, all of its chunks are moved into
+ * an (unlinked, sparse) temporary file, and from then on chunks are
+ * mmap()ed on demand, keeping at most mmap_budget bytes mapped.
+ */
+static uint64_t memory_limit = DATASTORE_MEMORY_LIMIT;
+static uint64_t mmap_budget = DATASTORE_MMAP_BUDGET;
+
+/*
+ * A bit-plane encoded chunk holds the same number of units as a raw chunk,
+ * in the same number of bytes: one plane of DATASTORE_CHUNKSIZE bits per
+ * probe, plane after plane. Unit n of the chunk is bit (n % 8) of byte
+ * (n / 8) of each plane.
+ */
+#define PLANE_BYTES (DATASTORE_CHUNKSIZE / 8)
+
+/*
+ * An RLE-encoded chunk holds the same number of units as a raw chunk,
+ * stored as runs of (unit value, uint32_t end) entries, where end is the
+ * position within the chunk of the first unit after the run. Runs are
+ * thus sorted by end, so the run holding any unit can be binary searched.
+ */
+struct rle_chunk {
+	uint8_t *runs;
+	uint64_t num_runs;
+	uint64_t runs_alloc;
+};
+
+static gpointer new_chunk(struct sr_datastore *ds);
+static uint8_t *get_chunk(struct sr_datastore *ds, guint index);
+static int raw_put(struct sr_datastore *ds, const uint8_t *src,
+		   uint64_t length);
+static int rle_put(struct sr_datastore *ds, const uint8_t *src,
+		   uint64_t length);
+static int rle_get(struct sr_datastore *ds, struct sr_datastore_iter *iter,
+		   uint64_t start_unit, uint64_t count, uint8_t *dst);
+static int bitplane_put(struct sr_datastore *ds, const uint8_t *src,
+			uint64_t length);
+static int bitplane_get(struct sr_datastore *ds, uint64_t start_unit,
+			uint64_t count, uint8_t *dst);
+
+/**
+ * Set the amount of memory a datastore may use before spilling to disk.
+ *
+ * This only affects datastores which haven't spilled yet. On platforms
+ * without mmap() support datastores always stay in memory.
+ *
+ * @param limit The limit in bytes, or 0 to never spill to disk.
+ * @return SR_OK upon success.
+ */
+int sr_datastore_set_memory_limit(uint64_t limit)
+{
+	memory_limit = limit;
+
+	return SR_OK;
+}
+
+/**
+ * Set the resident-memory budget of disk-backed datastores.
+ *
+ * @param budget The maximum number of bytes each disk-backed datastore
+ *               keeps mapped at any one time. At least two chunks are
+ *               always mapped, regardless of this setting.
+ * @return SR_OK upon success.
+ */
+int sr_datastore_set_mmap_budget(uint64_t budget)
+{
+	mmap_budget = budget;
+
+	return SR_OK;
+}
 
 int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 {
@@ -41,76 +116,1027 @@ int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 
 	(*ds)->ds_unitsize = unitsize;
 	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	(*ds)->chunk_bytes = (uint64_t)DATASTORE_CHUNKSIZE * unitsize;
+	(*ds)->tail = NULL;
+	(*ds)->tail_used = 0;
+	(*ds)->fd = -1;
+	(*ds)->chunk_stride = (*ds)->chunk_bytes;
+	(*ds)->spill_failed = FALSE;
+	(*ds)->mapped = NULL;
+	(*ds)->encoding = SR_DS_ENCODING_RAW;
+	(*ds)->summary = NULL;
+
+	if (!((*ds)->chunks = g_ptr_array_new())) {
+		sr_err("ds: %s: chunk array malloc failed", __func__);
+		g_free(*ds);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Select how a datastore encodes the data stored in it.
+ *
+ * With SR_DS_ENCODING_RLE, each chunk stores runs of identical units
+ * instead of every unit. This saves a lot of memory on mostly idle
+ * captures, at the cost of slower random access. RLE-encoded datastores
+ * always stay in memory.
+ *
+ * With SR_DS_ENCODING_BITPLANE, each chunk stores the samples of every
+ * probe separately, so the samples of one probe can be read without
+ * touching those of the others (see sr_datastore_iter_next_plane() and
+ * sr_datastore_get_probe()). Reading whole units is slower instead.
+ *
+ * @param ds The datastore. It must still be empty.
+ * @param encoding SR_DS_ENCODING_RAW, SR_DS_ENCODING_RLE or
+ *                 SR_DS_ENCODING_BITPLANE.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if
+ *         the datastore already holds data.
+ */
+int sr_datastore_set_encoding(struct sr_datastore *ds, int encoding)
+{
+	if (!ds || ds->chunks->len)
+		return SR_ERR_ARG;
+
+	if (encoding != SR_DS_ENCODING_RAW && encoding != SR_DS_ENCODING_RLE
+	    && encoding != SR_DS_ENCODING_BITPLANE)
+		return SR_ERR_ARG;
+
+	ds->encoding = encoding;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable the summary of a datastore.
+ *
+ * The summary is a pyramid of per-probe states and edge counts, which
+ * sr_datastore_summary() and sr_datastore_find_edge() use to look at
+ * large ranges without reading every unit in them. It costs extra work
+ * on every sr_datastore_put(), and about 50% of the stored data size in
+ * memory for 8-probe units (less for wider ones), which is never spilled
+ * to disk. Without it, both functions read the units instead.
+ *
+ * The summary is disabled by default.
+ *
+ * @param ds The datastore. It must still be empty.
+ * @param enable TRUE to enable the summary, FALSE to disable it.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, if the
+ *         datastore already holds data, or if its units are wider than
+ *         64 probes, SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_datastore_set_summary(struct sr_datastore *ds, int enable)
+{
+	if (!ds || ds->chunks->len)
+		return SR_ERR_ARG;
+
+	if (!enable) {
+		ds_summary_destroy(ds->summary);
+		ds->summary = NULL;
+		return SR_OK;
+	}
+
+	/* The per-probe masks are 64 bits wide. */
+	if (ds->ds_unitsize > 8)
+		return SR_ERR_ARG;
+
+	if (!ds->summary && !(ds->summary = ds_summary_new(ds->ds_unitsize)))
+		return SR_ERR_MALLOC;
 
 	return SR_OK;
 }
 
 int sr_datastore_destroy(struct sr_datastore *ds)
 {
-	GSList *chunk;
+	struct rle_chunk *rc;
+	gpointer chunk;
+	guint i;
 
 	if (!ds)
 		return SR_ERR;
 
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+	for (i = 0; i < ds->chunks->len; i++) {
+		chunk = g_ptr_array_index(ds->chunks, i);
+		if (ds->encoding == SR_DS_ENCODING_RLE) {
+			rc = chunk;
+			g_free(rc->runs);
+			g_free(rc);
+			continue;
+		}
+#ifdef HAVE_SYS_MMAN_H
+		if (ds->fd != -1) {
+			if (chunk)
+				munmap(chunk, ds->chunk_bytes);
+			continue;
+		}
+#endif
+		pool_free(chunk);
+	}
+	g_ptr_array_free(ds->chunks, TRUE);
+	ds_summary_destroy(ds->summary);
+	if (ds->mapped)
+		g_ptr_array_free(ds->mapped, TRUE);
+	if (ds->fd != -1)
+		close(ds->fd);
 	g_free(ds);
 
 	return SR_OK;
 }
 
-void sr_datastore_put(struct sr_datastore *ds, void *data, unsigned int length,
-		      int in_unitsize, int *probelist)
+/**
+ * Append data to a datastore.
+ *
+ * The data is copied into the datastore's chunks; a new chunk is only
+ * allocated once the current (tail) chunk is full, so appending is O(1)
+ * regardless of how much data is already stored. The datastore's summary,
+ * if enabled (see sr_datastore_set_summary()), is updated along the way.
+ *
+ * @param ds The datastore to append to.
+ * @param data The data to append.
+ * @param length The length of the data, in bytes.
+ * @param in_unitsize Unused.
+ * @param probelist Unused.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_datastore_put(struct sr_datastore *ds, const void *data,
+		     uint64_t length, int in_unitsize, int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
-	gpointer chunk;
+	int ret;
 
 	/* Avoid compiler warnings. */
 	in_unitsize = in_unitsize;
 	probelist = probelist;
 
-	if (ds->chunklist == NULL)
-		chunk = new_chunk(&ds);
+	if (!ds || !data)
+		return SR_ERR_ARG;
+
+	if (length == 0)
+		return SR_OK;
+
+	sr_trace(SR_TRACE_DATASTORE, SR_TRACE_BEGIN, length);
+
+	if (ds->encoding == SR_DS_ENCODING_RLE)
+		ret = rle_put(ds, data, length);
+	else if (ds->encoding == SR_DS_ENCODING_BITPLANE)
+		ret = bitplane_put(ds, data, length);
 	else
-		chunk = g_slist_last(ds->chunklist)->data;
+		ret = raw_put(ds, data, length);
 
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
-	stored = 0;
-	while (stored < length) {
-		if (chunk_bytes_free == 0) {
-			chunk = new_chunk(&ds);
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
-			chunk_offset = 0;
+	if (ret == SR_OK && ds->summary)
+		ds_summary_append(ds->summary, ds->ds_unitsize, data,
+				  length / ds->ds_unitsize);
+
+	sr_trace(SR_TRACE_DATASTORE, SR_TRACE_END, length);
+
+	return ret;
+}
+
+/**
+ * Copy a range of units out of a datastore.
+ *
+ * @param ds The datastore to read from.
+ * @param start_unit The first unit to copy.
+ * @param count The number of units to copy.
+ * @param data Buffer of at least count * ds_unitsize bytes to copy into.
+ * @return SR_OK upon success, SR_ERR_ARG if the range is not entirely
+ *         within the datastore, SR_ERR if a chunk could not be mapped.
+ */
+int sr_datastore_get(struct sr_datastore *ds, uint64_t start_unit,
+		     uint64_t count, void *data)
+{
+	struct sr_datastore_iter iter;
+	uint8_t *dst, *chunk;
+	uint64_t offset, end, chunk_offset, size;
+	guint chunk_index;
+
+	if (!ds || !data)
+		return SR_ERR_ARG;
+
+	if (start_unit > ds->num_units || count > ds->num_units - start_unit)
+		return SR_ERR_ARG;
+
+	if (ds->encoding == SR_DS_ENCODING_RLE) {
+		sr_datastore_iter_begin(ds, start_unit, &iter);
+		return rle_get(ds, &iter, start_unit, count, data);
+	}
+	if (ds->encoding == SR_DS_ENCODING_BITPLANE)
+		return bitplane_get(ds, start_unit, count, data);
+
+	dst = data;
+	offset = start_unit * ds->ds_unitsize;
+	end = offset + count * ds->ds_unitsize;
+	while (offset < end) {
+		chunk_index = offset / ds->chunk_bytes;
+		chunk_offset = offset % ds->chunk_bytes;
+		size = MIN(end - offset, ds->chunk_bytes - chunk_offset);
+		if (!(chunk = get_chunk(ds, chunk_index)))
+			return SR_ERR;
+		memcpy(dst, chunk + chunk_offset, size);
+		dst += size;
+		offset += size;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Start walking over the data stored in a datastore.
+ *
+ * The stored data is handed out by sr_datastore_iter_next() in spans of
+ * at most one chunk, pointing directly into the datastore's chunks where
+ * possible, so even very large datastores can be walked without copying
+ * them. Once done, the iterator must be released with
+ * sr_datastore_iter_end().
+ *
+ * @param ds The datastore to walk over.
+ * @param start_unit The unit to start at.
+ * @param iter The iterator to initialize.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_datastore_iter_begin(struct sr_datastore *ds, uint64_t start_unit,
+			    struct sr_datastore_iter *iter)
+{
+	if (!ds || !iter || start_unit > ds->num_units)
+		return SR_ERR_ARG;
+
+	iter->ds = ds;
+	iter->unit = start_unit;
+	iter->scratch = NULL;
+	iter->cursor_chunk = 0;
+	iter->cursor_run = 0;
+
+	return SR_OK;
+}
+
+/**
+ * Get the next span of stored data.
+ *
+ * The span stays valid until the next call on this iterator, or until the
+ * datastore is modified or read from in any other way. Data appended to
+ * the datastore while walking over it will be returned as well.
+ *
+ * @param iter The iterator.
+ * @param data Set to the first byte of the span.
+ * @param length Set to the length of the span in bytes, or 0 once all
+ *               stored data has been returned.
+ * @param first_unit If not NULL, set to the number of the span's first unit.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR if a chunk
+ *         could not be mapped.
+ */
+int sr_datastore_iter_next(struct sr_datastore_iter *iter, const void **data,
+			   uint64_t *length, uint64_t *first_unit)
+{
+	struct sr_datastore *ds;
+	uint64_t count;
+	uint8_t *chunk;
+	int ret;
+
+	if (!iter || !iter->ds || !data || !length)
+		return SR_ERR_ARG;
+
+	ds = iter->ds;
+	if (first_unit)
+		*first_unit = iter->unit;
+	count = MIN(ds->num_units - iter->unit,
+		    DATASTORE_CHUNKSIZE - iter->unit % DATASTORE_CHUNKSIZE);
+	if (count == 0) {
+		*data = NULL;
+		*length = 0;
+		return SR_OK;
+	}
+
+	if (ds->encoding != SR_DS_ENCODING_RAW) {
+		/* Decode one chunk's worth into the iterator's buffer. */
+		if (!iter->scratch
+		    && !(iter->scratch = pool_alloc(ds->chunk_bytes))) {
+			sr_err("ds: %s: scratch malloc failed", __func__);
+			return SR_ERR_MALLOC;
 		}
+		if (ds->encoding == SR_DS_ENCODING_RLE)
+			ret = rle_get(ds, iter, iter->unit, count,
+				      iter->scratch);
+		else
+			ret = sr_datastore_get(ds, iter->unit, count,
+					       iter->scratch);
+		if (ret != SR_OK)
+			return ret;
+		*data = iter->scratch;
+	} else {
+		if (!(chunk = get_chunk(ds, iter->unit / DATASTORE_CHUNKSIZE)))
+			return SR_ERR;
+		*data = chunk + (iter->unit % DATASTORE_CHUNKSIZE)
+			* ds->ds_unitsize;
+	}
+	*length = count * ds->ds_unitsize;
+	iter->unit += count;
+
+	return SR_OK;
+}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
-			size = chunk_bytes_free;
+/*
+ * Copy n bits from src, starting at bit src_bit, to dst starting at bit
+ * dst_bit. Bits are numbered from the least significant bit of the
+ * first byte on.
+ */
+static void copy_bits(uint8_t *dst, uint64_t dst_bit, const uint8_t *src,
+		      uint64_t src_bit, uint64_t n)
+{
+	uint64_t i, shift;
+	uint8_t *d;
+	const uint8_t *s;
+
+	/* Single bits until dst is byte-aligned. */
+	for (; n > 0 && dst_bit % 8; n--, dst_bit++, src_bit++) {
+		if (src[src_bit / 8] & (1 << (src_bit % 8)))
+			dst[dst_bit / 8] |= 1 << (dst_bit % 8);
 		else
-			/* Last part, won't fill up this chunk. */
-			size = length - stored;
+			dst[dst_bit / 8] &= ~(1 << (dst_bit % 8));
+	}
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
-		stored += size;
+	/* Whole bytes, shifted into place if src isn't aligned. */
+	d = dst + dst_bit / 8;
+	s = src + src_bit / 8;
+	shift = src_bit % 8;
+	if (shift == 0) {
+		memcpy(d, s, n / 8);
+	} else {
+		for (i = 0; i < n / 8; i++)
+			d[i] = (s[i] >> shift) | (s[i + 1] << (8 - shift));
+	}
+	dst_bit += n / 8 * 8;
+	src_bit += n / 8 * 8;
+
+	for (n %= 8; n > 0; n--, dst_bit++, src_bit++) {
+		if (src[src_bit / 8] & (1 << (src_bit % 8)))
+			dst[dst_bit / 8] |= 1 << (dst_bit % 8);
+		else
+			dst[dst_bit / 8] &= ~(1 << (dst_bit % 8));
+	}
+}
+
+/**
+ * Get the next span of stored samples of one probe.
+ *
+ * The samples are returned as a bit-plane: the span's first sample is
+ * bit (first_unit % 8) of the first byte, and every following sample is
+ * in the next more significant bit, continuing with bit 0 of the next
+ * byte. With SR_DS_ENCODING_BITPLANE datastores the span points directly
+ * into the datastore's chunks, so walking over one probe only reads that
+ * probe's samples. Other datastores are decoded into the iterator's
+ * buffer. The span stays valid as described in sr_datastore_iter_next().
+ *
+ * @param iter The iterator.
+ * @param probe The probe, as bit number (starting at 0) within a unit.
+ * @param data Set to the byte holding the span's first sample.
+ * @param num_units Set to the number of samples in the span, or 0 once
+ *                  all stored data has been returned.
+ * @param first_unit If not NULL, set to the number of the span's first unit.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR if a chunk
+ *         could not be mapped.
+ */
+int sr_datastore_iter_next_plane(struct sr_datastore_iter *iter, int probe,
+				 const void **data, uint64_t *num_units,
+				 uint64_t *first_unit)
+{
+	struct sr_datastore *ds;
+	const uint8_t *units;
+	uint64_t count, offset, length, i;
+	uint8_t *chunk, *plane;
+	int ret;
+
+	if (!iter || !iter->ds || !data || !num_units)
+		return SR_ERR_ARG;
+
+	ds = iter->ds;
+	if (probe < 0 || probe >= ds->ds_unitsize * 8)
+		return SR_ERR_ARG;
+
+	if (ds->encoding == SR_DS_ENCODING_BITPLANE) {
+		if (first_unit)
+			*first_unit = iter->unit;
+		offset = iter->unit % DATASTORE_CHUNKSIZE;
+		count = MIN(ds->num_units - iter->unit,
+			    DATASTORE_CHUNKSIZE - offset);
+		if (count == 0) {
+			*data = NULL;
+			*num_units = 0;
+			return SR_OK;
+		}
+		if (!(chunk = get_chunk(ds, iter->unit / DATASTORE_CHUNKSIZE)))
+			return SR_ERR;
+		*data = chunk + (uint64_t)probe * PLANE_BYTES + offset / 8;
+		*num_units = count;
+		iter->unit += count;
+
+		return SR_OK;
+	}
+
+	/*
+	 * Extract the probe's samples from the decoded units. This can be
+	 * done in place: the plane takes 1/(8 * unitsize) of the room the
+	 * units took, so writing it never overtakes reading them.
+	 */
+	offset = iter->unit % 8;
+	if ((ret = sr_datastore_iter_next(iter, (const void **)&units,
+					  &length, first_unit)) != SR_OK)
+		return ret;
+	count = length / ds->ds_unitsize;
+	if (count == 0) {
+		*data = NULL;
+		*num_units = 0;
+		return SR_OK;
+	}
+	if (units != iter->scratch) {
+		/* Raw datastore: don't touch the chunk itself. */
+		if (!iter->scratch
+		    && !(iter->scratch = pool_alloc(ds->chunk_bytes))) {
+			sr_err("ds: %s: scratch malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+	}
+	plane = iter->scratch;
+	units += probe / 8;
+	for (i = 0; i < count; i++, units += ds->ds_unitsize) {
+		if (*units & (1 << (probe % 8)))
+			plane[(i + offset) / 8] |= 1 << ((i + offset) % 8);
+		else
+			plane[(i + offset) / 8] &= ~(1 << ((i + offset) % 8));
+	}
+	*data = plane;
+	*num_units = count;
+
+	return SR_OK;
+}
+
+/**
+ * Copy the samples of one probe out of a datastore, as a bit-plane.
+ *
+ * Sample n of the range is stored in bit (n % 8) of byte (n / 8) of the
+ * buffer. With SR_DS_ENCODING_BITPLANE datastores, only the probe's own
+ * samples are read.
+ *
+ * @param ds The datastore to read from.
+ * @param probe The probe, as bit number (starting at 0) within a unit.
+ * @param start_unit The first unit to copy.
+ * @param count The number of units to copy.
+ * @param bits Buffer of at least (count + 7) / 8 bytes to copy into.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if the
+ *         range is not entirely within the datastore, SR_ERR_MALLOC upon
+ *         memory allocation errors, SR_ERR if a chunk could not be mapped.
+ */
+int sr_datastore_get_probe(struct sr_datastore *ds, int probe,
+			   uint64_t start_unit, uint64_t count, void *bits)
+{
+	struct sr_datastore_iter iter;
+	const void *plane;
+	uint64_t done, n, first;
+	int ret;
+
+	if (!ds || !bits || probe < 0 || probe >= ds->ds_unitsize * 8)
+		return SR_ERR_ARG;
+
+	if (start_unit > ds->num_units || count > ds->num_units - start_unit)
+		return SR_ERR_ARG;
+
+	if ((ret = sr_datastore_iter_begin(ds, start_unit, &iter)) != SR_OK)
+		return ret;
+
+	for (done = 0; done < count; done += n) {
+		ret = sr_datastore_iter_next_plane(&iter, probe, &plane, &n,
+						   &first);
+		if (ret != SR_OK)
+			break;
+		n = MIN(n, count - done);
+		copy_bits(bits, done, plane, first % 8, n);
+	}
+	sr_datastore_iter_end(&iter);
+
+	return ret;
+}
+
+/**
+ * Release the resources held by a datastore iterator.
+ *
+ * @param iter The iterator.
+ */
+void sr_datastore_iter_end(struct sr_datastore_iter *iter)
+{
+	if (!iter)
+		return;
+
+	pool_free(iter->scratch);
+	iter->scratch = NULL;
+	iter->ds = NULL;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static uint8_t *map_chunk(struct sr_datastore *ds, guint index)
+{
+	gpointer chunk, old;
+	guint max_mapped, old_index;
+
+	/* Unmap the least recently mapped chunk if we're over budget. */
+	max_mapped = MAX(mmap_budget / ds->chunk_bytes, 2);
+	if (ds->mapped->len >= max_mapped) {
+		old_index = GPOINTER_TO_UINT(g_ptr_array_index(ds->mapped, 0));
+		if (old_index == ds->chunks->len - 1 && ds->mapped->len > 1) {
+			/* Never unmap the tail, it's still being written. */
+			old_index = GPOINTER_TO_UINT(
+				g_ptr_array_index(ds->mapped, 1));
+			g_ptr_array_remove_index(ds->mapped, 1);
+		} else {
+			g_ptr_array_remove_index(ds->mapped, 0);
+		}
+		old = g_ptr_array_index(ds->chunks, old_index);
+		munmap(old, ds->chunk_bytes);
+		g_ptr_array_index(ds->chunks, old_index) = NULL;
+	}
+
+	chunk = mmap(NULL, ds->chunk_bytes, PROT_READ | PROT_WRITE,
+		     MAP_SHARED, ds->fd, (off_t)index * ds->chunk_stride);
+	if (chunk == MAP_FAILED) {
+		sr_err("ds: %s: failed to map chunk %u", __func__, index);
+		return NULL;
 	}
-	ds->num_units += stored / ds->ds_unitsize;
+	g_ptr_array_index(ds->chunks, index) = chunk;
+	g_ptr_array_add(ds->mapped, GUINT_TO_POINTER(index));
+
+	return chunk;
 }
 
-static gpointer new_chunk(struct sr_datastore **ds)
+/*
+ * Move all chunks of an in-memory datastore into a temporary file. The
+ * file is unlinked right away, so it disappears once the datastore is
+ * destroyed (or the process exits). mmap() offsets must be page-aligned,
+ * so chunks are stored chunk_stride bytes apart in the file.
+ */
+static int spill(struct sr_datastore *ds)
 {
+	GError *error;
 	gpointer chunk;
+	char *name;
+	uint64_t written;
+	ssize_t ret;
+	long page_size;
+	guint i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	ds->chunk_stride = (ds->chunk_bytes + page_size - 1)
+			   / page_size * page_size;
+
+	error = NULL;
+	if ((ds->fd = g_file_open_tmp("sigrok-ds-XXXXXX", &name,
+				      &error)) == -1) {
+		sr_err("ds: %s: failed to create temporary file: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		return SR_ERR;
+	}
+	unlink(name);
+	g_free(name);
+
+	if (!(ds->mapped = g_ptr_array_new())) {
+		sr_err("ds: %s: mapped array malloc failed", __func__);
+		goto err;
+	}
+
+	for (i = 0; i < ds->chunks->len; i++) {
+		chunk = g_ptr_array_index(ds->chunks, i);
+		for (written = 0; written < ds->chunk_bytes; written += ret) {
+			ret = pwrite(ds->fd, (uint8_t *)chunk + written,
+				     ds->chunk_bytes - written,
+				     (off_t)i * ds->chunk_stride + written);
+			if (ret <= 0) {
+				sr_err("ds: %s: write to temporary file "
+				       "failed", __func__);
+				goto err;
+			}
+		}
+	}
+
+	for (i = 0; i < ds->chunks->len; i++) {
+		pool_free(g_ptr_array_index(ds->chunks, i));
+		g_ptr_array_index(ds->chunks, i) = NULL;
+	}
+	ds->tail = NULL;
+
+	sr_info("ds: spilled %u chunks to disk", ds->chunks->len);
+
+	return SR_OK;
+
+err:
+	if (ds->mapped) {
+		g_ptr_array_free(ds->mapped, TRUE);
+		ds->mapped = NULL;
+	}
+	close(ds->fd);
+	ds->fd = -1;
+
+	return SR_ERR;
+}
+#endif
+
+static uint8_t *get_chunk(struct sr_datastore *ds, guint index)
+{
+	uint8_t *chunk;
+
+	chunk = g_ptr_array_index(ds->chunks, index);
+#ifdef HAVE_SYS_MMAN_H
+	if (!chunk && ds->fd != -1)
+		chunk = map_chunk(ds, index);
+#endif
+
+	return chunk;
+}
+
+static gpointer new_chunk(struct sr_datastore *ds)
+{
+	gpointer chunk;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->fd == -1 && !ds->spill_failed && memory_limit
+	    && (ds->chunks->len + 1) * ds->chunk_bytes > memory_limit) {
+		/* Don't rewrite all chunks again on every new chunk. */
+		if (spill(ds) != SR_OK) {
+			sr_warn("ds: %s: failed to spill to disk, keeping "
+				"data in memory", __func__);
+			ds->spill_failed = TRUE;
+		}
+	}
 
-	if (!(chunk = malloc(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize)))
+	if (ds->fd != -1) {
+		/* Grow the (sparse) file by one chunk, and map it. */
+		if (ftruncate(ds->fd, (off_t)(ds->chunks->len + 1)
+			      * ds->chunk_stride) == -1) {
+			sr_err("ds: %s: failed to grow temporary file",
+			       __func__);
+			return NULL;
+		}
+		g_ptr_array_add(ds->chunks, NULL);
+		if (!(chunk = map_chunk(ds, ds->chunks->len - 1))) {
+			g_ptr_array_set_size(ds->chunks, ds->chunks->len - 1);
+			return NULL;
+		}
+		ds->tail = chunk;
+		ds->tail_used = 0;
+
+		return chunk;
+	}
+#endif
+
+	if (!(chunk = pool_alloc(ds->chunk_bytes))) {
+		sr_err("ds: %s: chunk malloc failed", __func__);
 		return NULL;
+	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	g_ptr_array_add(ds->chunks, chunk);
+	ds->tail = chunk;
+	ds->tail_used = 0;
 
 	return chunk;
 }
+
+/*
+ * Recount the complete units stored, from the chunks in use and the
+ * bytes stored in the tail chunk. A store without chunks is still empty.
+ */
+static void update_num_units(struct sr_datastore *ds)
+{
+	if (ds->chunks->len == 0)
+		return;
+
+	ds->num_units = ((uint64_t)(ds->chunks->len - 1) * ds->chunk_bytes
+			 + ds->tail_used) / ds->ds_unitsize;
+}
+
+static int raw_put(struct sr_datastore *ds, const uint8_t *src,
+		   uint64_t length)
+{
+	uint64_t stored, size;
+
+	stored = 0;
+	while (stored < length) {
+		if (!ds->tail || ds->tail_used == ds->chunk_bytes) {
+			if (!new_chunk(ds))
+				return SR_ERR_MALLOC;
+		}
+
+		size = MIN(length - stored, ds->chunk_bytes - ds->tail_used);
+		memcpy((uint8_t *)ds->tail + ds->tail_used, src + stored, size);
+		ds->tail_used += size;
+		stored += size;
+	}
+
+	update_num_units(ds);
+
+	return SR_OK;
+}
+
+static struct rle_chunk *new_rle_chunk(struct sr_datastore *ds)
+{
+	struct rle_chunk *rc;
+
+	if (!(rc = g_try_malloc0(sizeof(struct rle_chunk)))) {
+		sr_err("ds: %s: chunk malloc failed", __func__);
+		return NULL;
+	}
+
+	g_ptr_array_add(ds->chunks, rc);
+	ds->tail = rc;
+	ds->tail_used = 0;
+
+	return rc;
+}
+
+static int rle_add_run(struct rle_chunk *rc, const uint8_t *unit,
+		       int unitsize, uint32_t end)
+{
+	uint8_t *runs;
+	uint64_t run_size, size;
+
+	run_size = unitsize + sizeof(uint32_t);
+	if ((rc->num_runs + 1) * run_size > rc->runs_alloc) {
+		size = MAX(rc->runs_alloc * 2, run_size * 64);
+		if (!(runs = g_try_realloc(rc->runs, size))) {
+			sr_err("ds: %s: runs realloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		rc->runs = runs;
+		rc->runs_alloc = size;
+	}
+
+	runs = rc->runs + rc->num_runs * run_size;
+	memcpy(runs, unit, unitsize);
+	memcpy(runs + unitsize, &end, sizeof(uint32_t));
+	rc->num_runs++;
+
+	return SR_OK;
+}
+
+/*
+ * Append units to an RLE-encoded datastore, directly from the incoming
+ * data. Trailing bytes which don't form a complete unit are dropped.
+ */
+static int rle_put(struct sr_datastore *ds, const uint8_t *src,
+		   uint64_t length)
+{
+	struct rle_chunk *rc;
+	const uint8_t *end;
+	uint8_t *last;
+	uint64_t run_size, free_units, n;
+	uint32_t run_end;
+	int unitsize, ret;
+
+	unitsize = ds->ds_unitsize;
+	run_size = unitsize + sizeof(uint32_t);
+	end = src + (length / unitsize) * unitsize;
+	while (src < end) {
+		if (!ds->tail || ds->tail_used == ds->chunk_bytes) {
+			if (!new_rle_chunk(ds))
+				return SR_ERR_MALLOC;
+		}
+		rc = ds->tail;
+
+		/* Count identical units, without crossing the chunk end. */
+		free_units = (ds->chunk_bytes - ds->tail_used) / unitsize;
+		for (n = 1; n < free_units && src + n * unitsize < end; n++) {
+			if (memcmp(src, src + n * unitsize, unitsize))
+				break;
+		}
+
+		run_end = ds->tail_used / unitsize + n;
+		last = NULL;
+		if (rc->num_runs)
+			last = rc->runs + (rc->num_runs - 1) * run_size;
+		if (last && !memcmp(last, src, unitsize)) {
+			memcpy(last + unitsize, &run_end, sizeof(uint32_t));
+		} else {
+			if ((ret = rle_add_run(rc, src, unitsize, run_end))
+			    != SR_OK)
+				return ret;
+		}
+
+		ds->tail_used += n * unitsize;
+		src += n * unitsize;
+	}
+
+	update_num_units(ds);
+
+	return SR_OK;
+}
+
+static uint32_t rle_run_end(const struct rle_chunk *rc, int unitsize,
+			    uint64_t run)
+{
+	uint32_t end;
+
+	memcpy(&end, rc->runs + run * (unitsize + sizeof(uint32_t))
+	       + unitsize, sizeof(uint32_t));
+
+	return end;
+}
+
+/*
+ * Decode a range of units from an RLE-encoded datastore. The run the last
+ * read ended in is remembered in the iterator, so sequential reads only
+ * search the runs after it. The datastore itself isn't modified, so any
+ * number of iterators can read from it at once.
+ */
+static int rle_get(struct sr_datastore *ds, struct sr_datastore_iter *iter,
+		   uint64_t start_unit, uint64_t count, uint8_t *dst)
+{
+	struct rle_chunk *rc;
+	uint64_t offset, lo, hi, mid, n;
+	uint8_t *run;
+	int unitsize;
+	guint chunk;
+
+	unitsize = ds->ds_unitsize;
+	while (count > 0) {
+		chunk = start_unit / DATASTORE_CHUNKSIZE;
+		offset = start_unit % DATASTORE_CHUNKSIZE;
+		rc = g_ptr_array_index(ds->chunks, chunk);
+
+		/* Resume at the iterator's run, unless offset is before it. */
+		lo = 0;
+		if (iter->cursor_chunk == chunk
+		    && iter->cursor_run < rc->num_runs
+		    && (iter->cursor_run == 0 || rle_run_end(rc, unitsize,
+				iter->cursor_run - 1) <= offset))
+			lo = iter->cursor_run;
+
+		/* Find the first run ending after offset. */
+		hi = rc->num_runs;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (rle_run_end(rc, unitsize, mid) > offset)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+
+		for (; lo < rc->num_runs; lo++) {
+			run = rc->runs + lo * (unitsize + sizeof(uint32_t));
+			n = MIN(count, rle_run_end(rc, unitsize, lo) - offset);
+			count -= n;
+			offset += n;
+			start_unit += n;
+			while (n--) {
+				memcpy(dst, run, unitsize);
+				dst += unitsize;
+			}
+			if (count == 0)
+				break;
+		}
+		iter->cursor_chunk = chunk;
+		iter->cursor_run = lo;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Transpose an 8x8 bit matrix, held as one row per byte (least
+ * significant byte first), with bit n of a row being column n.
+ */
+static uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x ^= t ^ (t << 28);
+
+	return x;
+}
+
+/*
+ * Store count units at unit position pos of a bit-plane chunk. Groups
+ * of 8 aligned units are transposed a byte column at a time, so each
+ * 8x8 transpose fills one byte of 8 planes.
+ */
+static void bitplane_encode(uint8_t *chunk, int unitsize, uint64_t pos,
+			    const uint8_t *src, uint64_t count)
+{
+	uint64_t x;
+	uint8_t *plane;
+	int b, i, p;
+
+	while (count > 0) {
+		if (pos % 8 || count < 8) {
+			for (p = 0; p < unitsize * 8; p++) {
+				plane = chunk + (uint64_t)p * PLANE_BYTES;
+				if (src[p / 8] & (1 << (p % 8)))
+					plane[pos / 8] |= 1 << (pos % 8);
+				else
+					plane[pos / 8] &= ~(1 << (pos % 8));
+			}
+			src += unitsize;
+			pos++;
+			count--;
+			continue;
+		}
+		for (b = 0; b < unitsize; b++) {
+			x = 0;
+			for (i = 0; i < 8; i++)
+				x |= (uint64_t)src[i * unitsize + b] << (i * 8);
+			x = transpose8(x);
+			plane = chunk + (uint64_t)b * 8 * PLANE_BYTES + pos / 8;
+			for (i = 0; i < 8; i++)
+				plane[i * PLANE_BYTES] = x >> (i * 8);
+		}
+		src += 8 * unitsize;
+		pos += 8;
+		count -= 8;
+	}
+}
+
+/* The reverse of bitplane_encode(). */
+static void bitplane_decode(const uint8_t *chunk, int unitsize, uint64_t pos,
+			    uint8_t *dst, uint64_t count)
+{
+	const uint8_t *plane;
+	uint64_t x;
+	int b, i, p;
+
+	while (count > 0) {
+		if (pos % 8 || count < 8) {
+			memset(dst, 0, unitsize);
+			for (p = 0; p < unitsize * 8; p++) {
+				plane = chunk + (uint64_t)p * PLANE_BYTES;
+				if (plane[pos / 8] & (1 << (pos % 8)))
+					dst[p / 8] |= 1 << (p % 8);
+			}
+			dst += unitsize;
+			pos++;
+			count--;
+			continue;
+		}
+		for (b = 0; b < unitsize; b++) {
+			plane = chunk + (uint64_t)b * 8 * PLANE_BYTES + pos / 8;
+			x = 0;
+			for (i = 0; i < 8; i++)
+				x |= (uint64_t)plane[i * PLANE_BYTES] << (i * 8);
+			x = transpose8(x);
+			for (i = 0; i < 8; i++)
+				dst[i * unitsize + b] = x >> (i * 8);
+		}
+		dst += 8 * unitsize;
+		pos += 8;
+		count -= 8;
+	}
+}
+
+static int bitplane_put(struct sr_datastore *ds, const uint8_t *src,
+			uint64_t length)
+{
+	uint64_t units, pos, n;
+	int unitsize;
+
+	unitsize = ds->ds_unitsize;
+	units = length / unitsize;
+	while (units > 0) {
+		if (!ds->tail || ds->tail_used == ds->chunk_bytes) {
+			if (!new_chunk(ds))
+				return SR_ERR_MALLOC;
+		}
+
+		pos = ds->tail_used / unitsize;
+		n = MIN(units, DATASTORE_CHUNKSIZE - pos);
+		bitplane_encode(ds->tail, unitsize, pos, src, n);
+		ds->tail_used += n * unitsize;
+		src += n * unitsize;
+		units -= n;
+	}
+
+	update_num_units(ds);
+
+	return SR_OK;
+}
+
+static int bitplane_get(struct sr_datastore *ds, uint64_t start_unit,
+			uint64_t count, uint8_t *dst)
+{
+	uint64_t pos, n;
+	uint8_t *chunk;
+
+	while (count > 0) {
+		if (!(chunk = get_chunk(ds, start_unit / DATASTORE_CHUNKSIZE)))
+			return SR_ERR;
+		pos = start_unit % DATASTORE_CHUNKSIZE;
+		n = MIN(count, DATASTORE_CHUNKSIZE - pos);
+		bitplane_decode(chunk, ds->ds_unitsize, pos, dst, n);
+		dst += n * ds->ds_unitsize;
+		start_unit += n;
+		count -= n;
+	}
+
+	return SR_OK;
+}
@@ -0,0 +1,582 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * The summary is a pyramid over the units stored in a datastore. An entry
+ * on level k covers 2^(SUMMARY_SHIFT + k) units, and records for every
+ * probe whether it was seen low and/or high, its first and last state,
+ * and how many edges it has within the entry. Entries on level k + 1 are
+ * built from pairs of entries on level k as soon as both are complete.
+ */
+#define SUMMARY_SHIFT	8
+#define SUMMARY_BLOCK	(1 << SUMMARY_SHIFT)
+/* Keep the per-entry edge counts within 32 bits. */
+#define SUMMARY_LEVELS	(32 - SUMMARY_SHIFT)
+
+struct summary_entry {
+	uint64_t low;
+	uint64_t high;
+	uint64_t first;
+	uint64_t last;
+};
+
+struct sr_datastore_summary {
+	int num_probes;
+	/* Per level: GArray of struct summary_entry */
+	GArray *entries[SUMMARY_LEVELS];
+	/* Per level: GArray of num_probes edge counts (uint32_t) per entry */
+	GArray *edges[SUMMARY_LEVELS];
+	/* The (incomplete) block currently being accumulated */
+	struct summary_entry acc;
+	uint32_t acc_edges[SR_MAX_NUM_PROBES];
+	uint64_t acc_units;
+};
+
+struct sr_datastore_summary *ds_summary_new(int unitsize)
+{
+	struct sr_datastore_summary *sum;
+	int i;
+
+	/* The per-probe masks are 64 bits wide. */
+	if (unitsize > 8)
+		return NULL;
+
+	if (!(sum = g_try_malloc0(sizeof(struct sr_datastore_summary)))) {
+		sr_err("ds: %s: summary malloc failed", __func__);
+		return NULL;
+	}
+
+	sum->num_probes = unitsize * 8;
+	for (i = 0; i < SUMMARY_LEVELS; i++) {
+		sum->entries[i] = g_array_new(FALSE, FALSE,
+					      sizeof(struct summary_entry));
+		sum->edges[i] = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	}
+
+	return sum;
+}
+
+void ds_summary_destroy(struct sr_datastore_summary *sum)
+{
+	int i;
+
+	if (!sum)
+		return;
+
+	for (i = 0; i < SUMMARY_LEVELS; i++) {
+		g_array_free(sum->entries[i], TRUE);
+		g_array_free(sum->edges[i], TRUE);
+	}
+	g_free(sum);
+}
+
+/* Append the completed block to level 0, and merge upwards. */
+static void summary_push_block(struct sr_datastore_summary *sum)
+{
+	struct summary_entry *a, *b, merged;
+	uint32_t *ea, *eb, e;
+	uint64_t boundary;
+	int level, p;
+	guint n;
+
+	g_array_append_val(sum->entries[0], sum->acc);
+	g_array_append_vals(sum->edges[0], sum->acc_edges, sum->num_probes);
+
+	for (level = 0; level < SUMMARY_LEVELS - 1; level++) {
+		n = sum->entries[level]->len;
+		if (n % 2)
+			break;
+		a = &g_array_index(sum->entries[level], struct summary_entry,
+				   n - 2);
+		b = a + 1;
+		merged.low = a->low | b->low;
+		merged.high = a->high | b->high;
+		merged.first = a->first;
+		merged.last = b->last;
+		g_array_append_val(sum->entries[level + 1], merged);
+
+		ea = &g_array_index(sum->edges[level], uint32_t,
+				    (n - 2) * sum->num_probes);
+		eb = ea + sum->num_probes;
+		boundary = a->last ^ b->first;
+		for (p = 0; p < sum->num_probes; p++) {
+			e = ea[p] + eb[p] + ((boundary >> p) & 1);
+			g_array_append_val(sum->edges[level + 1], e);
+		}
+	}
+}
+
+void ds_summary_append(struct sr_datastore_summary *sum, int unitsize,
+		       const uint8_t *data, uint64_t num_units)
+{
+	uint64_t i, unit, prev, diff, mask;
+	int p;
+
+	mask = sum->num_probes == 64 ? G_MAXUINT64
+		: (G_GUINT64_CONSTANT(1) << sum->num_probes) - 1;
+
+	prev = sum->acc.last;
+	for (i = 0; i < num_units; i++, data += unitsize) {
+		unit = 0;
+		memcpy(&unit, data, unitsize);
+
+		if (sum->acc_units == 0) {
+			sum->acc.first = unit;
+			sum->acc.low = ~unit & mask;
+			sum->acc.high = unit;
+			memset(sum->acc_edges, 0, sizeof(sum->acc_edges));
+		} else if (unit != prev) {
+			sum->acc.low |= ~unit & mask;
+			sum->acc.high |= unit;
+			for (diff = unit ^ prev; diff; diff &= diff - 1) {
+				p = __builtin_ctzll(diff);
+				sum->acc_edges[p]++;
+			}
+		}
+		prev = unit;
+		sum->acc.last = unit;
+
+		if (++sum->acc_units == SUMMARY_BLOCK) {
+			summary_push_block(sum);
+			sum->acc_units = 0;
+		}
+	}
+}
+
+/* Summary of a span, as built up piece by piece while walking a range. */
+struct span {
+	gboolean empty;
+	int low;
+	int high;
+	int last;
+	uint64_t edges;
+};
+
+static void span_add(struct span *s, int low, int high, int first, int last,
+		     uint64_t edges)
+{
+	if (!s->empty && s->last != first)
+		s->edges++;
+	s->empty = FALSE;
+	s->low |= low;
+	s->high |= high;
+	s->last = last;
+	s->edges += edges;
+}
+
+/* Add units read straight from the datastore to a span. */
+static int span_add_raw(struct sr_datastore *ds, int probe, uint64_t start,
+			uint64_t count, struct span *s)
+{
+	uint8_t buf[SUMMARY_BLOCK * 8];
+	uint64_t unit, i;
+	int ret, bit;
+
+	if ((ret = sr_datastore_get(ds, start, count, buf)) != SR_OK)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		unit = 0;
+		memcpy(&unit, buf + i * ds->ds_unitsize, ds->ds_unitsize);
+		bit = (unit >> probe) & 1;
+		span_add(s, !bit, bit, bit, bit, 0);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Summarize the state of a probe over a range of units.
+ *
+ * If the datastore's summary is enabled (see sr_datastore_set_summary()),
+ * this runs in time logarithmic in the size of the range, so viewers can
+ * call it once per pixel to draw a zoomed-out view of a large capture.
+ * Otherwise every unit in the range is read.
+ *
+ * @param ds The datastore.
+ * @param probe The probe, as bit number (starting at 0) within a unit.
+ * @param start The first unit of the range.
+ * @param count The number of units in the range (at least 1).
+ * @param state Will be set to SR_SUMMARY_LOW or SR_SUMMARY_HIGH if the
+ *              probe didn't change within the range, or
+ *              SR_SUMMARY_TOGGLING otherwise. May be NULL.
+ * @param edges Will be set to the number of edges within the range.
+ *              May be NULL.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if
+ *         the datastore's units are wider than 64 probes.
+ */
+int sr_datastore_summary(struct sr_datastore *ds, int probe, uint64_t start,
+			 uint64_t count, int *state, uint64_t *edges)
+{
+	struct sr_datastore_summary *sum;
+	struct summary_entry *entry;
+	struct span s;
+	uint64_t pos, end, complete, span_units, n, index;
+	uint32_t entry_edges;
+	int level, ret;
+
+	if (!ds || ds->ds_unitsize > 8 || probe < 0
+	    || probe >= ds->ds_unitsize * 8 || count == 0)
+		return SR_ERR_ARG;
+
+	if (start > ds->num_units || count > ds->num_units - start)
+		return SR_ERR_ARG;
+
+	memset(&s, 0, sizeof(struct span));
+	s.empty = TRUE;
+	/* Without a summary, all units are read. */
+	sum = ds->summary;
+	complete = sum ? (uint64_t)sum->entries[0]->len << SUMMARY_SHIFT : 0;
+	end = start + count;
+	pos = start;
+	while (pos < end) {
+		if (pos % SUMMARY_BLOCK || pos + SUMMARY_BLOCK > end
+		    || pos + SUMMARY_BLOCK > complete) {
+			/* Not covered by a whole block, read the units. */
+			n = MIN(end, pos - pos % SUMMARY_BLOCK + SUMMARY_BLOCK)
+			    - pos;
+			if ((ret = span_add_raw(ds, probe, pos, n, &s)) != SR_OK)
+				return ret;
+			pos += n;
+			continue;
+		}
+
+		/* Find the largest aligned entry that fits the range. */
+		for (level = SUMMARY_LEVELS - 1; level > 0; level--) {
+			span_units = G_GUINT64_CONSTANT(1)
+				     << (SUMMARY_SHIFT + level);
+			if (pos % span_units == 0 && pos + span_units <= end
+			    && (pos / span_units) < sum->entries[level]->len)
+				break;
+		}
+		span_units = G_GUINT64_CONSTANT(1) << (SUMMARY_SHIFT + level);
+		index = pos / span_units;
+		entry = &g_array_index(sum->entries[level],
+				       struct summary_entry, index);
+		entry_edges = g_array_index(sum->edges[level], uint32_t,
+					    index * sum->num_probes + probe);
+		span_add(&s, (entry->low >> probe) & 1,
+			 (entry->high >> probe) & 1,
+			 (entry->first >> probe) & 1,
+			 (entry->last >> probe) & 1, entry_edges);
+		pos += span_units;
+	}
+
+	if (state) {
+		if (s.low && s.high)
+			*state = SR_SUMMARY_TOGGLING;
+		else
+			*state = s.high ? SR_SUMMARY_HIGH : SR_SUMMARY_LOW;
+	}
+	if (edges)
+		*edges = s.edges;
+
+	return SR_OK;
+}
+
+static gboolean edge_matches(int type, int bit)
+{
+	if (type == SR_EDGE_RISING)
+		return bit;
+	if (type == SR_EDGE_FALLING)
+		return !bit;
+
+	return TRUE;
+}
+
+/*
+ * Whether an entry with the given first/last state and number of edges
+ * contains an edge of the requested type.
+ */
+static gboolean entry_matches(int type, int first, int last, uint32_t edges)
+{
+	if (edges == 0)
+		return FALSE;
+	if (edges == 1)
+		return edge_matches(type, last) && first != last;
+
+	/* Any two consecutive edges are one rising, one falling. */
+	return TRUE;
+}
+
+/* State of a single probe in a single unit. */
+static int get_bit(struct sr_datastore *ds, int probe, uint64_t unit_num,
+		   int *bit)
+{
+	uint64_t unit;
+	int ret;
+
+	unit = 0;
+	if ((ret = sr_datastore_get(ds, unit_num, 1, &unit)) != SR_OK)
+		return ret;
+	*bit = (unit >> probe) & 1;
+
+	return SR_OK;
+}
+
+/*
+ * Look for an edge at units lo..hi-1 by reading the units themselves. An
+ * edge "at" unit u is a change between unit u - 1 and unit u. Returns
+ * TRUE if one was found, FALSE if not, or an error code.
+ */
+static int find_edge_raw(struct sr_datastore *ds, int probe, uint64_t lo,
+			 uint64_t hi, int direction, int type, uint64_t *edge)
+{
+	uint8_t buf[(SUMMARY_BLOCK + 1) * 8];
+	uint64_t start, n, unit, prev, i, j;
+	int ret, bit;
+
+	while (lo < hi) {
+		n = MIN(hi - lo, SUMMARY_BLOCK);
+		start = direction == SR_SEARCH_FORWARD ? lo : hi - n;
+		if ((ret = sr_datastore_get(ds, start - 1, n + 1, buf)) != SR_OK)
+			return ret;
+
+		for (i = 0; i < n; i++) {
+			j = direction == SR_SEARCH_FORWARD ? i : n - 1 - i;
+			prev = unit = 0;
+			memcpy(&prev, buf + j * ds->ds_unitsize, ds->ds_unitsize);
+			memcpy(&unit, buf + (j + 1) * ds->ds_unitsize,
+			       ds->ds_unitsize);
+			bit = (unit >> probe) & 1;
+			if (bit != (int)((prev >> probe) & 1)
+			    && edge_matches(type, bit)) {
+				*edge = start + j;
+				return TRUE;
+			}
+		}
+
+		if (direction == SR_SEARCH_FORWARD)
+			lo += n;
+		else
+			hi -= n;
+	}
+
+	return FALSE;
+}
+
+/*
+ * The largest level with an entry starting at (forward) or ending at
+ * (backward) the block-aligned position pos.
+ */
+static int find_level(struct sr_datastore_summary *sum, uint64_t pos,
+		      int direction)
+{
+	uint64_t span_units;
+	int level;
+
+	for (level = SUMMARY_LEVELS - 1; level > 0; level--) {
+		span_units = G_GUINT64_CONSTANT(1) << (SUMMARY_SHIFT + level);
+		if (pos % span_units)
+			continue;
+		if (direction == SR_SEARCH_FORWARD
+		    && pos / span_units < sum->entries[level]->len)
+			break;
+		if (direction == SR_SEARCH_BACKWARD
+		    && pos / span_units <= sum->entries[level]->len)
+			break;
+	}
+
+	return level;
+}
+
+/*
+ * Look for an edge inside a summary entry, i.e. not counting a change
+ * from the unit before it. Only descends into entries which are known
+ * to contain a matching edge.
+ */
+static int find_edge_entry(struct sr_datastore *ds, int probe, int level,
+			   uint64_t index, int direction, int type,
+			   uint64_t *edge)
+{
+	struct sr_datastore_summary *sum;
+	struct summary_entry *entry, *child[2];
+	uint64_t start, mid;
+	uint32_t entry_edges;
+	int ret, bit, i;
+
+	sum = ds->summary;
+	entry = &g_array_index(sum->entries[level], struct summary_entry,
+			       index);
+	entry_edges = g_array_index(sum->edges[level], uint32_t,
+				    index * sum->num_probes + probe);
+	if (!entry_matches(type, (entry->first >> probe) & 1,
+			   (entry->last >> probe) & 1, entry_edges))
+		return FALSE;
+
+	start = index << (SUMMARY_SHIFT + level);
+	if (level == 0)
+		return find_edge_raw(ds, probe, start + 1, start + SUMMARY_BLOCK,
+				     direction, type, edge);
+
+	child[0] = &g_array_index(sum->entries[level - 1],
+				  struct summary_entry, index * 2);
+	child[1] = child[0] + 1;
+	mid = start + (G_GUINT64_CONSTANT(1) << (SUMMARY_SHIFT + level - 1));
+	for (i = 0; i < 2; i++) {
+		if (i == 1) {
+			/* The change between the two halves. */
+			bit = (child[1]->first >> probe) & 1;
+			if (bit != (int)((child[0]->last >> probe) & 1)
+			    && edge_matches(type, bit)) {
+				*edge = mid;
+				return TRUE;
+			}
+		}
+		ret = find_edge_entry(ds, probe, level - 1, index * 2
+				      + (direction == SR_SEARCH_FORWARD ? i
+				      : 1 - i), direction, type, edge);
+		if (ret != FALSE)
+			return ret;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Find the next or previous edge on a probe.
+ *
+ * An edge "at" unit u is a change of the probe's state between unit u - 1
+ * and unit u. If the datastore's summary is enabled, it is used as edge
+ * index: only entries known to contain a matching edge are looked into,
+ * so this takes logarithmic rather than linear time. Otherwise the units
+ * are read until an edge is found.
+ *
+ * @param ds The datastore.
+ * @param probe The probe, as bit number (starting at 0) within a unit.
+ * @param from The unit to start searching from. An edge at this unit is
+ *             not returned, so repeated calls step from edge to edge.
+ * @param direction SR_SEARCH_FORWARD for the first edge after from,
+ *                  SR_SEARCH_BACKWARD for the last edge before from.
+ * @param type SR_EDGE_RISING, SR_EDGE_FALLING or SR_EDGE_ANY.
+ * @param edge Will be set to the unit the edge is at.
+ * @return SR_OK upon success, SR_ERR if there is no such edge,
+ *         SR_ERR_ARG upon invalid arguments or if the datastore's units
+ *         are wider than 64 probes.
+ */
+int sr_datastore_find_edge(struct sr_datastore *ds, int probe, uint64_t from,
+			   int direction, int type, uint64_t *edge)
+{
+	struct sr_datastore_summary *sum;
+	struct summary_entry *entry;
+	uint64_t pos, complete, span_units, index;
+	int level, ret, bit, first;
+
+	if (!ds || ds->ds_unitsize > 8 || probe < 0
+	    || probe >= ds->ds_unitsize * 8 || !edge)
+		return SR_ERR_ARG;
+
+	if (direction != SR_SEARCH_FORWARD && direction != SR_SEARCH_BACKWARD)
+		return SR_ERR_ARG;
+
+	/* Without a summary, all units are read. */
+	sum = ds->summary;
+	complete = sum ? (uint64_t)sum->entries[0]->len << SUMMARY_SHIFT : 0;
+
+	if (direction == SR_SEARCH_FORWARD) {
+		if (from + 1 >= ds->num_units)
+			return SR_ERR;
+
+		/* Read up to the first whole block covered by the summary. */
+		pos = (from + SUMMARY_BLOCK) & ~(uint64_t)(SUMMARY_BLOCK - 1);
+		if (pos >= complete) {
+			ret = find_edge_raw(ds, probe, from + 1, ds->num_units,
+					    direction, type, edge);
+			goto done;
+		}
+		ret = find_edge_raw(ds, probe, from + 1, pos, direction, type,
+				    edge);
+		if (ret != FALSE)
+			goto done;
+
+		if ((ret = get_bit(ds, probe, pos - 1, &bit)) != SR_OK)
+			return ret;
+		while (pos < complete) {
+			level = find_level(sum, pos, direction);
+			span_units = G_GUINT64_CONSTANT(1)
+				     << (SUMMARY_SHIFT + level);
+			index = pos / span_units;
+			entry = &g_array_index(sum->entries[level],
+					       struct summary_entry, index);
+			first = (entry->first >> probe) & 1;
+			if (first != bit && edge_matches(type, first)) {
+				*edge = pos;
+				return SR_OK;
+			}
+			ret = find_edge_entry(ds, probe, level, index,
+					      direction, type, edge);
+			if (ret != FALSE)
+				goto done;
+			bit = (entry->last >> probe) & 1;
+			pos += span_units;
+		}
+
+		/* The rest isn't covered by the summary yet. */
+		ret = find_edge_raw(ds, probe, complete, ds->num_units,
+				    direction, type, edge);
+	} else {
+		if (from > ds->num_units)
+			from = ds->num_units;
+		if (from < 2)
+			return SR_ERR;
+
+		/* Read back to the last whole block covered by the summary. */
+		pos = MIN((from - 1) & ~(uint64_t)(SUMMARY_BLOCK - 1),
+			  complete);
+		ret = find_edge_raw(ds, probe, MAX(pos, 1), from, direction,
+				    type, edge);
+		if (ret != FALSE || pos == 0)
+			goto done;
+
+		if ((ret = get_bit(ds, probe, pos, &bit)) != SR_OK)
+			return ret;
+		while (pos > 0) {
+			level = find_level(sum, pos, direction);
+			span_units = G_GUINT64_CONSTANT(1)
+				     << (SUMMARY_SHIFT + level);
+			index = pos / span_units - 1;
+			entry = &g_array_index(sum->entries[level],
+					       struct summary_entry, index);
+			if ((int)((entry->last >> probe) & 1) != bit
+			    && edge_matches(type, bit)) {
+				*edge = pos;
+				return SR_OK;
+			}
+			ret = find_edge_entry(ds, probe, level, index,
+					      direction, type, edge);
+			if (ret != FALSE)
+				goto done;
+			bit = (entry->first >> probe) & 1;
+			pos -= span_units;
+		}
+	}
+
+done:
+	if (ret == TRUE)
+		return SR_OK;
+
+	return ret == FALSE ? SR_ERR : ret;
+}
@@ -20,7 +20,380 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <glib.h>
 #include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Runtime-selected kernels for x86 CPUs which support them. These need
+ * the target attribute and __builtin_cpu_supports() (GCC 4.9 or later).
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define FILTER_INLINE static inline __attribute__((always_inline))
+#else
+#define FILTER_INLINE static inline
+#endif
+
+typedef void (*filter_kernel)(const struct sr_filter *f, const uint8_t *in,
+			      uint8_t *out, uint64_t num_units);
+
+/*
+ * A probe filter, compiled for one probe list and unit size pair. Probe
+ * n of the output is taken from the input bit probelist[n] - 1.
+ */
+struct sr_filter {
+	int in_unitsize;
+	int out_unitsize;
+	/* Input bits used, and whether they're used in ascending order. */
+	uint64_t mask;
+	gboolean ascending;
+	/*
+	 * Output bits for each value of each input byte, for the input
+	 * bytes listed in lut_bytes.
+	 */
+	uint64_t lut[8][256];
+	int lut_bytes[8];
+	int num_lut_bytes;
+	/* Byte-wise shuffle of 16 input bytes, for the SSSE3 kernel. */
+	uint8_t shuffle[16];
+	filter_kernel kernel;
+};
+
+FILTER_INLINE uint64_t load_unit(const uint8_t *p, int size)
+{
+	uint64_t v;
+	int i;
+
+	v = 0;
+	for (i = 0; i < size; i++)
+		v |= (uint64_t)p[i] << (i * 8);
+
+	return v;
+}
+
+FILTER_INLINE void store_unit(uint8_t *p, uint64_t v, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		p[i] = v >> (i * 8);
+}
+
+/*
+ * Run a kernel loop with the unit sizes as constants, so the compiler
+ * can specialise the unit loads and stores for every common pair.
+ */
+#define SPECIALISE(loop, f, in, out, n) \
+	switch ((f)->in_unitsize * 16 + (f)->out_unitsize) { \
+	case 0x11: loop(f, in, out, n, 1, 1); break; \
+	case 0x21: loop(f, in, out, n, 2, 1); break; \
+	case 0x22: loop(f, in, out, n, 2, 2); break; \
+	case 0x41: loop(f, in, out, n, 4, 1); break; \
+	case 0x42: loop(f, in, out, n, 4, 2); break; \
+	case 0x44: loop(f, in, out, n, 4, 4); break; \
+	case 0x81: loop(f, in, out, n, 8, 1); break; \
+	case 0x82: loop(f, in, out, n, 8, 2); break; \
+	case 0x84: loop(f, in, out, n, 8, 4); break; \
+	case 0x88: loop(f, in, out, n, 8, 8); break; \
+	default: \
+		loop(f, in, out, n, (f)->in_unitsize, (f)->out_unitsize); \
+	}
+
+FILTER_INLINE void lut_loop(const struct sr_filter *f, const uint8_t *in,
+			    uint8_t *out, uint64_t num_units,
+			    int in_unitsize, int out_unitsize)
+{
+	uint64_t sample;
+	int b, i;
+
+	while (num_units--) {
+		sample = 0;
+		for (i = 0; i < f->num_lut_bytes; i++) {
+			b = f->lut_bytes[i];
+			sample |= f->lut[b][in[b]];
+		}
+		store_unit(out, sample, out_unitsize);
+		in += in_unitsize;
+		out += out_unitsize;
+	}
+}
+
+/* Portable kernel: one table lookup per input byte holding used probes. */
+static void lut_kernel(const struct sr_filter *f, const uint8_t *in,
+		       uint8_t *out, uint64_t num_units)
+{
+	SPECIALISE(lut_loop, f, in, out, num_units);
+}
+
+#ifdef HAVE_X86_KERNELS
+#ifdef __x86_64__
+__attribute__((target("bmi2")))
+static inline void pext_loop(const struct sr_filter *f, const uint8_t *in,
+			     uint8_t *out, uint64_t num_units,
+			     int in_unitsize, int out_unitsize)
+{
+	while (num_units--) {
+		store_unit(out, _pext_u64(load_unit(in, in_unitsize), f->mask),
+			   out_unitsize);
+		in += in_unitsize;
+		out += out_unitsize;
+	}
+}
+
+/* BMI2 kernel, for probes used in ascending order: one pext per unit. */
+__attribute__((target("bmi2")))
+static void pext_kernel(const struct sr_filter *f, const uint8_t *in,
+			uint8_t *out, uint64_t num_units)
+{
+	SPECIALISE(pext_loop, f, in, out, num_units);
+}
+#endif
+
+/*
+ * SSSE3 kernel, for whole input bytes used in ascending order: gathers
+ * the used bytes of 16 input bytes' worth of units with one pshufb.
+ */
+__attribute__((target("ssse3")))
+static void shuffle_kernel(const struct sr_filter *f, const uint8_t *in,
+			   uint8_t *out, uint64_t num_units)
+{
+	__m128i shuffle, v;
+	uint64_t units_per_vec;
+
+	shuffle = _mm_loadu_si128((const __m128i *)f->shuffle);
+	units_per_vec = 16 / f->in_unitsize;
+
+	/* Every store writes 16 bytes, so stop while that still fits. */
+	while (num_units >= units_per_vec
+	       && num_units * f->out_unitsize >= 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, shuffle));
+		in += 16;
+		out += units_per_vec * f->out_unitsize;
+		num_units -= units_per_vec;
+	}
+	lut_kernel(f, in, out, num_units);
+}
+#endif
+
+/* All probes are used, in their original order: plain copy. */
+static void copy_kernel(const struct sr_filter *f, const uint8_t *in,
+			uint8_t *out, uint64_t num_units)
+{
+	memmove(out, in, num_units * f->in_unitsize);
+}
+
+static int filter_init(struct sr_filter *f, int in_unitsize, int out_unitsize,
+		       const int *probelist)
+{
+	int num_probes, last, b, i, v;
+
+	/*
+	 * The output is never wider than the input, so it can be written
+	 * over the input, and a vector of input units always fits in one
+	 * vector of output units.
+	 */
+	if (in_unitsize < 1 || in_unitsize > 8 || out_unitsize < 1
+	    || out_unitsize > in_unitsize || !probelist)
+		return SR_ERR_ARG;
+
+	f->in_unitsize = in_unitsize;
+	f->out_unitsize = out_unitsize;
+	f->mask = 0;
+	f->ascending = TRUE;
+	last = 0;
+	for (num_probes = 0; probelist[num_probes]; num_probes++) {
+		if (probelist[num_probes] < 1
+		    || probelist[num_probes] > in_unitsize * 8
+		    || num_probes >= out_unitsize * 8)
+			return SR_ERR_ARG;
+		if (probelist[num_probes] <= last)
+			f->ascending = FALSE;
+		last = probelist[num_probes];
+		f->mask |= 1ULL << (probelist[num_probes] - 1);
+	}
+	f->num_lut_bytes = 0;
+	for (b = 0; b < in_unitsize; b++) {
+		if ((f->mask >> (b * 8)) & 0xff)
+			f->lut_bytes[f->num_lut_bytes++] = b;
+	}
+
+	/* All input probes in ascending order can only be the identity. */
+	if (num_probes == in_unitsize * 8 && out_unitsize == in_unitsize
+	    && f->ascending) {
+		f->kernel = copy_kernel;
+		return SR_OK;
+	}
+	f->kernel = lut_kernel;
+
+#ifdef HAVE_X86_KERNELS
+	if (f->ascending && in_unitsize > 1 && 16 % in_unitsize == 0
+	    && __builtin_cpu_supports("ssse3")) {
+		/* Are only whole input bytes used? */
+		for (b = 0; b < in_unitsize; b++) {
+			v = (f->mask >> (b * 8)) & 0xff;
+			if (v != 0 && v != 0xff)
+				break;
+		}
+		if (b == in_unitsize) {
+			memset(f->shuffle, 0x80, sizeof(f->shuffle));
+			for (i = 0; i < 16 / in_unitsize; i++) {
+				for (b = 0; b < f->num_lut_bytes; b++)
+					f->shuffle[i * out_unitsize + b] =
+						i * in_unitsize + f->lut_bytes[b];
+			}
+			f->kernel = shuffle_kernel;
+		}
+	}
+#ifdef __x86_64__
+	if (f->kernel == lut_kernel && f->ascending
+	    && __builtin_cpu_supports("bmi2")) {
+		/* The only kernel which doesn't need the table. */
+		f->kernel = pext_kernel;
+		return SR_OK;
+	}
+#endif
+#endif
+
+	for (i = 0; i < f->num_lut_bytes; i++)
+		memset(f->lut[f->lut_bytes[i]], 0, sizeof(f->lut[0]));
+	for (i = 0; i < num_probes; i++) {
+		b = (probelist[i] - 1) / 8;
+		for (v = 0; v < 256; v++) {
+			if (v & (1 << ((probelist[i] - 1) % 8)))
+				f->lut[b][v] |= 1ULL << i;
+		}
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Compile a probe filter.
+ *
+ * This does all the work of looking at the probe list once, so that
+ * sr_filter_run() can then be used on every packet of an acquisition.
+ * Depending on the probes used and on what the CPU supports, the filter
+ * uses a plain copy, a byte shuffle (SSSE3), a bit extract (BMI2), or a
+ * table lookup per input byte.
+ *
+ * @param in_unitsize The unit size of the input, at most 8.
+ * @param out_unitsize The unit size of the output, at most in_unitsize.
+ * @param probelist Zero-terminated list of the (1-based) input probes to
+ *                  keep, in output order.
+ * @param filter Set to the new filter.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_filter_new(int in_unitsize, int out_unitsize, const int *probelist,
+		  struct sr_filter **filter)
+{
+	int ret;
+
+	if (!filter)
+		return SR_ERR_ARG;
+
+	if (!(*filter = g_try_malloc(sizeof(struct sr_filter)))) {
+		sr_err("filter: %s: filter malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if ((ret = filter_init(*filter, in_unitsize, out_unitsize,
+			       probelist)) != SR_OK) {
+		g_free(*filter);
+		*filter = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * Destroy a probe filter.
+ *
+ * @param filter The filter.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_filter_destroy(struct sr_filter *filter)
+{
+	if (!filter)
+		return SR_ERR_ARG;
+
+	g_free(filter);
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, using a compiled filter.
+ *
+ * No memory is allocated. The output may be written over the input
+ * (data_out == data_in).
+ *
+ * @param filter The filter.
+ * @param data_in The input data. A trailing partial unit is ignored.
+ * @param length_in The input data length.
+ * @param data_out Buffer for the output data, of at least
+ *                 (length_in / in_unitsize) * out_unitsize bytes.
+ * @param length_out Set to the output data length.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_filter_run(const struct sr_filter *filter, const void *data_in,
+		  uint64_t length_in, void *data_out, uint64_t *length_out)
+{
+	uint64_t num_units;
+
+	if (!filter || !data_in || !data_out || !length_out)
+		return SR_ERR_ARG;
+
+	num_units = length_in / filter->in_unitsize;
+	sr_trace(SR_TRACE_FILTER, SR_TRACE_BEGIN, length_in);
+	filter->kernel(filter, data_in, data_out, num_units);
+	sr_trace(SR_TRACE_FILTER, SR_TRACE_END, length_in);
+	*length_out = num_units * filter->out_unitsize;
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, into a caller-provided buffer.
+ *
+ * Like sr_filter_probes(), but without allocating any memory. When
+ * filtering many packets with the same probe list, compiling the filter
+ * once with sr_filter_new() and running it with sr_filter_run() is
+ * faster.
+ *
+ * @param in_unitsize The unit size of the input (data_in), at most 8.
+ * @param out_unitsize The unit size of the output (data_out), at most
+ *                     in_unitsize.
+ * @param probelist Pointer to a list of integers (probe numbers).
+ * @param data_in The input data.
+ * @param length_in The input data length.
+ * @param data_out Buffer for the output data, of at least
+ *                 (length_in / in_unitsize) * out_unitsize bytes. This
+ *                 may be data_in.
+ * @param length_out Set to the output data length.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_filter_probes_into(int in_unitsize, int out_unitsize,
+			  const int *probelist, const void *data_in,
+			  uint64_t length_in, void *data_out,
+			  uint64_t *length_out)
+{
+	struct sr_filter f;
+	int ret;
+
+	if ((ret = filter_init(&f, in_unitsize, out_unitsize,
+			       probelist)) != SR_OK)
+		return ret;
+
+	return sr_filter_run(&f, data_in, length_in, data_out, length_out);
+}
 
 /**
  * Remove unused probes from samples.
@@ -29,52 +402,35 @@
  * it -- to a sample taking up only as much space as required, with
  * unused probes removed.
  *
- * @param in_unitsize The unit size of the input (data_in).
- * @param out_unitsize The unit size of the output (data_out).
+ * The output buffer is allocated here, and must be freed by the caller.
+ * See sr_filter_new() and sr_filter_probes_into() for variants which
+ * don't allocate any memory.
+ *
+ * @param in_unitsize The unit size of the input (data_in), at most 8.
+ * @param out_unitsize The unit size of the output (data_out), at most
+ *                     in_unitsize.
  * @param probelist Pointer to a list of integers (probe numbers).
  * @param data_in The input data.
  * @param length_in The input data length.
  * @param data_out The output data.
  * @param length_out The output data length.
- * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
  */
 int sr_filter_probes(int in_unitsize, int out_unitsize, int *probelist,
 		     const unsigned char *data_in, uint64_t length_in,
 		     char **data_out, uint64_t *length_out)
 {
-	unsigned int in_offset, out_offset;
-	int num_enabled_probes, out_bit, i;
-	uint64_t sample_in, sample_out;
+	int ret;
 
 	if (!(*data_out = malloc(length_in)))
 		return SR_ERR_MALLOC;
 
-	num_enabled_probes = 0;
-	for (i = 0; probelist[i]; i++)
-		num_enabled_probes++;
-
-	if (num_enabled_probes == in_unitsize * 8) {
-		/* All probes are used -- no need to compress anything. */
-		memcpy(*data_out, data_in, length_in);
-		*length_out = length_in;
-		return SR_OK;
+	if ((ret = sr_filter_probes_into(in_unitsize, out_unitsize, probelist,
+			data_in, length_in, *data_out, length_out)) != SR_OK) {
+		free(*data_out);
+		*data_out = NULL;
 	}
 
-	/* If we reached this point, not all probes are used, so "compress". */
-	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
-		memcpy(&sample_in, data_in + in_offset, in_unitsize);
-		sample_out = out_bit = 0;
-		for (i = 0; probelist[i]; i++) {
-			if (sample_in & (1 << (probelist[i] - 1)))
-				sample_out |= (1 << out_bit);
-			out_bit++;
-		}
-		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
-		in_offset += in_unitsize;
-		out_offset += out_unitsize;
-	}
-	*length_out = out_offset;
-
-	return SR_OK;
+	return ret;
 }
@@ -215,7 +215,7 @@ static int receive_data(int fd, int revents, void *user_data)
 	struct sr_analog_sample *sample;
 	unsigned int sample_size = sizeof(struct sr_analog_sample) +
 		(NUM_PROBES * sizeof(struct sr_analog_probe));
-	char *outb;
+	struct sr_buffer *outb;
 	char inb[4096];
 	int i, x, count;
 
@@ -231,14 +231,15 @@ static int receive_data(int fd, int revents, void *user_data)
 			return FALSE;
 		}
 
-		if (!(outb = g_try_malloc(sample_size * count))) {
+		if (!(outb = sr_buffer_new(session_current(),
+					   sample_size * count))) {
 			sr_err("alsa: %s: outb malloc failed", __func__);
 			return FALSE;
 		}
 
 		for (i = 0; i < count; i++) {
 			sample = (struct sr_analog_sample *)
-						(outb + (i * sample_size));
+				((char *)outb->data + (i * sample_size));
 			sample->num_probes = NUM_PROBES;
 
 			for (x = 0; x < NUM_PROBES; x++) {
@@ -252,9 +253,9 @@ static int receive_data(int fd, int revents, void *user_data)
 		packet.type = SR_DF_ANALOG;
 		packet.length = count * sample_size;
 		packet.unitsize = sample_size;
-		packet.payload = outb;
+		packet.payload = outb->data;
 		sr_session_bus(user_data, &packet);
-		g_free(outb);
+		sr_buffer_unref(outb);
 		alsa->limit_samples -= count;
 
 	} while (alsa->limit_samples > 0);
@@ -902,6 +902,7 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			logic.length = tosend * sizeof(uint16_t);
 			logic.unitsize = 2;
 			logic.data = samples + sent;
+			logic.buffer = NULL;
 			sr_session_bus(sigma->session_id, &packet);
 
 			sent += tosend;
@@ -950,6 +951,7 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 				logic.length = tosend * sizeof(uint16_t);
 				logic.unitsize = 2;
 				logic.data = samples;
+				logic.buffer = NULL;
 				sr_session_bus(sigma->session_id, &packet);
 
 				sent += tosend;
@@ -977,6 +979,7 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			logic.length = tosend * sizeof(uint16_t);
 			logic.unitsize = 2;
 			logic.data = samples + sent;
+			logic.buffer = NULL;
 			sr_session_bus(sigma->session_id, &packet);
 		}
 
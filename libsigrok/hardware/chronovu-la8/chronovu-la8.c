@@ -837,14 +837,14 @@ static int la8_read_block(struct la8 *la8)
 		return SR_ERR_ARG;
 	}
 
-	sr_spew("la8: %s: reading block %d", __func__, la8->block_counter);
+	sr_spew_fast("la8: %s: reading block %d", __func__, la8->block_counter);
 
 	bytes_read = la8_read(la8, la8->mangled_buf, BS);
 
 	/* If first block read got 0 bytes, retry until success or timeout. */
 	if ((bytes_read == 0) && (la8->block_counter == 0)) {
 		do {
-			sr_spew("la8: %s: reading block 0 again", __func__);
+			sr_spew_fast("la8: %s: reading block 0 again", __func__);
 			bytes_read = la8_read(la8, la8->mangled_buf, BS);
 			/* TODO: How to handle read errors here? */
 			now = time(NULL);
@@ -857,9 +857,10 @@ static int la8_read_block(struct la8 *la8)
 		(void) la8_reset(la8); /* Ignore errors. */
 		return SR_ERR;
 	}
+	sr_trace(SR_TRACE_TRANSFER, SR_TRACE_INSTANT, bytes_read);
 
 	/* De-mangle the data. */
-	sr_spew("la8: de-mangling samples of block %d", la8->block_counter);
+	sr_spew_fast("la8: de-mangling samples of block %d", la8->block_counter);
 	byte_offset = la8->block_counter * BS;
 	m = byte_offset / (1024 * 1024);
 	mi = m * (1024 * 1024);
@@ -911,7 +912,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 	/* If no trigger was found, send one SR_DF_LOGIC packet. */
 	if (trigger_point == -1) {
 		/* Send an SR_DF_LOGIC packet to the session bus. */
-		sr_spew("la8: sending SR_DF_LOGIC packet (%d bytes) for "
+		sr_spew_fast("la8: sending SR_DF_LOGIC packet (%d bytes) for "
 		        "block %d", BS, block);
 		packet.type = SR_DF_LOGIC;
 		packet.timeoffset = block * BS * la8->period_ps;
@@ -920,6 +921,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 		logic.length = BS;
 		logic.unitsize = 1;
 		logic.data = la8->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_bus(la8->session_id, &packet);
 		return;
 	}
@@ -936,7 +938,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 	/* If at least one sample is located before the trigger... */
 	if (trigger_point > 0) {
 		/* Send pre-trigger SR_DF_LOGIC packet to the session bus. */
-		sr_spew("la8: sending pre-trigger SR_DF_LOGIC packet, "
+		sr_spew_fast("la8: sending pre-trigger SR_DF_LOGIC packet, "
 			"start = %d, length = %d", block * BS, trigger_point);
 		packet.type = SR_DF_LOGIC;
 		packet.timeoffset = block * BS * la8->period_ps;
@@ -945,6 +947,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 		logic.length = trigger_point;
 		logic.unitsize = 1;
 		logic.data = la8->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_bus(la8->session_id, &packet);
 	}
 
@@ -960,7 +963,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 	/* If at least one sample is located after the trigger... */
 	if (trigger_point < (BS - 1)) {
 		/* Send post-trigger SR_DF_LOGIC packet to the session bus. */
-		sr_spew("la8: sending post-trigger SR_DF_LOGIC packet, "
+		sr_spew_fast("la8: sending post-trigger SR_DF_LOGIC packet, "
 			"start = %d, length = %d",
 			(block * BS) + trigger_point, BS - trigger_point);
 		packet.type = SR_DF_LOGIC;
@@ -970,6 +973,7 @@ static void send_block_to_session_bus(struct la8 *la8, int block)
 		logic.length = BS - trigger_point;
 		logic.unitsize = 1;
 		logic.data = la8->final_buf + (block * BS) + trigger_point;
+		logic.buffer = NULL;
 		sr_session_bus(la8->session_id, &packet);
 	}
 }
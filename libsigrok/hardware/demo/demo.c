@@ -64,15 +64,42 @@ enum {
 	PATTERN_ALL_HIGH,
 };
 
-/* FIXME: Should not be global. */
+#ifdef _WIN32
+/* FIXME: Should not be global; session.c polls the pipe through it. */
 GIOChannel *channels[2];
+#endif
+
+/* Configuration of one demo device, in its instance's priv. */
+struct demo_device {
+	uint64_t cur_samplerate;
+	uint64_t limit_samples;
+	uint64_t limit_msec;
+	int pattern;
+	/* The running acquisition, if any */
+	struct databag *acquisition;
+};
 
+/* State of one acquisition. */
 struct databag {
 	int pipe_fds[2];
+	GIOChannel *channels[2];
 	uint8_t sample_generator;
-	uint8_t thread_running;
+	/* Position in the pattern being generated */
+	uint64_t pattern_pos;
+	volatile gint thread_running;
+	GThread *thread;
+	/* Set by receive_data() while the session can't keep up. */
+	volatile gint congested;
+	/* Samples the thread dropped, and receive_data() hasn't reported */
+	volatile gint samples_lost;
 	uint64_t samples_counter;
-	int device_index;
+	uint64_t samples_received;
+	/* The device's configuration when the acquisition started */
+	uint64_t samplerate;
+	uint64_t period_ps;
+	uint64_t limit_samples;
+	uint64_t limit_msec;
+	struct demo_device *device;
 	gpointer session_data;
 	GTimer *timer;
 };
@@ -115,28 +142,31 @@ static uint8_t pattern_sigrok[] = {
 
 /* List of struct sr_device_instance, maintained by opendev()/closedev(). */
 static GSList *device_instances = NULL;
-static uint64_t cur_samplerate = SR_KHZ(200);
-static uint64_t period_ps = 5000000;
-static uint64_t limit_samples = 0;
-static uint64_t limit_msec = 0;
-static int default_pattern = PATTERN_SIGROK;
-static GThread *my_thread;
-static int thread_running;
 
 static void hw_stop_acquisition(int device_index, gpointer session_data);
 
 static int hw_init(const char *deviceinfo)
 {
 	struct sr_device_instance *sdi;
+	struct demo_device *dev;
 
 	/* Avoid compiler warnings. */
 	deviceinfo = deviceinfo;
 
+	if (!(dev = g_try_malloc0(sizeof(struct demo_device)))) {
+		sr_err("demo: %s: dev malloc failed", __func__);
+		return 0;
+	}
+	dev->cur_samplerate = SR_KHZ(200);
+	dev->pattern = PATTERN_SIGROK;
+
 	sdi = sr_device_instance_new(0, SR_ST_ACTIVE, DEMONAME, NULL, NULL);
 	if (!sdi) {
 		sr_err("demo: %s: sr_device_instance_new failed", __func__);
+		g_free(dev);
 		return 0;
 	}
+	sdi->priv = dev;
 
 	device_instances = g_slist_append(device_instances, sdi);
 
@@ -171,12 +201,14 @@ static void hw_cleanup(void)
 static void *hw_get_device_info(int device_index, int device_info_id)
 {
 	struct sr_device_instance *sdi;
+	struct demo_device *dev;
 	void *info = NULL;
 
 	if (!(sdi = sr_get_device_instance(device_instances, device_index))) {
 		sr_err("demo: %s: sdi was NULL", __func__);
 		return NULL;
 	}
+	dev = sdi->priv;
 
 	switch (device_info_id) {
 	case SR_DI_INSTANCE:
@@ -189,7 +221,7 @@ static void *hw_get_device_info(int device_index, int device_info_id)
 		info = &samplerates;
 		break;
 	case SR_DI_CUR_SAMPLERATE:
-		info = &cur_samplerate;
+		info = &dev->cur_samplerate;
 		break;
 	case SR_DI_PATTERNMODES:
 		info = &pattern_strings;
@@ -214,49 +246,53 @@ static int *hw_get_capabilities(void)
 
 static int hw_set_configuration(int device_index, int capability, void *value)
 {
+	struct sr_device_instance *sdi;
+	struct demo_device *dev;
 	int ret;
 	char *stropt;
 
-	/* Avoid compiler warnings. */
-	device_index = device_index;
+	if (!(sdi = sr_get_device_instance(device_instances, device_index))) {
+		sr_err("demo: %s: sdi was NULL", __func__);
+		return SR_ERR;
+	}
+	dev = sdi->priv;
 
 	if (capability == SR_HWCAP_PROBECONFIG) {
 		/* Nothing to do, but must be supported */
 		ret = SR_OK;
 	} else if (capability == SR_HWCAP_SAMPLERATE) {
-		cur_samplerate = *(uint64_t *)value;
-		period_ps = 1000000000000 / cur_samplerate;
+		dev->cur_samplerate = *(uint64_t *)value;
 		sr_dbg("demo: %s: setting samplerate to %" PRIu64, __func__,
-		       cur_samplerate);
+		       dev->cur_samplerate);
 		ret = SR_OK;
 	} else if (capability == SR_HWCAP_LIMIT_SAMPLES) {
-		limit_samples = *(uint64_t *)value;
+		dev->limit_samples = *(uint64_t *)value;
 		sr_dbg("demo: %s: setting limit_samples to %" PRIu64, __func__,
-		       limit_samples);
+		       dev->limit_samples);
 		ret = SR_OK;
 	} else if (capability == SR_HWCAP_LIMIT_MSEC) {
-		limit_msec = *(uint64_t *)value;
+		dev->limit_msec = *(uint64_t *)value;
 		sr_dbg("demo: %s: setting limit_msec to %" PRIu64, __func__,
-		       limit_msec);
+		       dev->limit_msec);
 		ret = SR_OK;
 	} else if (capability == SR_HWCAP_PATTERN_MODE) {
 		stropt = value;
 		ret = SR_OK;
 		if (!strcmp(stropt, "sigrok")) {
-			default_pattern = PATTERN_SIGROK;
+			dev->pattern = PATTERN_SIGROK;
 		} else if (!strcmp(stropt, "random")) {
-			default_pattern = PATTERN_RANDOM;
+			dev->pattern = PATTERN_RANDOM;
 		} else if (!strcmp(stropt, "incremental")) {
-			default_pattern = PATTERN_INC;
+			dev->pattern = PATTERN_INC;
 		} else if (!strcmp(stropt, "all-low")) {
-			default_pattern = PATTERN_ALL_LOW;
+			dev->pattern = PATTERN_ALL_LOW;
 		} else if (!strcmp(stropt, "all-high")) {
-			default_pattern = PATTERN_ALL_HIGH;
+			dev->pattern = PATTERN_ALL_HIGH;
 		} else {
 			ret = SR_ERR;
 		}
 		sr_dbg("demo: %s: setting pattern to %d", __func__,
-		       default_pattern);
+		       dev->pattern);
 	} else {
 		ret = SR_ERR;
 	}
@@ -266,20 +302,21 @@ static int hw_set_configuration(int device_index, int capability, void *value)
 
 static void samples_generator(uint8_t *buf, uint64_t size, void *data)
 {
-	static uint64_t p = 0;
 	struct databag *mydata = data;
-	uint64_t i;
+	uint64_t i, p;
 
 	/* TODO: Needed? */
 	memset(buf, 0, size);
 
 	switch (mydata->sample_generator) {
 	case PATTERN_SIGROK: /* sigrok pattern */
+		p = mydata->pattern_pos;
 		for (i = 0; i < size; i++) {
 			*(buf + i) = ~(pattern_sigrok[p] >> 1);
 			if (++p == 64)
 				p = 0;
 		}
+		mydata->pattern_pos = p;
 		break;
 	case PATTERN_RANDOM: /* Random */
 		for (i = 0; i < size; i++)
@@ -307,23 +344,23 @@ static void thread_func(void *data)
 	struct databag *mydata = data;
 	uint8_t buf[BUFSIZE];
 	uint64_t nb_to_send = 0;
-	int bytes_written;
+	gsize bytes_written;
 	double time_cur, time_last, time_diff;
 
 	time_last = g_timer_elapsed(mydata->timer, NULL);
 
-	while (thread_running) {
+	while (g_atomic_int_get(&mydata->thread_running)) {
 		/* Rate control */
 		time_cur = g_timer_elapsed(mydata->timer, NULL);
 
 		time_diff = time_cur - time_last;
 		time_last = time_cur;
 
-		nb_to_send = cur_samplerate * time_diff;
+		nb_to_send = mydata->samplerate * time_diff;
 
-		if (limit_samples) {
-			nb_to_send = MIN(nb_to_send,
-				      limit_samples - mydata->samples_counter);
+		if (mydata->limit_samples) {
+			nb_to_send = MIN(nb_to_send, mydata->limit_samples
+					 - mydata->samples_counter);
 		}
 
 		/* Make sure we don't overflow. */
@@ -333,60 +370,131 @@ static void thread_func(void *data)
 			samples_generator(buf, nb_to_send, data);
 			mydata->samples_counter += nb_to_send;
 
-			g_io_channel_write_chars(channels[1], (gchar *)&buf,
-				nb_to_send, (gsize *)&bytes_written, NULL);
+			/*
+			 * Like real hardware, don't wait for the host: while
+			 * it can't keep up, or earlier losses haven't been
+			 * reported yet (so they stay in order), drop samples.
+			 */
+			bytes_written = 0;
+			if (!g_atomic_int_get(&mydata->congested)
+			    && !g_atomic_int_get(&mydata->samples_lost))
+				g_io_channel_write_chars(mydata->channels[1],
+					(gchar *)&buf, nb_to_send,
+					&bytes_written, NULL);
+			if (bytes_written < nb_to_send)
+				g_atomic_int_add(&mydata->samples_lost,
+					nb_to_send - bytes_written);
+			sr_trace(SR_TRACE_TRANSFER, SR_TRACE_INSTANT,
+				 bytes_written);
 		}
 
 		/* Check if we're done. */
-		if ((limit_msec && time_cur * 1000 > limit_msec) ||
-		    (limit_samples && mydata->samples_counter >= limit_samples))
+		if ((mydata->limit_msec && time_cur * 1000 > mydata->limit_msec)
+		    || (mydata->limit_samples
+			&& mydata->samples_counter >= mydata->limit_samples))
 		{
 			close(mydata->pipe_fds[1]);
-			thread_running = 0;
+			mydata->pipe_fds[1] = -1;
+			g_atomic_int_set(&mydata->thread_running, 0);
 		}
 
 		g_usleep(10);
 	}
 }
 
+/* Send the last packet, and free the acquisition's resources. */
+static void acquisition_end(struct databag *mydata)
+{
+	struct sr_datafeed_packet packet;
+
+	/* The thread never blocks on the pipe, so this doesn't take long. */
+	g_atomic_int_set(&mydata->thread_running, 0);
+	g_thread_join(mydata->thread);
+
+	/* Make sure we don't receive more packets. */
+	g_io_channel_close(mydata->channels[0]);
+	g_io_channel_unref(mydata->channels[0]);
+	if (mydata->pipe_fds[1] != -1)
+		close(mydata->pipe_fds[1]);
+	g_io_channel_unref(mydata->channels[1]);
+	g_timer_destroy(mydata->timer);
+
+	packet.type = SR_DF_END;
+	sr_session_bus(mydata->session_data, &packet);
+
+	mydata->device->acquisition = NULL;
+	g_free(mydata);
+}
+
+/* Report the samples the thread dropped since the last call. */
+static void send_overflow(struct databag *mydata)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_overflow overflow;
+	gint lost;
+
+	do {
+		lost = g_atomic_int_get(&mydata->samples_lost);
+	} while (!g_atomic_int_compare_and_exchange(&mydata->samples_lost,
+						    lost, 0));
+	if (lost == 0)
+		return;
+
+	packet.type = SR_DF_OVERFLOW;
+	packet.payload = &overflow;
+	packet.timeoffset = mydata->samples_received * mydata->period_ps;
+	packet.duration = lost * mydata->period_ps;
+	overflow.num_samples = lost;
+	sr_session_bus(mydata->session_data, &packet);
+	mydata->samples_received += lost;
+}
+
 /* Callback handling data */
-static int receive_data(int fd, int revents, void *session_data)
+static int receive_data(int fd, int revents, void *data)
 {
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
-	static uint64_t samples_received = 0;
-	unsigned char c[BUFSIZE];
+	struct databag *mydata = data;
+	struct sr_buffer *buffer;
+	gboolean running;
 	gsize z;
 
 	/* Avoid compiler warnings. */
 	fd = fd;
 	revents = revents;
 
+	/* Once it's stopped, all the thread sent is in the pipe. */
+	running = g_atomic_int_get(&mydata->thread_running);
+
 	do {
-		g_io_channel_read_chars(channels[0],
-				        (gchar *)&c, BUFSIZE, &z, NULL);
+		if (!(buffer = sr_buffer_new(session_current(), BUFSIZE)))
+			return TRUE;
+		g_io_channel_read_chars(mydata->channels[0],
+				        buffer->data, BUFSIZE, &z, NULL);
 
 		if (z > 0) {
 			packet.type = SR_DF_LOGIC;
 			packet.payload = &logic;
-			packet.timeoffset =  samples_received * period_ps;
-			packet.duration = z * period_ps;
+			packet.timeoffset = mydata->samples_received
+					    * mydata->period_ps;
+			packet.duration = z * mydata->period_ps;
 			logic.length = z;
 			logic.unitsize = 1;
-			logic.data = c;
-			sr_session_bus(session_data, &packet);
-			samples_received += z;
+			logic.data = buffer->data;
+			logic.buffer = buffer;
+			sr_session_bus(mydata->session_data, &packet);
+			mydata->samples_received += z;
 		}
+		sr_buffer_unref(buffer);
 	} while (z > 0);
 
-	if (!thread_running && z <= 0) {
-		/* Make sure we don't receive more packets. */
-		g_io_channel_close(channels[0]);
-
-		/* Send last packet. */
-		packet.type = SR_DF_END;
-		sr_session_bus(session_data, &packet);
+	/* Samples dropped come after everything that was in the pipe. */
+	send_overflow(mydata);
+	g_atomic_int_set(&mydata->congested,
+			 sr_session_bus_congested(mydata->session_data));
 
+	if (!running && z <= 0) {
+		acquisition_end(mydata);
 		return FALSE;
 	}
 
@@ -395,19 +503,33 @@ static int receive_data(int fd, int revents, void *session_data)
 
 static int hw_start_acquisition(int device_index, gpointer session_data)
 {
+	struct sr_device_instance *sdi;
 	struct sr_datafeed_packet *packet;
 	struct sr_datafeed_header *header;
+	struct demo_device *dev;
 	struct databag *mydata;
 
-	/* TODO: 'mydata' is never g_free()'d? */
-	if (!(mydata = g_try_malloc(sizeof(struct databag)))) {
+	if (!(sdi = sr_get_device_instance(device_instances, device_index)))
+		return SR_ERR;
+	dev = sdi->priv;
+	if (dev->acquisition) {
+		sr_err("demo: %s: acquisition already running", __func__);
+		return SR_ERR;
+	}
+
+	/* Freed when the acquisition ends, in receive_data(). */
+	if (!(mydata = g_try_malloc0(sizeof(struct databag)))) {
 		sr_err("demo: %s: mydata malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	mydata->sample_generator = default_pattern;
+	mydata->sample_generator = dev->pattern;
+	mydata->samplerate = dev->cur_samplerate;
+	mydata->period_ps = 1000000000000ULL / dev->cur_samplerate;
+	mydata->limit_samples = dev->limit_samples;
+	mydata->limit_msec = dev->limit_msec;
+	mydata->device = dev;
 	mydata->session_data = session_data;
-	mydata->device_index = device_index;
 	mydata->samples_counter = 0;
 
 	if (pipe(mydata->pipe_fds)) {
@@ -416,28 +538,41 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 		return SR_ERR;
 	}
 
-	channels[0] = g_io_channel_unix_new(mydata->pipe_fds[0]);
-	channels[1] = g_io_channel_unix_new(mydata->pipe_fds[1]);
+	mydata->channels[0] = g_io_channel_unix_new(mydata->pipe_fds[0]);
+	mydata->channels[1] = g_io_channel_unix_new(mydata->pipe_fds[1]);
+#ifdef _WIN32
+	channels[0] = mydata->channels[0];
+	channels[1] = mydata->channels[1];
+#endif
 
 	/* Set channel encoding to binary (default is UTF-8). */
-	g_io_channel_set_encoding(channels[0], NULL, NULL);
-	g_io_channel_set_encoding(channels[1], NULL, NULL);
+	g_io_channel_set_encoding(mydata->channels[0], NULL, NULL);
+	g_io_channel_set_encoding(mydata->channels[1], NULL, NULL);
 
 	/* Make channels to unbuffered. */
-	g_io_channel_set_buffered(channels[0], FALSE);
-	g_io_channel_set_buffered(channels[1], FALSE);
+	g_io_channel_set_buffered(mydata->channels[0], FALSE);
+	g_io_channel_set_buffered(mydata->channels[1], FALSE);
+
+	/*
+	 * A full pipe loses samples, rather than block the thread; while
+	 * the thread drops samples, receive_data() mustn't wait for more.
+	 */
+	g_io_channel_set_flags(mydata->channels[0], G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(mydata->channels[1], G_IO_FLAG_NONBLOCK, NULL);
 
 	sr_source_add(mydata->pipe_fds[0], G_IO_IN | G_IO_ERR, 40,
-		      receive_data, session_data);
+		      receive_data, mydata);
 
 	/* Run the demo thread. */
-	g_thread_init(NULL);
+	if (!g_thread_supported())
+		g_thread_init(NULL);
 	/* This must to be done between g_thread_init() & g_thread_create(). */
 	mydata->timer = g_timer_new();
-	thread_running = 1;
-	my_thread =
+	mydata->thread_running = 1;
+	dev->acquisition = mydata;
+	mydata->thread =
 	    g_thread_create((GThreadFunc)thread_func, mydata, TRUE, NULL);
-	if (!my_thread) {
+	if (!mydata->thread) {
 		sr_err("demo: %s: g_thread_create failed", __func__);
 		return SR_ERR; /* TODO */
 	}
@@ -458,7 +593,7 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 	packet->duration = 0;
 	header->feed_version = 1;
 	gettimeofday(&header->starttime, NULL);
-	header->samplerate = cur_samplerate;
+	header->samplerate = mydata->samplerate;
 	header->num_logic_probes = NUM_PROBES;
 	header->num_analog_probes = 0;
 	sr_session_bus(session_data, packet);
@@ -470,12 +605,22 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 
 static void hw_stop_acquisition(int device_index, gpointer session_data)
 {
+	struct sr_device_instance *sdi;
+	struct demo_device *dev;
+	struct databag *mydata;
+
 	/* Avoid compiler warnings. */
-	device_index = device_index;
 	session_data = session_data;
 
-	/* Stop generate thread. */
-	thread_running = 0;
+	if (!(sdi = sr_get_device_instance(device_instances, device_index)))
+		return;
+	dev = sdi->priv;
+
+	/* Stop generate thread, unless the acquisition ended already. */
+	if (!(mydata = dev->acquisition))
+		return;
+	sr_source_remove(mydata->pipe_fds[0]);
+	acquisition_end(mydata);
 }
 
 struct sr_device_plugin demo_plugin_info = {
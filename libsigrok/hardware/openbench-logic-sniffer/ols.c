@@ -688,10 +688,10 @@ static int receive_data(int fd, int revents, void *session_data)
 			return TRUE;
 
 		ols->sample[ols->num_bytes++] = byte;
-		sr_dbg("ols: received byte 0x%.2x", byte);
+		sr_spew_fast("ols: received byte 0x%.2x", byte);
 		if (ols->num_bytes == num_channels) {
 			/* Got a full sample. */
-			sr_dbg("ols: received sample 0x%.*x",
+			sr_spew_fast("ols: received sample 0x%.*x",
 			       ols->num_bytes * 2, *(int *)ols->sample);
 			if (ols->flag_reg & FLAG_RLE) {
 				/*
@@ -705,7 +705,7 @@ static int receive_data(int fd, int revents, void *session_data)
 					 * little-endian systems.
 					 */
 					ols->rle_count = *(int *)(ols->sample);
-					sr_dbg("ols: RLE count = %d", ols->rle_count);
+					sr_spew_fast("ols: RLE count = %d", ols->rle_count);
 					ols->num_bytes = 0;
 					return TRUE;
 				}
@@ -740,7 +740,7 @@ static int receive_data(int fd, int revents, void *session_data)
 					}
 				}
 				memcpy(ols->sample, ols->tmp_sample, 4);
-				sr_dbg("ols: full sample 0x%.8x", *(int *)ols->sample);
+				sr_spew_fast("ols: full sample 0x%.8x", *(int *)ols->sample);
 			}
 
 			/* the OLS sends its sample buffer backwards.
@@ -762,6 +762,8 @@ static int receive_data(int fd, int revents, void *session_data)
 		 * we've acquired all the samples we asked for -- we're done.
 		 * Send the (properly-ordered) buffer to the frontend.
 		 */
+		sr_trace(SR_TRACE_TRANSFER, SR_TRACE_INSTANT,
+			 ols->num_samples * 4);
 		if (ols->trigger_at != -1) {
 			/* a trigger was set up, so we need to tell the frontend
 			 * about it.
@@ -776,6 +778,7 @@ static int receive_data(int fd, int revents, void *session_data)
 				logic.unitsize = 4;
 				logic.data = ols->raw_sample_buf +
 					(ols->limit_samples - ols->num_samples) * 4;
+				logic.buffer = NULL;
 				sr_session_bus(session_data, &packet);
 			}
 
@@ -794,6 +797,7 @@ static int receive_data(int fd, int revents, void *session_data)
 			logic.unitsize = 4;
 			logic.data = ols->raw_sample_buf + ols->trigger_at * 4 +
 				(ols->limit_samples - ols->num_samples) * 4;
+			logic.buffer = NULL;
 			sr_session_bus(session_data, &packet);
 		} else {
 			/* no trigger was used */
@@ -805,6 +809,7 @@ static int receive_data(int fd, int revents, void *session_data)
 			logic.unitsize = 4;
 			logic.data = ols->raw_sample_buf +
 				(ols->limit_samples - ols->num_samples) * 4;
+			logic.buffer = NULL;
 			sr_session_bus(session_data, &packet);
 		}
 		g_free(ols->raw_sample_buf);
@@ -564,65 +564,84 @@ static int receive_data(int fd, int revents, void *user_data)
 	return TRUE;
 }
 
-void receive_transfer(struct libusb_transfer *transfer)
+static void abort_acquisition(struct fx2_device *fx2)
 {
-	/* TODO: these statics have to move to fx2_device struct */
-	static int num_samples = 0;
-	static int empty_transfer_count = 0;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	struct fx2_device *fx2;
-	int cur_buflen, trigger_offset, i;
-	unsigned char *cur_buf, *new_buf;
 
-	/* hw_stop_acquisition() is telling us to stop. */
-	if (transfer == NULL)
-		num_samples = -1;
-
-	/*
-	 * If acquisition has already ended, just free any queued up
-	 * transfer that come in.
-	 */
-	if (num_samples == -1) {
-		if (transfer)
-			libusb_free_transfer(transfer);
+	if (fx2->num_samples == -1)
 		return;
-	}
 
-	sr_info("saleae: receive_transfer(): status %d received %d bytes",
-		transfer->status, transfer->actual_length);
+	packet.type = SR_DF_END;
+	sr_session_bus(fx2->session_data, &packet);
 
-	/* Save incoming transfer before reusing the transfer struct. */
-	cur_buf = transfer->buffer;
-	cur_buflen = transfer->actual_length;
-	fx2 = transfer->user_data;
+	/* Any transfers still queued up are freed as they come in. */
+	fx2->num_samples = -1;
+}
 
-	/* Fire off a new request. */
-	if (!(new_buf = g_try_malloc(4096))) {
-		sr_err("saleae: %s: new_buf malloc failed", __func__);
-		// return SR_ERR_MALLOC;
-		return; /* FIXME */
+/* Find the slot holding the buffer a transfer's data is in. */
+static struct sr_buffer **transfer_buffer(struct fx2_device *fx2,
+					  unsigned char *data)
+{
+	int i;
+
+	for (i = 0; i < NUM_SIMUL_TRANSFERS; i++) {
+		if (fx2->transfer_buffers[i]
+		    && fx2->transfer_buffers[i]->data == data)
+			return &fx2->transfer_buffers[i];
 	}
 
-	transfer->buffer = new_buf;
-	transfer->length = 4096;
-	if (libusb_submit_transfer(transfer) != 0) {
-		/* TODO: Stop session? */
-		sr_warn("eek");
+	return NULL;
+}
+
+/*
+ * A transfer couldn't be resubmitted. With fewer transfers queued up, the
+ * FX2's FIFO may overrun from here on, so tell the frontend.
+ */
+static void transfer_lost(struct fx2_device *fx2,
+			  struct libusb_transfer *transfer)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_overflow overflow;
+
+	libusb_free_transfer(transfer);
+	if (fx2->num_samples == -1)
+		return;
+
+	packet.type = SR_DF_OVERFLOW;
+	packet.timeoffset = fx2->num_samples * fx2->period_ps;
+	packet.duration = 0;
+	packet.payload = &overflow;
+	overflow.num_samples = 0;
+	sr_session_bus(fx2->session_data, &packet);
+
+	if (--fx2->num_transfers == 0) {
+		sr_err("saleae: %s: no transfers left", __func__);
+		abort_acquisition(fx2);
 	}
+}
+
+/* Send the samples of a finished transfer, and look for the trigger. */
+static void receive_samples(struct fx2_device *fx2,
+			    struct sr_buffer *cur_buffer,
+			    unsigned char *cur_buf, int cur_buflen)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	int trigger_offset, i;
 
 	if (cur_buflen == 0) {
-		empty_transfer_count++;
-		if (empty_transfer_count > MAX_EMPTY_TRANSFERS) {
+		fx2->empty_transfer_count++;
+		if (fx2->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
 			/*
 			 * The FX2 gave up. End the acquisition, the frontend
 			 * will work out that the samplecount is short.
 			 */
-			hw_stop_acquisition(-1, fx2->session_data);
+			abort_acquisition(fx2);
 		}
+		sr_buffer_unref(cur_buffer);
 		return;
 	} else {
-		empty_transfer_count = 0;
+		fx2->empty_transfer_count = 0;
 	}
 
 	trigger_offset = 0;
@@ -643,7 +662,7 @@ void receive_transfer(struct libusb_transfer *transfer)
 					 * Tell the frontend we hit the trigger here.
 					 */
 					packet.type = SR_DF_TRIGGER;
-					packet.timeoffset = (num_samples + i) * fx2->period_ps;
+					packet.timeoffset = (fx2->num_samples + i) * fx2->period_ps;
 					packet.duration = 0;
 					packet.payload = NULL;
 					sr_session_bus(fx2->session_data, &packet);
@@ -653,17 +672,19 @@ void receive_transfer(struct libusb_transfer *transfer)
 					 * skipping past them.
 					 */
 					packet.type = SR_DF_LOGIC;
-					packet.timeoffset = (num_samples + i) * fx2->period_ps;
+					packet.timeoffset = (fx2->num_samples + i) * fx2->period_ps;
 					packet.duration = fx2->trigger_stage * fx2->period_ps;
 					packet.payload = &logic;
 					logic.length = fx2->trigger_stage;
 					logic.unitsize = 1;
 					logic.data = fx2->trigger_buffer;
+					logic.buffer = NULL;
 					sr_session_bus(fx2->session_data, &packet);
 
 					fx2->trigger_stage = TRIGGER_FIRED;
 					break;
 				}
+				sr_buffer_unref(cur_buffer);
 				return;
 			}
 
@@ -687,25 +708,85 @@ void receive_transfer(struct libusb_transfer *transfer)
 	if (fx2->trigger_stage == TRIGGER_FIRED) {
 		/* Send the incoming transfer to the session bus. */
 		packet.type = SR_DF_LOGIC;
-		packet.timeoffset = num_samples * fx2->period_ps;
+		packet.timeoffset = fx2->num_samples * fx2->period_ps;
 		packet.duration = cur_buflen * fx2->period_ps;
 		packet.payload = &logic;
 		logic.length = cur_buflen - trigger_offset;
 		logic.unitsize = 1;
 		logic.data = cur_buf + trigger_offset;
+		logic.buffer = cur_buffer;
 		sr_session_bus(fx2->session_data, &packet);
-		g_free(cur_buf);
 
-		num_samples += cur_buflen;
-		if (fx2->limit_samples && (unsigned int) num_samples > fx2->limit_samples) {
-			hw_stop_acquisition(-1, fx2->session_data);
-		}
+		fx2->num_samples += cur_buflen;
+		if (fx2->limit_samples &&
+		    (unsigned int) fx2->num_samples > fx2->limit_samples)
+			abort_acquisition(fx2);
 	} else {
 		/*
 		 * TODO: Buffer pre-trigger data in capture
 		 * ratio-sized buffer.
 		 */
 	}
+	sr_buffer_unref(cur_buffer);
+}
+
+void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct fx2_device *fx2;
+	struct sr_buffer **slot, *cur_buffer, *new_buffer;
+	int cur_buflen;
+	unsigned char *cur_buf;
+	gboolean resubmitted;
+
+	fx2 = transfer->user_data;
+	if (!(slot = transfer_buffer(fx2, transfer->buffer))) {
+		sr_err("saleae: %s: transfer with unknown buffer", __func__);
+		return;
+	}
+
+	/*
+	 * If acquisition has already ended, just free any queued up
+	 * transfer that come in.
+	 */
+	if (fx2->num_samples == -1) {
+		sr_buffer_unref(*slot);
+		*slot = NULL;
+		libusb_free_transfer(transfer);
+		return;
+	}
+
+	sr_info_fast("saleae: receive_transfer(): status %d received %d bytes",
+		transfer->status, transfer->actual_length);
+	sr_trace(SR_TRACE_TRANSFER, SR_TRACE_INSTANT, transfer->actual_length);
+
+	/* Save incoming transfer before reusing the transfer struct. */
+	cur_buffer = *slot;
+	cur_buf = transfer->buffer;
+	cur_buflen = transfer->actual_length;
+
+	/* Fire off a new request. */
+	resubmitted = FALSE;
+	if (!(new_buffer = sr_buffer_new(session_current(), 4096))) {
+		sr_err("saleae: %s: new_buffer malloc failed", __func__);
+		*slot = NULL;
+	} else {
+		*slot = new_buffer;
+		transfer->buffer = new_buffer->data;
+		transfer->length = 4096;
+		if (libusb_submit_transfer(transfer) == 0) {
+			resubmitted = TRUE;
+		} else {
+			sr_err("saleae: %s: failed to resubmit transfer",
+			       __func__);
+			sr_buffer_unref(new_buffer);
+			*slot = NULL;
+		}
+	}
+
+	receive_samples(fx2, cur_buffer, cur_buf, cur_buflen);
+
+	if (!resubmitted)
+		transfer_lost(fx2, transfer);
 }
 
 static int hw_start_acquisition(int device_index, gpointer session_data)
@@ -716,13 +797,16 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 	struct fx2_device *fx2;
 	struct libusb_transfer *transfer;
 	const struct libusb_pollfd **lupfd;
+	struct sr_buffer *buffer;
 	int size, i;
-	unsigned char *buf;
 
 	if (!(sdi = sr_get_device_instance(device_instances, device_index)))
 		return SR_ERR;
 	fx2 = sdi->priv;
 	fx2->session_data = session_data;
+	fx2->num_samples = 0;
+	fx2->empty_transfer_count = 0;
+	fx2->num_transfers = 0;
 
 	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
 		sr_err("saleae: %s: packet malloc failed", __func__);
@@ -737,20 +821,23 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 	/* Start with 2K transfer, subsequently increased to 4K. */
 	size = 2048;
 	for (i = 0; i < NUM_SIMUL_TRANSFERS; i++) {
-		if (!(buf = g_try_malloc(size))) {
-			sr_err("saleae: %s: buf malloc failed", __func__);
+		if (!(buffer = sr_buffer_new(session_current(), size))) {
+			sr_err("saleae: %s: buffer malloc failed", __func__);
 			return SR_ERR_MALLOC;
 		}
+		fx2->transfer_buffers[i] = buffer;
 		transfer = libusb_alloc_transfer(0);
 		libusb_fill_bulk_transfer(transfer, sdi->usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
+				2 | LIBUSB_ENDPOINT_IN, buffer->data, size,
 				receive_transfer, fx2, 40);
 		if (libusb_submit_transfer(transfer) != 0) {
 			/* TODO: Free them all. */
 			libusb_free_transfer(transfer);
-			g_free(buf);
+			sr_buffer_unref(buffer);
+			fx2->transfer_buffers[i] = NULL;
 			return SR_ERR;
 		}
+		fx2->num_transfers++;
 		size = 4096;
 	}
 
@@ -774,18 +861,17 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 	return SR_OK;
 }
 
-/* This stops acquisition on ALL devices, ignoring device_index. */
 static void hw_stop_acquisition(int device_index, gpointer session_data)
 {
-	struct sr_datafeed_packet packet;
+	struct sr_device_instance *sdi;
 
 	/* Avoid compiler warnings. */
-	device_index = device_index;
+	session_data = session_data;
 
-	packet.type = SR_DF_END;
-	sr_session_bus(session_data, &packet);
+	if (!(sdi = sr_get_device_instance(device_instances, device_index)))
+		return;
 
-	receive_transfer(NULL);
+	abort_acquisition(sdi->priv);
 
 	/* TODO: Need to cancel and free any queued up transfers. */
 }
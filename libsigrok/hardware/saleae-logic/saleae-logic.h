@@ -72,7 +72,13 @@ struct fx2_device {
 	 * on the session bus along with samples.
 	 */
 	void *session_data;
-
+	/* Samples received so far, -1 once the acquisition has ended. */
+	int num_samples;
+	int empty_transfer_count;
+	/* Transfers queued up, less those which couldn't be resubmitted */
+	int num_transfers;
+	/* Buffers the queued transfers are reading into */
+	struct sr_buffer *transfer_buffers[NUM_SIMUL_TRANSFERS];
 };
 
 
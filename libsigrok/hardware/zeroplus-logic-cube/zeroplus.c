@@ -545,6 +545,7 @@ static int hw_start_acquisition(int device_index, gpointer session_data)
 		logic.length = PACKET_SIZE;
 		logic.unitsize = 4;
 		logic.data = buf;
+		logic.buffer = NULL;
 		sr_session_bus(session_data, &packet);
 		samples_read += res / 4;
 	}
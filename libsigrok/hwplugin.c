@@ -40,6 +40,9 @@ struct sr_hwcap_option sr_hwcap_options[] = {
 	{SR_HWCAP_CAPTURE_RATIO, SR_T_UINT64, "Pre-trigger capture ratio", "captureratio"},
 	{SR_HWCAP_PATTERN_MODE, SR_T_CHAR, "Pattern generator mode", "patternmode"},
 	{SR_HWCAP_RLE, SR_T_BOOL, "Run Length Encoding", "rle"},
+	{SR_HWCAP_CAPTURE_PACKET_SIZE, SR_T_UINT64, "Replay packet size", "packetsize"},
+	{SR_HWCAP_CAPTURE_SPEED, SR_T_CHAR, "Replay speed", "speed"},
+	{SR_HWCAP_CAPTURE_LOOP, SR_T_BOOL, "Replay in a loop", "loop"},
 	{0, 0, NULL, NULL},
 };
 
@@ -268,15 +271,46 @@ struct sr_hwcap_option *sr_find_hwcap_option(int hwcap)
 	return NULL;
 }
 
-/* unnecessary level of indirection follows. */
+/*
+ * Drivers add and remove their sources from start_acquisition(),
+ * stop_acquisition() or a source callback; the sources belong to the
+ * session these are running for.
+ */
 
 void sr_source_remove(int fd)
 {
-	sr_session_source_remove(fd);
+	struct sr_session *session;
+
+	if (!(session = session_current())) {
+		sr_err("hwplugin: %s: not called for a session", __func__);
+		return;
+	}
+
+	sr_session_source_remove(session, fd);
+}
+
+void sr_source_remove_callback(sr_receive_data_callback rcv_cb,
+			       void *user_data)
+{
+	struct sr_session *session;
+
+	if (!(session = session_current())) {
+		sr_err("hwplugin: %s: not called for a session", __func__);
+		return;
+	}
+
+	sr_session_source_remove_callback(session, rcv_cb, user_data);
 }
 
 void sr_source_add(int fd, int events, int timeout,
 		   sr_receive_data_callback rcv_cb, void *user_data)
 {
-	sr_session_source_add(fd, events, timeout, rcv_cb, user_data);
+	struct sr_session *session;
+
+	if (!(session = session_current())) {
+		sr_err("hwplugin: %s: not called for a session", __func__);
+		return;
+	}
+
+	sr_session_source_add(session, fd, events, timeout, rcv_cb, user_data);
 }
@@ -23,7 +23,8 @@
 #include <sigrok.h>
 #include <sigrok-internal.h>
 
-static int sr_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
+/* Not static, so sr_log_enabled() can check it inline. */
+int sr_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
 
 /**
  * Set the libsigrok loglevel.
@@ -0,0 +1,378 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Pool of large buffers (datastore chunks, datafeed buffers), shared by
+ * all sessions.
+ *
+ * Block sizes are rounded up to a size class; freed blocks are kept on
+ * their class's free list and handed out again by the next allocation of
+ * that class, so repeated captures of similar size don't go back to the
+ * system allocator at all. At most cache_limit bytes are kept around.
+ *
+ * Size classes are geometric: every power of two from 2^POOL_MIN_SHIFT up
+ * is split into 2^POOL_STEP_SHIFT classes, so a block is never more than
+ * 12.5% larger than asked for, and the class of a size is computed rather
+ * than looked up.
+ */
+
+#define POOL_MIN_SHIFT		12
+#define POOL_MAX_SHIFT		48
+#define POOL_STEP_SHIFT		3
+#define POOL_NUM_CLASSES	(((POOL_MAX_SHIFT - POOL_MIN_SHIFT) \
+				  << POOL_STEP_SHIFT) + 1)
+/* Size of a huge page, and the smallest block worth putting in one. */
+#define POOL_HUGE_PAGE		(2 * 1024 * 1024)
+#define POOL_HUGE_MIN		(POOL_HUGE_PAGE / 2)
+
+struct pool_class {
+	uint64_t size;
+	/* Blocks of this class are mmap()ed and huge page backed. */
+	gboolean huge;
+	GSList *free;
+};
+
+static GStaticMutex pool_mutex = G_STATIC_MUTEX_INIT;
+/* Regular and huge page backed classes, by class index. */
+static struct pool_class classes[2][POOL_NUM_CLASSES];
+/* Blocks currently handed out, and the class they belong to. */
+static GHashTable *live = NULL;
+static uint64_t cache_limit = POOL_CACHE_LIMIT;
+static gboolean use_hugepages = FALSE;
+static struct sr_pool_stats stats;
+
+static void *huge_alloc(uint64_t size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	uint8_t *map, *block;
+	uint64_t head;
+
+#ifdef MAP_HUGETLB
+	block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (block != MAP_FAILED)
+		return block;
+#endif
+
+	/*
+	 * No reserved huge pages available: map a huge page aligned region
+	 * and ask for transparent huge pages instead.
+	 */
+	map = mmap(NULL, size + POOL_HUGE_PAGE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	block = (uint8_t *)(((uintptr_t)map + POOL_HUGE_PAGE - 1)
+			    & ~(uintptr_t)(POOL_HUGE_PAGE - 1));
+	head = block - map;
+	if (head)
+		munmap(map, head);
+	munmap(block + size, POOL_HUGE_PAGE - head);
+#ifdef MADV_HUGEPAGE
+	madvise(block, size, MADV_HUGEPAGE);
+#endif
+
+	return block;
+#else
+	/* Avoid compiler warnings. */
+	size = size;
+
+	return NULL;
+#endif
+}
+
+static void block_release(struct pool_class *class, void *block)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	if (class->huge) {
+		munmap(block, class->size);
+		stats.bytes_huge -= class->size;
+		return;
+	}
+#endif
+	g_free(block);
+}
+
+/*
+ * The index of the smallest class holding size bytes, and that class's
+ * block size. Class 0 holds up to 2^POOL_MIN_SHIFT bytes; the classes
+ * after it hold 2^s + k * 2^(s - POOL_STEP_SHIFT) bytes, for k = 1 to
+ * 2^POOL_STEP_SHIFT, for every s from POOL_MIN_SHIFT up.
+ */
+static guint class_index(uint64_t size, uint64_t *class_size)
+{
+	uint64_t step;
+	guint shift, k;
+
+	if (size <= G_GUINT64_CONSTANT(1) << POOL_MIN_SHIFT) {
+		*class_size = G_GUINT64_CONSTANT(1) << POOL_MIN_SHIFT;
+		return 0;
+	}
+
+	shift = 63 - __builtin_clzll(size - 1);
+	step = G_GUINT64_CONSTANT(1) << (shift - POOL_STEP_SHIFT);
+	k = (size - 1 - (G_GUINT64_CONSTANT(1) << shift)) / step + 1;
+	*class_size = (G_GUINT64_CONSTANT(1) << shift) + k * step;
+
+	return ((shift - POOL_MIN_SHIFT) << POOL_STEP_SHIFT) + k;
+}
+
+static struct pool_class *get_class(uint64_t size)
+{
+	struct pool_class *class;
+	uint64_t class_size;
+	gboolean huge;
+	guint index;
+
+	huge = FALSE;
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	if (use_hugepages && size >= POOL_HUGE_MIN) {
+		size = (size + POOL_HUGE_PAGE - 1)
+		       & ~(uint64_t)(POOL_HUGE_PAGE - 1);
+		huge = TRUE;
+	}
+#endif
+	if (size > G_GUINT64_CONSTANT(1) << POOL_MAX_SHIFT) {
+		sr_err("pool: %s: %" PRIu64 " bytes is too large", __func__,
+		       size);
+		return NULL;
+	}
+	index = class_index(size, &class_size);
+	if (huge)
+		class_size = (class_size + POOL_HUGE_PAGE - 1)
+			     & ~(uint64_t)(POOL_HUGE_PAGE - 1);
+
+	class = &classes[huge][index];
+	if (!class->size) {
+		class->size = class_size;
+		class->huge = huge;
+	}
+
+	return class;
+}
+
+/*
+ * Allocate a block of at least size bytes from the pool. The block must
+ * be given back with pool_free(), not g_free().
+ */
+void *pool_alloc(uint64_t size)
+{
+	struct pool_class *class;
+	void *block;
+
+	if (size == 0)
+		return NULL;
+
+	g_static_mutex_lock(&pool_mutex);
+
+	block = NULL;
+	if (!live && !(live = g_hash_table_new(g_direct_hash, g_direct_equal)))
+		goto out;
+	if (!(class = get_class(size)))
+		goto out;
+
+	if (class->free) {
+		block = class->free->data;
+		class->free = g_slist_delete_link(class->free, class->free);
+		stats.bytes_cached -= class->size;
+		stats.reuses++;
+	} else {
+		if (class->huge) {
+			if ((block = huge_alloc(class->size)))
+				stats.bytes_huge += class->size;
+			else
+				sr_err("pool: %s: failed to map %" PRIu64
+				       " bytes", __func__, class->size);
+		} else if (!(block = g_try_malloc(class->size))) {
+			sr_err("pool: %s: block malloc failed", __func__);
+		}
+		if (!block)
+			goto out;
+	}
+
+	g_hash_table_insert(live, block, class);
+	stats.allocs++;
+	stats.bytes_in_use += class->size;
+	if (stats.bytes_in_use > stats.bytes_peak)
+		stats.bytes_peak = stats.bytes_in_use;
+
+out:
+	g_static_mutex_unlock(&pool_mutex);
+
+	return block;
+}
+
+/*
+ * Give a block obtained from pool_alloc() back to the pool. It's kept for
+ * reuse, unless that would take the pool over its cache limit.
+ */
+void pool_free(void *block)
+{
+	struct pool_class *class;
+
+	if (!block)
+		return;
+
+	g_static_mutex_lock(&pool_mutex);
+
+	if (!live || !(class = g_hash_table_lookup(live, block))) {
+		sr_err("pool: %s: %p was not allocated from the pool",
+		       __func__, block);
+		goto out;
+	}
+	g_hash_table_remove(live, block);
+	stats.frees++;
+	stats.bytes_in_use -= class->size;
+
+	if (stats.bytes_cached + class->size > cache_limit) {
+		block_release(class, block);
+		goto out;
+	}
+	class->free = g_slist_prepend(class->free, block);
+	stats.bytes_cached += class->size;
+
+out:
+	g_static_mutex_unlock(&pool_mutex);
+}
+
+static void pool_trim_locked(void)
+{
+	struct pool_class *class;
+	GSList *b;
+	guint i;
+
+	for (i = 0; i < 2 * POOL_NUM_CLASSES; i++) {
+		class = &classes[i / POOL_NUM_CLASSES][i % POOL_NUM_CLASSES];
+		for (b = class->free; b; b = b->next)
+			block_release(class, b->data);
+		g_slist_free(class->free);
+		class->free = NULL;
+	}
+	stats.bytes_cached = 0;
+}
+
+/*
+ * Release all cached blocks; called from sr_exit(). Blocks still handed
+ * out at this point are leaked, and only reported.
+ */
+void pool_cleanup(void)
+{
+	g_static_mutex_lock(&pool_mutex);
+
+	pool_trim_locked();
+
+	if (live && g_hash_table_size(live) > 0) {
+		sr_warn("pool: %u blocks (%" PRIu64 " bytes) still in use "
+			"at exit", g_hash_table_size(live),
+			stats.bytes_in_use);
+		goto out;
+	}
+
+	if (live)
+		g_hash_table_destroy(live);
+	live = NULL;
+
+out:
+	g_static_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * Enable or disable huge pages for large pool blocks.
+ *
+ * When enabled, blocks of 1MB and larger are allocated from reserved huge
+ * pages if possible, or as transparent huge pages otherwise. Only affects
+ * blocks allocated afterwards. Not available on platforms without mmap().
+ *
+ * @param enable TRUE to use huge pages, FALSE to use regular memory.
+ * @return SR_OK upon success, SR_ERR if huge pages aren't supported.
+ */
+int sr_pool_set_hugepages(gboolean enable)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	g_static_mutex_lock(&pool_mutex);
+	use_hugepages = enable;
+	g_static_mutex_unlock(&pool_mutex);
+
+	return SR_OK;
+#else
+	return enable ? SR_ERR : SR_OK;
+#endif
+}
+
+/**
+ * Set the maximum number of bytes the pool keeps around for reuse.
+ *
+ * Blocks in excess of the new limit are released right away.
+ *
+ * @param limit The limit in bytes, or 0 to never keep freed blocks.
+ * @return SR_OK upon success.
+ */
+int sr_pool_set_cache_limit(uint64_t limit)
+{
+	g_static_mutex_lock(&pool_mutex);
+	cache_limit = limit;
+	if (stats.bytes_cached > cache_limit)
+		pool_trim_locked();
+	g_static_mutex_unlock(&pool_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Release all blocks the pool keeps around for reuse.
+ *
+ * @return SR_OK upon success.
+ */
+int sr_pool_trim(void)
+{
+	g_static_mutex_lock(&pool_mutex);
+	pool_trim_locked();
+	g_static_mutex_unlock(&pool_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Get the pool's allocation statistics.
+ *
+ * @param pool_stats The struct to fill in.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_pool_get_stats(struct sr_pool_stats *pool_stats)
+{
+	if (!pool_stats)
+		return SR_ERR_ARG;
+
+	g_static_mutex_lock(&pool_mutex);
+	*pool_stats = stats;
+	g_static_mutex_unlock(&pool_mutex);
+
+	return SR_OK;
+}
@@ -22,12 +22,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <glib.h>
 #include <sigrok.h>
 #include <sigrok-internal.h>
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#ifndef USE_EPOLL
 /* demo.c */
 extern GIOChannel channels[2];
+#endif
+
+/* Maximum number of events handled per epoll_wait() */
+#define MAX_EVENTS 32
+
+/* Marks an epoll event as coming from a source's timer, not its fd. */
+#define TIMER_EVENT (1ULL << 32)
 
 struct source {
 	int fd;
@@ -35,49 +51,243 @@ struct source {
 	int timeout;
 	sr_receive_data_callback cb;
 	void *user_data;
+	/* Index in sources (fd >= 0) or idle_sources (fd < 0) */
+	guint index;
+	/* When the source last had an event or timed out, in us */
+	gint64 last_active;
+#ifdef USE_EPOLL
+	/* Fires when the source may have timed out, or -1 */
+	int timerfd;
+	/* The fd can't be polled, and is always considered ready */
+	gboolean always_ready;
+#endif
+};
+
+/*
+ * A set of event sources and the means to wait for them. Each session has
+ * one for the thread running sr_session_run(); in threaded mode, each
+ * device thread has its own.
+ *
+ * Sources with a file descriptor are kept in sources, along with a lookup
+ * table from descriptor to source. Sources without one (fd < 0) are idle
+ * sources: their callback runs on every iteration of the loop, or, if
+ * they have a timeout, every timeout ms (timer sources).
+ */
+struct sr_event_loop {
+	GPtrArray *sources;
+	GHashTable *source_fds;
+	GPtrArray *idle_sources;
+#ifdef USE_EPOLL
+	int epfd;
+#else
+	/* The g_poll() array, kept in step with sources. */
+	GArray *pollfds;
+	/* The entries of pollfds ready in this iteration */
+	GArray *ready;
+#endif
+	/* Logic data held back per device, see sr_session_set_coalescing(). */
+	GHashTable *batches;
+};
+
+/* Contiguous logic packets of one device, merged into one. */
+struct batch {
+	struct sr_session *session;
+	struct sr_device *device;
+	struct sr_buffer *buffer;
+	/* The packet to send, once done; logic.length is 0 while empty. */
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	/* When the first packet of the batch came in */
+	gint64 started;
 };
 
-/* There can only be one session at a time. */
-struct sr_session *session;
-int num_sources = 0;
+/* What the calling thread is doing, and for which session. */
+struct context {
+	struct sr_session *session;
+	/* The device thread it is, or acts for; NULL for none. */
+	struct device_thread *dt;
+};
+
+/* A device's acquisition thread, in threaded mode. */
+struct device_thread {
+	struct sr_device *device;
+	struct context ctx;
+	struct sr_event_loop loop;
+	/* Queue to the datafeed thread, while that runs. */
+	struct sr_datafeed_ring *ring;
+	GThread *thread;
+};
+
+/* How long a device thread waits for events before checking for a halt. */
+#define DEVICE_THREAD_WAIT_MS	100
+
+/* The context of the calling thread, if it's doing anything for a session. */
+static GStaticPrivate current_context = G_STATIC_PRIVATE_INIT;
+
+static void datafeed_thread_stop(struct sr_session *session);
+static void device_threads_join(struct sr_session *session);
+static void device_threads_free(struct sr_session *session);
+static void loop_cleanup(struct sr_event_loop *loop);
+static int loop_batch_wait(struct sr_event_loop *loop, int max_wait);
+static void loop_flush_batches(struct sr_event_loop *loop, gboolean all);
+static gint64 now_usec(void);
+
+static struct context *context_get(void)
+{
+	return g_static_private_get(&current_context);
+}
+
+/* Make ctx the calling thread's context; returns the previous one. */
+static struct context *context_enter(struct context *ctx)
+{
+	struct context *prev;
+
+	prev = g_static_private_get(&current_context);
+	g_static_private_set(&current_context, ctx, NULL);
+
+	return prev;
+}
+
+static void context_leave(struct context *prev)
+{
+	g_static_private_set(&current_context, prev, NULL);
+}
+
+/*
+ * The session the calling thread is working for: the one whose
+ * start_acquisition(), stop_acquisition() or event source callback is
+ * running. Drivers use this to add their event sources.
+ */
+struct sr_session *session_current(void)
+{
+	struct context *ctx;
 
-struct source *sources = NULL;
-int source_timeout = -1;
+	if (!(ctx = context_get()))
+		return NULL;
 
+	return ctx->session;
+}
 
+/**
+ * Create a new session.
+ *
+ * Sessions are independent of each other, and can run concurrently on
+ * different threads; a device can only be part of one session at a time.
+ *
+ * @return The new session, or NULL upon errors.
+ */
 struct sr_session *sr_session_new(void)
 {
-	session = calloc(1, sizeof(struct sr_session));
+	struct sr_session *session;
+
+	if (!(session = g_try_malloc0(sizeof(struct sr_session)))) {
+		sr_err("session: %s: session malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(session->main_loop = g_try_malloc0(sizeof(struct sr_event_loop)))) {
+		sr_err("session: %s: main loop malloc failed", __func__);
+		g_free(session);
+		return NULL;
+	}
+
+	if (!(session->buffer_pool = buffer_pool_new())) {
+		g_free(session->main_loop);
+		g_free(session);
+		return NULL;
+	}
+	g_static_mutex_init(&session->threads_mutex);
+	g_static_mutex_init(&session->stop_mutex);
+	g_static_mutex_init(&session->stats_mutex);
 
 	return session;
 }
 
-void sr_session_destroy(void)
+/**
+ * Destroy a session.
+ *
+ * Stops all threads of the session, and closes the devices added to it.
+ * The devices themselves are not freed.
+ *
+ * @param session The session to destroy.
+ */
+void sr_session_destroy(struct sr_session *session)
 {
+	struct sr_device *device;
+	GSList *l;
+
+	if (!session)
+		return;
+
+	datafeed_thread_stop(session);
+	device_threads_join(session);
+	device_threads_free(session);
+	loop_cleanup(session->main_loop);
+	g_free(session->main_loop);
 
+	for (l = session->devices; l; l = l->next) {
+		device = l->data;
+		if (device->plugin && device->plugin->closedev)
+			device->plugin->closedev(device->plugin_index);
+		device->session = NULL;
+		g_free(device->stats);
+		device->stats = NULL;
+	}
 	g_slist_free(session->devices);
+	sr_session_datafeed_callback_clear(session);
 
 	/* TODO: Loop over protocol decoders and free them. */
 
+	/* Buffers still referenced elsewhere keep the pool alive. */
+	buffer_pool_unref(session->buffer_pool);
+	g_static_mutex_free(&session->threads_mutex);
+	g_static_mutex_free(&session->stop_mutex);
+	g_static_mutex_free(&session->stats_mutex);
 	g_free(session);
 }
 
-void sr_session_device_clear(void)
+void sr_session_device_clear(struct sr_session *session)
 {
+	struct sr_device *device;
+	GSList *l;
+
+	for (l = session->devices; l; l = l->next) {
+		device = l->data;
+		device->session = NULL;
+		g_free(device->stats);
+		device->stats = NULL;
+	}
 	g_slist_free(session->devices);
 	session->devices = NULL;
 }
 
-int sr_session_device_add(struct sr_device *device)
+int sr_session_device_add(struct sr_session *session,
+			  struct sr_device *device)
 {
 	int ret;
 
+	if (device->session && device->session != session) {
+		sr_err("session: %s: device is in use by another session",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!device->stats) {
+		if (!(device->stats = g_try_malloc0(
+				sizeof(struct sr_device_stats)))) {
+			sr_err("session: %s: stats malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		device->stats->device = device;
+	}
+
 	if (device->plugin && device->plugin->opendev) {
 		ret = device->plugin->opendev(device->plugin_index);
 		if (ret != SR_OK)
 			return ret;
 	}
 
+	device->session = session;
 	session->devices = g_slist_append(session->devices, device);
 
 	return SR_OK;
@@ -100,208 +310,1582 @@ void sr_session_pa_add(struct sr_analyzer *an)
 }
 #endif
 
-void sr_session_datafeed_callback_clear(void)
+void sr_session_datafeed_callback_clear(struct sr_session *session)
 {
+	GSList *l;
+
 	g_slist_free(session->datafeed_callbacks);
 	session->datafeed_callbacks = NULL;
+
+	for (l = session->callback_stats; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(session->callback_stats);
+	session->callback_stats = NULL;
 }
 
-void sr_session_datafeed_callback_add(sr_datafeed_callback callback)
+void sr_session_datafeed_callback_add(struct sr_session *session,
+				      sr_datafeed_callback callback)
 {
+	struct sr_callback_stats *stats;
+
+	if (!(stats = g_try_malloc0(sizeof(struct sr_callback_stats)))) {
+		sr_err("session: %s: stats malloc failed", __func__);
+		return;
+	}
+	stats->callback = callback;
+
 	session->datafeed_callbacks =
 	    g_slist_append(session->datafeed_callbacks, callback);
+	session->callback_stats =
+	    g_slist_append(session->callback_stats, stats);
 }
 
-static void sr_session_run_poll()
+/**
+ * Dispatch datafeed packets on a separate thread.
+ *
+ * Normally the datafeed callbacks run from within sr_session_bus(), i.e.
+ * on the thread (and in the receive path) of the driver sending the
+ * packet. When this is enabled, sr_session_bus() instead copies packets
+ * into a lock-free queue, and the callbacks run on a consumer thread, so
+ * a slow callback doesn't hold up the driver.
+ *
+ * The callbacks must be safe to run on another thread. Packets still
+ * queued when sr_session_run() returns are delivered before it does.
+ *
+ * @param session The session.
+ * @param async TRUE to dispatch on a separate thread, FALSE otherwise.
+ *              Takes effect on the next sr_session_start().
+ * @return SR_OK upon success.
+ */
+int sr_session_set_async_datafeed(struct sr_session *session, gboolean async)
 {
-	GPollFD *fds, my_gpollfd;
-	int ret, i;
+	session->async_datafeed = async;
 
-	fds = NULL;
-	while (session->running) {
-		if (fds)
-			free(fds);
+	return SR_OK;
+}
 
-		/* Construct g_poll()'s array. */
-		fds = malloc(sizeof(GPollFD) * num_sources);
-		for (i = 0; i < num_sources; i++) {
-#ifdef _WIN32
-			g_io_channel_win32_make_pollfd(&channels[0],
-					sources[i].events, &my_gpollfd);
-#else
-			my_gpollfd.fd = sources[i].fd;
-			my_gpollfd.events = sources[i].events;
-			fds[i] = my_gpollfd;
-#endif
-		}
+/**
+ * Merge small logic packets on the session bus.
+ *
+ * When enabled, consecutive SR_DF_LOGIC packets from a device are
+ * collected into one packet of up to max_bytes, so the datafeed
+ * callbacks, filters and outputs run once per batch instead of once per
+ * driver transfer. A batch is sent when it's full, when the unit size
+ * changes, before any other packet from the device (so triggers and the
+ * end of the acquisition keep their place in the stream), and once its
+ * oldest data is max_latency ms old. Packets of max_bytes or more are
+ * passed on as they are.
+ *
+ * Only packets sent from the session's own threads (the driver's
+ * callbacks, start_acquisition() and stop_acquisition()) are merged.
+ *
+ * @param session The session.
+ * @param max_bytes The largest packet to build, or 0 to disable merging.
+ * @param max_latency The longest time to hold back data, in ms, or 0 for
+ *                    no limit.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_session_set_coalescing(struct sr_session *session, uint64_t max_bytes,
+			      int max_latency)
+{
+	if (!session || max_latency < 0)
+		return SR_ERR_ARG;
 
-		ret = g_poll(fds, num_sources, source_timeout);
-
-		for (i = 0; i < num_sources; i++) {
-			if (fds[i].revents > 0 || (ret == 0
-				&& source_timeout == sources[i].timeout)) {
-				/*
-				 * Invoke the source's callback on an event,
-				 * or if the poll timeout out and this source
-				 * asked for that timeout.
-				 */
-				if (!sources[i].cb(fds[i].fd, fds[i].revents,
-						  sources[i].user_data))
-					sr_session_source_remove(sources[i].fd);
-			}
-		}
-	}
-	free(fds);
+	session->coalesce_bytes = max_bytes;
+	session->coalesce_latency = max_latency;
+
+	return SR_OK;
+}
+
+/**
+ * Get the number of times the session's devices lost data.
+ *
+ * Drivers report lost data with an SR_DF_OVERFLOW packet; this counts
+ * those packets, and the samples they say were lost, since the session
+ * was created.
+ *
+ * @param session The session.
+ * @param overflows Where to store the number of overflows, or NULL.
+ * @param samples_lost Where to store the number of samples lost, or NULL.
+ *                     Overflows of unknown size don't add to this.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_session_get_overflows(struct sr_session *session, uint64_t *overflows,
+			     uint64_t *samples_lost)
+{
+	if (!session)
+		return SR_ERR_ARG;
+
+	g_static_mutex_lock(&session->stats_mutex);
+	if (overflows)
+		*overflows = session->overflows;
+	if (samples_lost)
+		*samples_lost = session->samples_lost;
+	g_static_mutex_unlock(&session->stats_mutex);
 
+	return SR_OK;
 }
 
-int sr_session_start(void)
+/**
+ * Get a snapshot of the session's datafeed counters.
+ *
+ * The counters are always kept, and cover every run of the session
+ * since it was created: for each device, the packets and payload bytes
+ * of each type delivered to the datafeed callbacks, and how deep its
+ * queue to the datafeed thread got; for each datafeed callback, the
+ * time it took per call. This can be called at any time, from any
+ * thread.
+ *
+ * @param session The session.
+ * @param stats Where to store the snapshot. It must be freed with
+ *              sr_session_stats_free().
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_session_get_stats(struct sr_session *session,
+			 struct sr_session_stats **stats)
 {
+	struct sr_session_stats *s;
 	struct sr_device *device;
+	void *copy;
 	GSList *l;
-	int ret;
+	gint64 stop;
 
-	sr_info("session: starting");
+	if (!session || !stats)
+		return SR_ERR_ARG;
+
+	if (!(s = g_try_malloc0(sizeof(struct sr_session_stats)))) {
+		sr_err("session: %s: stats malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	g_static_mutex_lock(&session->stats_mutex);
 	for (l = session->devices; l; l = l->next) {
 		device = l->data;
-		if ((ret = device->plugin->start_acquisition(
-				device->plugin_index, device)) != SR_OK)
-			break;
+		if (!(copy = g_try_malloc(sizeof(struct sr_device_stats))))
+			goto err;
+		memcpy(copy, device->stats, sizeof(struct sr_device_stats));
+		s->devices = g_slist_append(s->devices, copy);
+	}
+	for (l = session->callback_stats; l; l = l->next) {
+		if (!(copy = g_try_malloc(sizeof(struct sr_callback_stats))))
+			goto err;
+		memcpy(copy, l->data, sizeof(struct sr_callback_stats));
+		s->callbacks = g_slist_append(s->callbacks, copy);
+	}
+	s->overflows = session->overflows;
+	s->samples_lost = session->samples_lost;
+	if (session->start_usec) {
+		stop = session->stop_usec ? session->stop_usec : now_usec();
+		s->elapsed_usec = stop - session->start_usec;
 	}
+	g_static_mutex_unlock(&session->stats_mutex);
 
-	return ret;
+	*stats = s;
+
+	return SR_OK;
+
+err:
+	g_static_mutex_unlock(&session->stats_mutex);
+	sr_err("session: %s: stats copy malloc failed", __func__);
+	sr_session_stats_free(s);
+
+	return SR_ERR_MALLOC;
 }
 
-void sr_session_run(void)
+/**
+ * Free a snapshot returned by sr_session_get_stats().
+ *
+ * @param stats The snapshot.
+ */
+void sr_session_stats_free(struct sr_session_stats *stats)
 {
+	GSList *l;
 
-	sr_info("session: running");
-	session->running = TRUE;
+	if (!stats)
+		return;
 
-	/* do we have real sources? */
-	if (num_sources == 1 && sources[0].fd == -1)
-		/* dummy source, freewheel over it */
-		while (session->running)
-			sources[0].cb(-1, 0, sources[0].user_data);
-	else
-		/* real sources, use g_poll() main loop */
-		sr_session_run_poll();
+	for (l = stats->devices; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(stats->devices);
+	for (l = stats->callbacks; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(stats->callbacks);
+	g_free(stats);
+}
 
+/**
+ * Run each device's acquisition on its own thread.
+ *
+ * When this is enabled, every device in the session gets an acquisition
+ * thread with its own main loop: the event sources a driver adds from
+ * its start_acquisition() or its callbacks are serviced on that thread,
+ * so devices don't compete for one thread, and a device without an fd to
+ * wait for (e.g. a session file) no longer spins the whole session.
+ * Each device thread queues its packets to the datafeed thread (see
+ * sr_session_set_async_datafeed(), which this implies), where the
+ * datafeed callbacks run; packets from one device keep their order.
+ *
+ * Sources added by the thread calling sr_session_run() stay on that
+ * thread. sr_session_run() returns when all device threads finished, or
+ * shortly after sr_session_halt() or sr_session_stop(); it joins all
+ * threads before returning.
+ *
+ * @param session The session.
+ * @param threaded TRUE to run one thread per device, FALSE otherwise.
+ *                 Takes effect on the next sr_session_start().
+ * @return SR_OK upon success.
+ */
+int sr_session_set_threaded(struct sr_session *session, gboolean threaded)
+{
+	session->threaded = threaded;
+
+	return SR_OK;
 }
 
-void sr_session_halt(void)
+static void datafeed_dispatch(struct sr_session *session,
+			      struct sr_device *device,
+			      struct sr_datafeed_packet *packet);
+
+static gpointer datafeed_thread(gpointer data)
 {
+	struct sr_session *session;
+	struct sr_datafeed_ring **rings;
+	struct sr_datafeed_packet *packet;
+	struct sr_device *device;
+	struct device_thread *dt;
+	GSList *l;
+	int num_rings, index;
 
-	sr_info("session: halting");
-	session->running = FALSE;
+	session = data;
+
+	/* The queues of the main thread and of all device threads. */
+	num_rings = 1 + g_slist_length(session->device_threads);
+	if (!(rings = g_try_malloc(sizeof(struct sr_datafeed_ring *)
+				   * num_rings))) {
+		sr_err("session: %s: rings malloc failed", __func__);
+		return NULL;
+	}
+	rings[0] = session->ring;
+	for (num_rings = 1, l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		rings[num_rings++] = dt->ring;
+	}
+
+	index = 0;
+	while ((packet = datafeed_ring_pop_any(rings, num_rings,
+					       &device, &index))) {
+		datafeed_dispatch(session, device, packet);
+		datafeed_ring_release(rings[index]);
+	}
+	g_free(rings);
 
+	return NULL;
 }
 
-void sr_session_stop(void)
+static void device_threads_free(struct sr_session *session)
 {
-	struct sr_device *device;
+	struct device_thread *dt;
+	GSList *l;
+
+	g_static_mutex_lock(&session->threads_mutex);
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		loop_cleanup(&dt->loop);
+		g_free(dt);
+	}
+	g_slist_free(session->device_threads);
+	session->device_threads = NULL;
+	g_static_mutex_unlock(&session->threads_mutex);
+}
+
+static int device_threads_new(struct sr_session *session)
+{
+	struct device_thread *dt;
 	GSList *l;
 
-	sr_info("session: stopping");
-	session->running = FALSE;
 	for (l = session->devices; l; l = l->next) {
-		device = l->data;
-		if (device->plugin && device->plugin->stop_acquisition)
-			device->plugin->stop_acquisition(device->plugin_index, device);
+		if (!(dt = g_try_malloc0(sizeof(struct device_thread)))) {
+			sr_err("session: %s: device thread malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		dt->device = l->data;
+		dt->ctx.session = session;
+		dt->ctx.dt = dt;
+		/* Share the waiter, so the datafeed thread can wait for all. */
+		if (!(dt->ring = datafeed_ring_new(session->ring))) {
+			g_free(dt);
+			return SR_ERR_MALLOC;
+		}
+		session->device_threads =
+		    g_slist_append(session->device_threads, dt);
 	}
 
+	return SR_OK;
 }
 
-static void datafeed_dump(struct sr_datafeed_packet *packet)
+static struct device_thread *device_thread_get(struct sr_session *session,
+					       struct sr_device *device)
 {
-	struct sr_datafeed_logic *logic;
+	struct device_thread *dt;
+	GSList *l;
 
-	switch (packet->type) {
-	case SR_DF_HEADER:
-		sr_dbg("bus: received SR_DF_HEADER");
-		break;
-	case SR_DF_TRIGGER:
-		sr_dbg("bus: received SR_DF_TRIGGER at %lu ms",
-				packet->timeoffset / 1000000);
-		break;
-	case SR_DF_LOGIC:
-		logic = packet->payload;
-		sr_dbg("bus: received SR_DF_LOGIC at %f ms duration %f ms, %"PRIu64" bytes",
-				packet->timeoffset / 1000000.0, packet->duration / 1000000.0,
-				logic->length);
-		break;
-	case SR_DF_END:
-		sr_dbg("bus: received SR_DF_END");
-		break;
-	default:
-		sr_dbg("bus: received unknown packet type %d", packet->type);
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		if (dt->device == device)
+			return dt;
 	}
 
+	return NULL;
 }
 
-void sr_session_bus(struct sr_device *device, struct sr_datafeed_packet *packet)
+static int datafeed_thread_start(struct sr_session *session)
 {
+	struct device_thread *dt;
 	GSList *l;
-	sr_datafeed_callback cb;
+	int ret;
 
-	/*
-	 * TODO: Send packet through PD pipe, and send the output of that to
-	 * the callbacks as well.
-	 */
-	for (l = session->datafeed_callbacks; l; l = l->next) {
-		cb = l->data;
-		datafeed_dump(packet);
-		cb(device, packet);
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	/* Left over from a run that wasn't stopped. */
+	device_threads_free(session);
+
+	if (!(session->ring = datafeed_ring_new(NULL)))
+		return SR_ERR_MALLOC;
+
+	if (session->threaded && (ret = device_threads_new(session)) != SR_OK)
+		goto err;
+
+	session->datafeed_thread = g_thread_create(datafeed_thread,
+						   session, TRUE, NULL);
+	if (!session->datafeed_thread) {
+		sr_err("session: %s: g_thread_create failed", __func__);
+		ret = SR_ERR;
+		goto err;
+	}
+
+	return SR_OK;
+
+err:
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		datafeed_ring_destroy(dt->ring);
+		dt->ring = NULL;
 	}
+	device_threads_free(session);
+	datafeed_ring_destroy(session->ring);
+	session->ring = NULL;
+
+	return ret;
 }
 
-void sr_session_source_add(int fd, int events, int timeout,
-	        sr_receive_data_callback callback, void *user_data)
+/* Deliver any packets still queued, and stop the datafeed thread. */
+static void datafeed_thread_stop(struct sr_session *session)
 {
-	struct source *new_sources, *s;
+	struct device_thread *dt;
+	GSList *l;
+
+	g_static_mutex_lock(&session->threads_mutex);
 
-	new_sources = calloc(1, sizeof(struct source) * (num_sources + 1));
+	if (!session->ring)
+		goto out;
 
-	if (sources) {
-		memcpy(new_sources, sources,
-		       sizeof(struct source) * num_sources);
-		free(sources);
+	datafeed_ring_close(session->ring);
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		datafeed_ring_close(dt->ring);
 	}
+	g_thread_join(session->datafeed_thread);
 
-	s = &new_sources[num_sources++];
-	s->fd = fd;
-	s->events = events;
-	s->timeout = timeout;
-	s->cb = callback;
-	s->user_data = user_data;
-	sources = new_sources;
+	/* From now on, packets are dispatched right away. */
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		datafeed_ring_destroy(dt->ring);
+		dt->ring = NULL;
+	}
+	datafeed_ring_destroy(session->ring);
+	session->ring = NULL;
+	session->datafeed_thread = NULL;
+
+out:
+	g_static_mutex_unlock(&session->threads_mutex);
+}
+
+static gint64 now_usec(void)
+{
+#ifdef USE_EPOLL
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (gint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+
+	return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+#ifdef USE_EPOLL
+static void source_arm_timer(struct source *s, gint64 usec)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = (usec % 1000000) * 1000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	timerfd_settime(s->timerfd, 0, &its, NULL);
+}
+
+static int gio_to_epoll(int events)
+{
+	return (events & G_IO_IN ? EPOLLIN : 0)
+		| (events & G_IO_OUT ? EPOLLOUT : 0)
+		| (events & G_IO_PRI ? EPOLLPRI : 0);
+}
 
-	if (timeout != source_timeout && timeout > 0
-	    && (source_timeout == -1 || timeout < source_timeout))
-		source_timeout = timeout;
+static int epoll_to_gio(uint32_t events)
+{
+	return (events & EPOLLIN ? G_IO_IN : 0)
+		| (events & EPOLLOUT ? G_IO_OUT : 0)
+		| (events & EPOLLPRI ? G_IO_PRI : 0)
+		| (events & EPOLLERR ? G_IO_ERR : 0)
+		| (events & EPOLLHUP ? G_IO_HUP : 0);
 }
+#endif
 
-void sr_session_source_remove(int fd)
+static void loop_remove(struct sr_event_loop *loop, int fd);
+static void source_unlink(struct sr_event_loop *loop, GPtrArray *array,
+			  struct source *s);
+static void source_free(struct sr_event_loop *loop, struct source *s);
+
+/*
+ * Run a source's callback, and remove the source if it asks for that.
+ * The callback may add and remove sources itself, including this one.
+ * A source without fd that asks to be removed is removed alone.
+ */
+static void source_dispatch(struct sr_event_loop *loop, struct source *s,
+			    int revents)
 {
-	struct source *new_sources;
-	int old, new;
+	guint i;
+	int fd, ret;
 
-	if (!sources)
+	fd = s->fd;
+	sr_trace(SR_TRACE_SOURCE, SR_TRACE_BEGIN, fd);
+	ret = s->cb(fd, revents, s->user_data);
+	sr_trace(SR_TRACE_SOURCE, SR_TRACE_END, fd);
+	if (ret)
 		return;
 
-	new_sources = calloc(1, sizeof(struct source) * num_sources);
-	for (old = 0, new = 0; old < num_sources; old++)
-		if (sources[old].fd != fd)
-			memcpy(&new_sources[new++], &sources[old],
-			       sizeof(struct source));
+	if (fd >= 0) {
+		loop_remove(loop, fd);
+		return;
+	}
+	/* Unless it's gone already. */
+	for (i = 0; i < loop->idle_sources->len; i++) {
+		if (g_ptr_array_index(loop->idle_sources, i) == s) {
+			source_unlink(loop, loop->idle_sources, s);
+			source_free(loop, s);
+			break;
+		}
+	}
+}
 
-	if (old != new) {
-		free(sources);
-		sources = new_sources;
-		num_sources--;
-	} else {
-		/* Target fd was not found. */
-		free(new_sources);
+static gboolean source_is_timer(struct source *s)
+{
+	return s->fd < 0 && s->timeout > 0;
+}
+
+static void run_idle_sources(struct sr_event_loop *loop)
+{
+	struct source *s;
+	gint64 now;
+	guint i;
+
+	now = now_usec();
+	for (i = 0; i < loop->idle_sources->len; i++) {
+		s = g_ptr_array_index(loop->idle_sources, i);
+		if (source_is_timer(s)) {
+			if (now - s->last_active < (gint64)s->timeout * 1000)
+				continue;
+			s->last_active = now;
+		}
+		/* An fd which can't be polled is always ready. */
+		source_dispatch(loop, s, s->fd < 0 ? 0 : s->events);
+		/* Don't skip the source which took the removed one's place. */
+		if (i < loop->idle_sources->len
+		    && g_ptr_array_index(loop->idle_sources, i) != s)
+			i--;
+	}
+}
+
+static gboolean loop_has_sources(struct sr_event_loop *loop)
+{
+	return loop->sources
+	       && (loop->sources->len > 0 || loop->idle_sources->len > 0);
+}
+
+/*
+ * Shorten max_wait (in ms, -1 for none) to when the first idle source
+ * needs to run: right away, unless they're all timer sources.
+ */
+static int loop_idle_wait(struct sr_event_loop *loop, int max_wait)
+{
+	struct source *s;
+	gint64 now, due;
+	guint i;
+
+	now = now_usec();
+	for (i = 0; i < loop->idle_sources->len; i++) {
+		s = g_ptr_array_index(loop->idle_sources, i);
+		if (!source_is_timer(s))
+			return 0;
+		due = (s->last_active + (gint64)s->timeout * 1000 - now
+		       + 999) / 1000;
+		if (due < 0)
+			due = 0;
+		if (max_wait == -1 || due < max_wait)
+			max_wait = due;
 	}
+
+	return max_wait;
 }
 
+/*
+ * Wait for events on the loop's sources, for at most max_wait ms (or
+ * indefinitely if -1), and run the callbacks of those that are ready.
+ *
+ * @return FALSE if the loop has no sources to run, TRUE otherwise.
+ */
+#ifdef USE_EPOLL
+static gboolean loop_iterate(struct sr_event_loop *loop, int max_wait)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct source *s;
+	uint64_t expirations;
+	gint64 now, idle;
+	int num_events, revents, fd, i;
+
+	if (!loop_has_sources(loop))
+		return FALSE;
+
+	max_wait = loop_idle_wait(loop, loop_batch_wait(loop, max_wait));
+	num_events = 0;
+	if (loop->sources->len > 0) {
+		num_events = epoll_wait(loop->epfd, events, MAX_EVENTS,
+					max_wait);
+		if (num_events == -1) {
+			if (errno == EINTR)
+				return TRUE;
+			sr_err("session: epoll_wait() failed: %s",
+			       strerror(errno));
+			return FALSE;
+		}
+	} else if (max_wait > 0) {
+		/* Only timer sources: sleep until the first is due. */
+		g_usleep((gulong)max_wait * 1000);
+	}
+
+	now = now_usec();
+	for (i = 0; i < num_events; i++) {
+		/* The source may have gone away in the meantime. */
+		fd = (int)(events[i].data.u64 & 0xffffffff);
+		if (!(s = g_hash_table_lookup(loop->source_fds,
+					      GINT_TO_POINTER(fd))))
+			continue;
+
+		if (events[i].data.u64 & TIMER_EVENT) {
+			if (s->timerfd == -1)
+				continue;
+			if (read(s->timerfd, &expirations,
+				 sizeof(uint64_t)) == -1)
+				continue;
+			/* Only a timeout if there was no event since. */
+			idle = now - s->last_active;
+			if (idle < (gint64)s->timeout * 1000) {
+				source_arm_timer(s, s->timeout * 1000 - idle);
+				continue;
+			}
+			revents = 0;
+		} else {
+			revents = epoll_to_gio(events[i].events);
+		}
+
+		s->last_active = now;
+		if (s->timerfd != -1 && revents == 0)
+			source_arm_timer(s, s->timeout * 1000);
+		source_dispatch(loop, s, revents);
+	}
+
+	run_idle_sources(loop);
+	loop_flush_batches(loop, FALSE);
+
+	return TRUE;
+}
+#else
+static gboolean loop_iterate(struct sr_event_loop *loop, int max_wait)
+{
+	GPollFD *fds;
+	struct source *s;
+	GArray *ready;
+	gint64 now, wait, due;
+	int ret, timeout, fd, i;
+
+	if (!loop_has_sources(loop))
+		return FALSE;
+
+	max_wait = loop_idle_wait(loop, loop_batch_wait(loop, max_wait));
+	/* Sleep until the first source times out, at most. */
+	now = now_usec();
+	wait = max_wait == -1 ? -1 : (gint64)max_wait * 1000;
+	for (i = 0; i < (int)loop->sources->len; i++) {
+		s = g_ptr_array_index(loop->sources, i);
+		if (s->timeout <= 0)
+			continue;
+		due = s->last_active + (gint64)s->timeout * 1000 - now;
+		if (due < 0)
+			due = 0;
+		if (wait == -1 || due < wait)
+			wait = due;
+	}
+	timeout = wait == -1 ? -1 : (int)((wait + 999) / 1000);
+
+	if (loop->sources->len > 0) {
+		fds = (GPollFD *)loop->pollfds->data;
+		ret = g_poll(fds, loop->sources->len, timeout);
+		if (ret == -1 && errno == EINTR)
+			return TRUE;
+
+		/* Collect the ready sources first, the callbacks may
+		 * change the sources. */
+		now = now_usec();
+		ready = loop->ready;
+		g_array_set_size(ready, 0);
+		for (i = 0; i < (int)loop->sources->len; i++) {
+			s = g_ptr_array_index(loop->sources, i);
+			if (fds[i].revents == 0 && (s->timeout <= 0
+			    || now - s->last_active < (gint64)s->timeout * 1000))
+				continue;
+			g_array_append_val(ready, fds[i]);
+		}
+
+		for (i = 0; i < (int)ready->len; i++) {
+			fd = g_array_index(ready, GPollFD, i).fd;
+			if (!(s = g_hash_table_lookup(loop->source_fds,
+						      GINT_TO_POINTER(fd))))
+				continue;
+			s->last_active = now;
+			source_dispatch(loop, s,
+					g_array_index(ready, GPollFD, i).revents);
+		}
+	} else if (timeout > 0) {
+		/* Only timer sources: sleep until the first is due. */
+		g_usleep((gulong)timeout * 1000);
+	}
+
+	run_idle_sources(loop);
+	loop_flush_batches(loop, FALSE);
+
+	return TRUE;
+}
+#endif
+
+/* The main loop the calling thread uses for the session. */
+static struct sr_event_loop *current_loop(struct sr_session *session)
+{
+	struct context *ctx;
+
+	if ((ctx = context_get()) && ctx->session == session && ctx->dt)
+		return &ctx->dt->loop;
+
+	return session->main_loop;
+}
+
+static gpointer device_thread(gpointer data)
+{
+	struct sr_session *session;
+	struct device_thread *dt;
+
+	dt = data;
+	session = dt->ctx.session;
+	context_enter(&dt->ctx);
+
+	/* Wake up now and then to notice a halt. */
+	while (g_atomic_int_get(&session->running)
+	       && loop_iterate(&dt->loop, DEVICE_THREAD_WAIT_MS))
+		;
+	loop_flush_batches(&dt->loop, TRUE);
+	sr_dbg("session: device thread for %s done",
+	       dt->device->plugin ? dt->device->plugin->name : "device");
+
+	g_atomic_int_add(&session->device_threads_running, -1);
+
+	return NULL;
+}
+
+static void device_threads_run(struct sr_session *session)
+{
+	struct device_thread *dt;
+	GSList *l;
+
+	g_static_mutex_lock(&session->threads_mutex);
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		g_atomic_int_inc(&session->device_threads_running);
+		dt->thread = g_thread_create(device_thread, dt, TRUE, NULL);
+		if (!dt->thread) {
+			sr_err("session: %s: g_thread_create failed", __func__);
+			g_atomic_int_add(&session->device_threads_running, -1);
+		}
+	}
+	g_static_mutex_unlock(&session->threads_mutex);
+}
+
+static void device_threads_join(struct sr_session *session)
+{
+	struct device_thread *dt;
+	GSList *l;
+
+	g_static_mutex_lock(&session->threads_mutex);
+	for (l = session->device_threads; l; l = l->next) {
+		dt = l->data;
+		if (dt->thread)
+			g_thread_join(dt->thread);
+		dt->thread = NULL;
+	}
+	g_static_mutex_unlock(&session->threads_mutex);
+}
+
+/* Whether the calling thread is one of the session's own. */
+static gboolean in_session_thread(struct sr_session *session)
+{
+	struct context *ctx;
+
+	return ((ctx = context_get()) && ctx->session == session && ctx->dt)
+	       || (session->datafeed_thread
+		   && g_thread_self() == session->datafeed_thread);
+}
+
+int sr_session_start(struct sr_session *session)
+{
+	struct sr_device *device;
+	struct context ctx, *prev;
+	GSList *l;
+	int ret;
+
+	sr_info("session: starting");
+	g_static_mutex_lock(&session->stats_mutex);
+	session->start_usec = now_usec();
+	session->stop_usec = 0;
+	g_static_mutex_unlock(&session->stats_mutex);
+
+	if ((session->async_datafeed || session->threaded) && !session->ring) {
+		if ((ret = datafeed_thread_start(session)) != SR_OK)
+			return ret;
+	}
+
+	ret = SR_OK;
+	ctx.session = session;
+	for (l = session->devices; l; l = l->next) {
+		device = l->data;
+		/* Sources and packets go to the device's thread, if any. */
+		ctx.dt = device_thread_get(session, device);
+		prev = context_enter(&ctx);
+		ret = device->plugin->start_acquisition(device->plugin_index,
+							device);
+		context_leave(prev);
+		if (ret != SR_OK)
+			break;
+	}
+
+	return ret;
+}
+
+static void session_stop_devices(struct sr_session *session);
+
+void sr_session_run(struct sr_session *session)
+{
+	struct context ctx, *prev;
+	gboolean stop;
+
+	sr_info("session: running");
+	g_static_mutex_lock(&session->stop_mutex);
+	session->run_thread = g_thread_self();
+	/* Stopped from another thread before this got to run. */
+	g_atomic_int_set(&session->running, !session->stop_pending);
+	g_static_mutex_unlock(&session->stop_mutex);
+
+	ctx.session = session;
+	ctx.dt = NULL;
+	prev = context_enter(&ctx);
+
+	if (session->device_threads) {
+		device_threads_run(session);
+		/* Serve the sources added from this thread meanwhile. */
+		while (g_atomic_int_get(&session->running)
+		       && g_atomic_int_get(&session->device_threads_running) > 0
+		       && loop_iterate(session->main_loop, DEVICE_THREAD_WAIT_MS))
+			;
+		device_threads_join(session);
+	} else {
+		if (!loop_has_sources(session->main_loop))
+			sr_err("session: no sources to run");
+		/* Wake up now and then to notice a halt from another thread. */
+		while (g_atomic_int_get(&session->running)
+		       && loop_iterate(session->main_loop, DEVICE_THREAD_WAIT_MS))
+			;
+	}
+
+	loop_flush_batches(session->main_loop, TRUE);
+	datafeed_thread_stop(session);
+
+	g_static_mutex_lock(&session->stop_mutex);
+	stop = session->stop_pending;
+	session->stop_pending = FALSE;
+	session->run_thread = NULL;
+	g_static_mutex_unlock(&session->stop_mutex);
+	if (stop)
+		session_stop_devices(session);
+	context_leave(prev);
+
+	g_static_mutex_lock(&session->stats_mutex);
+	session->stop_usec = now_usec();
+	g_static_mutex_unlock(&session->stats_mutex);
+
+}
+
+void sr_session_halt(struct sr_session *session)
+{
+
+	sr_info("session: halting");
+	g_atomic_int_set(&session->running, FALSE);
+
+}
+
+/* Call the drivers' stop_acquisition(), with the device threads gone. */
+static void session_stop_devices(struct sr_session *session)
+{
+	struct sr_device *device;
+	struct context ctx, *prev;
+	GSList *l;
+
+	ctx.session = session;
+	for (l = session->devices; l; l = l->next) {
+		device = l->data;
+		ctx.dt = device_thread_get(session, device);
+		prev = context_enter(&ctx);
+		if (device->plugin && device->plugin->stop_acquisition)
+			device->plugin->stop_acquisition(device->plugin_index, device);
+		context_leave(prev);
+	}
+	device_threads_free(session);
+}
+
+/*
+ * In threaded mode, the device threads are joined first, so the drivers'
+ * stop_acquisition() doesn't race with their own callbacks; it runs with
+ * the device's main loop as the current one.
+ *
+ * Only the thread in sr_session_run() may touch the session's main loop
+ * while it runs, and session threads can't join themselves: called from
+ * any other thread, this only halts the session, and sr_session_run()
+ * stops the devices on its way out.
+ */
+void sr_session_stop(struct sr_session *session)
+{
+	gboolean defer;
+
+	sr_info("session: stopping");
+	g_static_mutex_lock(&session->stop_mutex);
+	g_atomic_int_set(&session->running, FALSE);
+	defer = (session->run_thread && session->run_thread != g_thread_self())
+		|| in_session_thread(session);
+	session->stop_pending = defer;
+	g_static_mutex_unlock(&session->stop_mutex);
+	if (defer)
+		return;
+
+	if (session->device_threads) {
+		device_threads_join(session);
+		datafeed_thread_stop(session);
+	}
+	session_stop_devices(session);
+
+}
+
+static void datafeed_dump(struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_dbg("bus: received SR_DF_HEADER");
+		break;
+	case SR_DF_TRIGGER:
+		sr_dbg("bus: received SR_DF_TRIGGER at %lu ms",
+				packet->timeoffset / 1000000);
+		break;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		sr_dbg("bus: received SR_DF_LOGIC at %f ms duration %f ms, %"PRIu64" bytes",
+				packet->timeoffset / 1000000.0, packet->duration / 1000000.0,
+				logic->length);
+		break;
+	case SR_DF_END:
+		sr_dbg("bus: received SR_DF_END");
+		break;
+	case SR_DF_OVERFLOW:
+		sr_dbg("bus: received SR_DF_OVERFLOW at %f ms",
+				packet->timeoffset / 1000000.0);
+		break;
+	default:
+		sr_dbg("bus: received unknown packet type %d", packet->type);
+	}
+
+}
+
+/* Account for a call of a datafeed callback which took usec. */
+static void stats_callback(struct sr_session *session,
+			   struct sr_callback_stats *stats, uint64_t usec)
+{
+	int bucket;
+
+	bucket = usec ? MIN(g_bit_storage(usec), SR_STATS_BUCKETS - 1) : 0;
+
+	g_static_mutex_lock(&session->stats_mutex);
+	stats->calls++;
+	stats->total_usec += usec;
+	if (usec > stats->max_usec)
+		stats->max_usec = usec;
+	stats->histogram[bucket]++;
+	g_static_mutex_unlock(&session->stats_mutex);
+}
+
+/* Account for a packet delivered to the datafeed callbacks. */
+static void stats_dispatched(struct sr_session *session,
+			     struct sr_device *device,
+			     struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+
+	if (!device->stats || packet->type >= SR_DF_NUM_TYPES)
+		return;
+
+	g_static_mutex_lock(&session->stats_mutex);
+	device->stats->packets[packet->type]++;
+	if (packet->type == SR_DF_LOGIC && (logic = packet->payload))
+		device->stats->bytes[packet->type] += logic->length;
+	g_static_mutex_unlock(&session->stats_mutex);
+}
+
+/* Account for a packet about to be queued for the datafeed thread. */
+static void stats_queued(struct sr_session *session, struct sr_device *device,
+			 struct sr_datafeed_ring *ring)
+{
+	uint64_t depth;
+	gboolean full;
+
+	if (!device->stats)
+		return;
+
+	depth = datafeed_ring_depth(ring);
+	full = datafeed_ring_full(ring);
+
+	g_static_mutex_lock(&session->stats_mutex);
+	device->stats->queued++;
+	device->stats->queue_depth_sum += depth;
+	if (depth > device->stats->queue_depth_max)
+		device->stats->queue_depth_max = depth;
+	if (full)
+		device->stats->queue_full++;
+	g_static_mutex_unlock(&session->stats_mutex);
+}
+
+static void datafeed_dispatch(struct sr_session *session,
+			      struct sr_device *device,
+			      struct sr_datafeed_packet *packet)
+{
+	GSList *l, *s;
+	sr_datafeed_callback cb;
+	gint64 start;
+
+	sr_trace(SR_TRACE_BUS_DISPATCH, SR_TRACE_INSTANT, packet->type);
+	if (sr_log_enabled(SR_LOG_DBG))
+		datafeed_dump(packet);
+
+	/*
+	 * TODO: Send packet through PD pipe, and send the output of that to
+	 * the callbacks as well.
+	 */
+	for (l = session->datafeed_callbacks, s = session->callback_stats;
+	     l && s; l = l->next, s = s->next) {
+		cb = l->data;
+		sr_trace(SR_TRACE_CALLBACK, SR_TRACE_BEGIN, 0);
+		start = now_usec();
+		cb(device, packet);
+		stats_callback(session, s->data, now_usec() - start);
+		sr_trace(SR_TRACE_CALLBACK, SR_TRACE_END, 0);
+	}
+	stats_dispatched(session, device, packet);
+}
+
+static void bus_deliver(struct sr_session *session, struct sr_device *device,
+			struct sr_datafeed_packet *packet)
+{
+	struct context *ctx;
+	struct sr_datafeed_ring *ring;
+
+	if (!session->ring || g_thread_self() == session->datafeed_thread) {
+		datafeed_dispatch(session, device, packet);
+		return;
+	}
+
+	/*
+	 * Every ring has a single producer: a device thread, or whichever
+	 * thread drives the session (and so has a context without one).
+	 */
+	ctx = context_get();
+	if (!ctx || ctx->session != session) {
+		sr_err("session: %s: packet from outside the session's threads "
+		       "dropped", __func__);
+		return;
+	}
+	if (!(ring = ctx->dt ? ctx->dt->ring : session->ring)) {
+		datafeed_dispatch(session, device, packet);
+		return;
+	}
+	stats_queued(session, device, ring);
+	datafeed_ring_push(ring, device, packet);
+}
+
+static void batch_free(gpointer data)
+{
+	struct batch *b;
+
+	b = data;
+	sr_buffer_unref(b->buffer);
+	g_free(b);
+}
+
+static void batch_flush(struct batch *b)
+{
+	if (b->logic.length == 0)
+		return;
+
+	b->packet.payload = &b->logic;
+	b->logic.data = b->buffer->data;
+	b->logic.buffer = b->buffer;
+	bus_deliver(b->session, b->device, &b->packet);
+	sr_buffer_unref(b->buffer);
+	b->buffer = NULL;
+	b->logic.length = 0;
+}
+
+/*
+ * Add a packet to the device's batch on the loop. Returns FALSE if the
+ * packet must be sent on as it is; any batched data has been sent ahead
+ * of it then.
+ */
+static gboolean batch_add(struct sr_session *session,
+			  struct sr_event_loop *loop, struct sr_device *device,
+			  struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+	struct batch *b;
+
+	if (!loop->batches && !(loop->batches = g_hash_table_new_full(
+			g_direct_hash, g_direct_equal, NULL, batch_free)))
+		return FALSE;
+
+	if (!(b = g_hash_table_lookup(loop->batches, device))) {
+		if (packet->type != SR_DF_LOGIC)
+			return FALSE;
+		if (!(b = g_try_malloc0(sizeof(struct batch)))) {
+			sr_err("session: %s: batch malloc failed", __func__);
+			return FALSE;
+		}
+		b->session = session;
+		b->device = device;
+		g_hash_table_insert(loop->batches, device, b);
+	}
+
+	if (packet->type != SR_DF_LOGIC) {
+		batch_flush(b);
+		return FALSE;
+	}
+
+	logic = packet->payload;
+	if (b->logic.length > 0 && (logic->unitsize != b->logic.unitsize
+	    || b->logic.length + logic->length > session->coalesce_bytes))
+		batch_flush(b);
+	if (logic->length >= session->coalesce_bytes)
+		return FALSE;
+
+	if (b->logic.length == 0) {
+		if (!(b->buffer = sr_buffer_new(session,
+						session->coalesce_bytes)))
+			return FALSE;
+		b->packet = *packet;
+		b->logic.unitsize = logic->unitsize;
+		b->started = now_usec();
+	} else {
+		b->packet.duration += packet->duration;
+	}
+	memcpy((uint8_t *)b->buffer->data + b->logic.length, logic->data,
+	       logic->length);
+	b->logic.length += logic->length;
+
+	return TRUE;
+}
+
+/* Shorten max_wait (in ms, -1 for none) to when the first batch is due. */
+static int loop_batch_wait(struct sr_event_loop *loop, int max_wait)
+{
+	GHashTableIter iter;
+	struct batch *b;
+	gint64 now, due;
+	int latency;
+
+	if (!loop->batches)
+		return max_wait;
+
+	now = now_usec();
+	g_hash_table_iter_init(&iter, loop->batches);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&b)) {
+		latency = b->session->coalesce_latency;
+		if (b->logic.length == 0 || latency == 0)
+			continue;
+		due = (b->started + (gint64)latency * 1000 - now + 999) / 1000;
+		if (due < 0)
+			due = 0;
+		if (max_wait == -1 || due < max_wait)
+			max_wait = due;
+	}
+
+	return max_wait;
+}
+
+/* Send the loop's batches that are due, or all of them. */
+static void loop_flush_batches(struct sr_event_loop *loop, gboolean all)
+{
+	GHashTableIter iter;
+	struct batch *b;
+	gint64 now;
+	int latency;
+
+	if (!loop->batches)
+		return;
+
+	now = now_usec();
+	g_hash_table_iter_init(&iter, loop->batches);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&b)) {
+		latency = b->session->coalesce_latency;
+		if (all || (latency > 0
+			    && now - b->started >= (gint64)latency * 1000))
+			batch_flush(b);
+	}
+}
+
+/* Count a lost data report, and say where it happened. */
+static void bus_overflow(struct sr_session *session, struct sr_device *device,
+			 struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_overflow *overflow;
+	uint64_t num_samples;
+
+	overflow = packet->payload;
+	num_samples = overflow ? overflow->num_samples : 0;
+
+	g_static_mutex_lock(&session->stats_mutex);
+	session->overflows++;
+	session->samples_lost += num_samples;
+	g_static_mutex_unlock(&session->stats_mutex);
+
+	if (num_samples)
+		sr_warn("bus: %s lost %"PRIu64" samples at %f ms",
+			device->plugin ? device->plugin->name : "device",
+			num_samples, packet->timeoffset / 1000000.0);
+	else
+		sr_warn("bus: %s lost data at %f ms",
+			device->plugin ? device->plugin->name : "device",
+			packet->timeoffset / 1000000.0);
+}
+
+/**
+ * Check whether the session's datafeed consumer is falling behind.
+ *
+ * With sr_session_set_async_datafeed() or sr_session_set_threaded(),
+ * packets sent by a driver are queued for the datafeed thread. This
+ * returns TRUE once the device's queue filled past its high watermark,
+ * and keeps doing so until it drained below the low watermark. A driver
+ * which can pace its device, or would rather drop data (and report it
+ * with an SR_DF_OVERFLOW packet) than block in sr_session_bus() on a
+ * full queue, should check this. Without a queue, the callbacks run
+ * inline and this is always FALSE.
+ *
+ * This must be called from the thread which sends the device's packets,
+ * i.e. from the driver's event source callbacks.
+ *
+ * @param device The device.
+ * @return TRUE if the device should send less, FALSE otherwise.
+ */
+gboolean sr_session_bus_congested(struct sr_device *device)
+{
+	struct sr_session *session;
+	struct context *ctx;
+	struct sr_datafeed_ring *ring;
+
+	if (!device || !(session = device->session))
+		return FALSE;
+
+	if (!(ctx = context_get()) || ctx->session != session)
+		return FALSE;
+
+	if (ctx->dt && ctx->dt->ring)
+		ring = ctx->dt->ring;
+	else
+		ring = session->ring;
+
+	return ring && datafeed_ring_congested(ring);
+}
+
+/**
+ * Send a packet to the datafeed callbacks of the device's session.
+ *
+ * @param device The device the packet is from. It must have been added
+ *               to a session with sr_session_device_add().
+ * @param packet The packet.
+ */
+void sr_session_bus(struct sr_device *device, struct sr_datafeed_packet *packet)
+{
+	struct sr_session *session;
+	struct context *ctx;
+
+	if (!device || !(session = device->session)) {
+		sr_err("session: %s: device is not in a session", __func__);
+		return;
+	}
+
+	sr_trace(SR_TRACE_BUS_SEND, SR_TRACE_INSTANT, packet->type);
+	if (packet->type == SR_DF_OVERFLOW)
+		bus_overflow(session, device, packet);
+
+	/* Batches live on the loop of the thread sending the packets. */
+	if (session->coalesce_bytes && (ctx = context_get())
+	    && ctx->session == session
+	    && batch_add(session, current_loop(session), device, packet))
+		return;
+
+	bus_deliver(session, device, packet);
+}
+
+static int loop_init(struct sr_event_loop *loop)
+{
+	if (loop->sources)
+		return SR_OK;
+
+#ifdef USE_EPOLL
+	if ((loop->epfd = epoll_create(MAX_EVENTS)) == -1) {
+		sr_err("session: epoll_create() failed: %s", strerror(errno));
+		return SR_ERR;
+	}
+#else
+	loop->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+	loop->ready = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+#endif
+	loop->sources = g_ptr_array_new();
+	loop->idle_sources = g_ptr_array_new();
+	loop->source_fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return SR_OK;
+}
+
+static void source_free(struct sr_event_loop *loop, struct source *s)
+{
+#ifdef USE_EPOLL
+	if (!s->always_ready)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	if (s->timerfd != -1) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->timerfd, NULL);
+		close(s->timerfd);
+	}
+#else
+	/* Avoid compiler warnings. */
+	loop = loop;
+#endif
+	g_free(s);
+}
+
+/* Free the loop's resources, and any sources it still has. */
+static void loop_cleanup(struct sr_event_loop *loop)
+{
+	guint i;
+
+	if (loop->batches) {
+		g_hash_table_destroy(loop->batches);
+		loop->batches = NULL;
+	}
+
+	if (!loop->sources)
+		return;
+
+	for (i = 0; i < loop->sources->len; i++)
+		source_free(loop, g_ptr_array_index(loop->sources, i));
+	for (i = 0; i < loop->idle_sources->len; i++)
+		source_free(loop, g_ptr_array_index(loop->idle_sources, i));
+
+#ifdef USE_EPOLL
+	close(loop->epfd);
+	loop->epfd = -1;
+#else
+	g_array_free(loop->pollfds, TRUE);
+	loop->pollfds = NULL;
+	g_array_free(loop->ready, TRUE);
+	loop->ready = NULL;
+#endif
+	g_ptr_array_free(loop->sources, TRUE);
+	loop->sources = NULL;
+	g_ptr_array_free(loop->idle_sources, TRUE);
+	loop->idle_sources = NULL;
+	g_hash_table_destroy(loop->source_fds);
+	loop->source_fds = NULL;
+}
+
+#ifdef USE_EPOLL
+static int source_register(struct sr_event_loop *loop, struct source *s)
+{
+	struct epoll_event ev;
+
+	s->timerfd = -1;
+	s->always_ready = FALSE;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = gio_to_epoll(s->events);
+	ev.data.u64 = (uint32_t)s->fd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+		if (errno != EPERM) {
+			sr_err("session: failed to add fd %d: %s", s->fd,
+			       strerror(errno));
+			return SR_ERR;
+		}
+		/* Regular files can't be polled, but are always ready. */
+		s->always_ready = TRUE;
+	}
+
+	if (s->timeout > 0) {
+		if ((s->timerfd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+			sr_err("session: timerfd_create() failed: %s",
+			       strerror(errno));
+			if (!s->always_ready)
+				epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+			return SR_ERR;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u64 = TIMER_EVENT | (uint32_t)s->fd;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s->timerfd, &ev);
+		source_arm_timer(s, s->timeout * 1000);
+	}
+
+	return SR_OK;
+}
+#endif
+
+/**
+ * Add an event source to the session's main loop.
+ *
+ * The callback is run when the fd has any of the given events pending,
+ * or when it had none for timeout ms (with revents 0). Sources with a
+ * negative fd have their callback run on every main loop iteration, or,
+ * if a timeout is given, every timeout ms: the loop sleeps in between.
+ * Adding and removing sources takes constant time.
+ *
+ * In a threaded session (see sr_session_set_threaded()), sources added
+ * by a driver are serviced by the thread of the device being started, or
+ * whose callback is running.
+ *
+ * @param session The session.
+ * @param fd The file descriptor to poll, or -1.
+ * @param events The G_IO_* events to poll for.
+ * @param timeout Timeout in ms, or -1 (or 0) for none.
+ * @param callback The callback.
+ * @param user_data Passed to the callback.
+ */
+void sr_session_source_add(struct sr_session *session, int fd, int events,
+		int timeout, sr_receive_data_callback callback, void *user_data)
+{
+	struct sr_event_loop *loop;
+	struct source *s;
+#ifndef USE_EPOLL
+	GPollFD pollfd;
+#endif
+
+	loop = current_loop(session);
+	if (loop_init(loop) != SR_OK)
+		return;
+
+	/* Only one source per fd. */
+	if (fd >= 0 && g_hash_table_lookup(loop->source_fds,
+					   GINT_TO_POINTER(fd)))
+		loop_remove(loop, fd);
+
+	if (!(s = g_try_malloc0(sizeof(struct source)))) {
+		sr_err("session: %s: source malloc failed", __func__);
+		return;
+	}
+	s->fd = fd;
+	s->events = events;
+	s->timeout = timeout;
+	s->cb = callback;
+	s->user_data = user_data;
+	s->last_active = now_usec();
+
+	if (fd < 0) {
+#ifdef USE_EPOLL
+		s->timerfd = -1;
+		s->always_ready = TRUE;
+#endif
+		s->index = loop->idle_sources->len;
+		g_ptr_array_add(loop->idle_sources, s);
+		return;
+	}
+
+#ifdef USE_EPOLL
+	if (source_register(loop, s) != SR_OK) {
+		g_free(s);
+		return;
+	}
+	if (s->always_ready) {
+		s->index = loop->idle_sources->len;
+		g_ptr_array_add(loop->idle_sources, s);
+		g_hash_table_insert(loop->source_fds, GINT_TO_POINTER(fd), s);
+		return;
+	}
+#else
+#ifdef _WIN32
+	g_io_channel_win32_make_pollfd(&channels[0], events, &pollfd);
+#else
+	pollfd.fd = fd;
+	pollfd.events = events;
+#endif
+	pollfd.revents = 0;
+	g_array_append_val(loop->pollfds, pollfd);
+#endif
+	s->index = loop->sources->len;
+	g_ptr_array_add(loop->sources, s);
+	g_hash_table_insert(loop->source_fds, GINT_TO_POINTER(fd), s);
+}
+
+/* Remove a source from its array, moving the last one into its place. */
+static void source_unlink(struct sr_event_loop *loop, GPtrArray *array,
+			  struct source *s)
+{
+	struct source *last;
+
+	last = g_ptr_array_index(array, array->len - 1);
+	g_ptr_array_remove_index_fast(array, s->index);
+	if (last != s)
+		last->index = s->index;
+#ifndef USE_EPOLL
+	if (array == loop->sources)
+		g_array_remove_index_fast(loop->pollfds, s->index);
+#else
+	/* Avoid compiler warnings. */
+	loop = loop;
+#endif
+}
+
+static void loop_remove(struct sr_event_loop *loop, int fd)
+{
+	struct source *s;
+	guint i;
+
+	if (!loop->sources)
+		return;
+
+	if (fd < 0) {
+		for (i = loop->idle_sources->len; i > 0; i--) {
+			s = g_ptr_array_index(loop->idle_sources, i - 1);
+			if (s->fd < 0) {
+				source_unlink(loop, loop->idle_sources, s);
+				source_free(loop, s);
+			}
+		}
+	} else if ((s = g_hash_table_lookup(loop->source_fds,
+					    GINT_TO_POINTER(fd)))) {
+		g_hash_table_remove(loop->source_fds, GINT_TO_POINTER(fd));
+#ifdef USE_EPOLL
+		source_unlink(loop, s->always_ready ? loop->idle_sources
+						    : loop->sources, s);
+#else
+		source_unlink(loop, loop->sources, s);
+#endif
+		source_free(loop, s);
+	}
+}
+
+/**
+ * Remove an event source from the session's main loop.
+ *
+ * @param session The session.
+ * @param fd The source's file descriptor. A negative fd removes all
+ *           sources without a file descriptor.
+ */
+void sr_session_source_remove(struct sr_session *session, int fd)
+{
+
+	loop_remove(current_loop(session), fd);
+
+}
+
+/**
+ * Remove the event sources with the given callback and user data from
+ * the session's main loop.
+ *
+ * Unlike sr_session_source_remove() with a negative fd, this leaves the
+ * sources other drivers or devices added alone.
+ *
+ * @param session The session.
+ * @param callback The callback the sources were added with.
+ * @param user_data The user data the sources were added with.
+ */
+void sr_session_source_remove_callback(struct sr_session *session,
+		sr_receive_data_callback callback, void *user_data)
+{
+	struct sr_event_loop *loop;
+	struct source *s;
+	GSList *found, *l;
+	guint i;
+
+	loop = current_loop(session);
+	if (!loop->sources)
+		return;
+
+	found = NULL;
+	for (i = 0; i < loop->idle_sources->len; i++) {
+		s = g_ptr_array_index(loop->idle_sources, i);
+		if (s->cb == callback && s->user_data == user_data)
+			found = g_slist_prepend(found, s);
+	}
+	for (i = 0; i < loop->sources->len; i++) {
+		s = g_ptr_array_index(loop->sources, i);
+		if (s->cb == callback && s->user_data == user_data)
+			found = g_slist_prepend(found, s);
+	}
+
+	for (l = found; l; l = l->next) {
+		s = l->data;
+		if (s->fd >= 0) {
+			loop_remove(loop, s->fd);
+			continue;
+		}
+		source_unlink(loop, loop->idle_sources, s);
+		source_free(loop, s);
+	}
+	g_slist_free(found);
+}
@@ -17,32 +17,100 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
 #include <zip.h>
 #include <sigrok.h>
 #include <sigrok-internal.h>
 
-/* size of payloads sent across the session bus */
-#define CHUNKSIZE 4096
+/*
+ * Default size of the packets sent across the session bus. Each packet's
+ * samples are read straight into a buffer from the session's pool, which
+ * the datafeed callbacks get by reference, so a few large buffers keep
+ * cycling through the pool.
+ */
+#define DEFAULT_PACKET_SIZE	(1024 * 1024)
+/* Largest packet size which can be set with SR_HWCAP_CAPTURE_PACKET_SIZE. */
+#define MAX_PACKET_SIZE		(64 * 1024 * 1024)
+/* Size of the buffer for skipping to the start sample. */
+#define SKIP_BUFSIZE		(64 * 1024)
+
+/*
+ * With a replay speed set, the samples are sent as they come due at that
+ * speed: a timer source runs every REPLAY_TICK_MS, and sends the samples
+ * due since the last tick, in packets of at most the packet size. When the
+ * consumers can't keep up, at most REPLAY_MAX_PACKETS go out per tick.
+ */
+#define REPLAY_TICK_MS		10
+#define REPLAY_MAX_PACKETS	32
+
+/* A chunk of a capture in a version 2 session file. */
+struct session_chunk {
+	uint64_t first_sample;
+	uint64_t num_samples;
+	char *name;
+};
 
 struct session_vdevice {
+	char *sessionfile;
 	char *capturefile;
+	/* Version of the session file format */
+	int version;
 	struct zip *archive;
 	struct zip_file *capfile;
 	uint64_t samplerate;
 	int unitsize;
 	int num_probes;
+	/* Where to start replaying, and how many samples to replay (0: all) */
+	uint64_t start_sample;
+	uint64_t limit_samples;
+	/* Samples left to replay, if limit_samples is set */
+	uint64_t samples_left;
+	/* Bytes of samples per packet, 0 for the default */
+	uint64_t packet_size;
+	/* Samples replayed so far, and their period (0 if unknown) */
+	uint64_t samples_sent;
+	uint64_t period_ps;
+	/* Replay speed, relative to the samplerate (0: as fast as possible) */
+	double speed;
+	/* Start over at start_sample at the end of the capture */
+	gboolean loop;
+	/* Samples replayed since the last start over */
+	uint64_t pass_samples;
+	/* Replaying at speed, and since when (in us) */
+	gboolean paced;
+	gint64 replay_start;
+	/* Version 2: the capture's chunks, and the one being replayed */
+	struct session_chunk *chunks;
+	uint64_t num_chunks;
+	uint64_t cur_chunk;
 };
 
-static char *sessionfile = NULL;
+/*
+ * The devices of all loaded sessions. Sessions can be loaded and run
+ * concurrently, so the list is locked, and device indices are unique
+ * across sessions.
+ */
 static GSList *device_instances = NULL;
+static GStaticMutex instances_mutex = G_STATIC_MUTEX_INIT;
+static int next_device_index = 0;
 static int capabilities[] = {
 	SR_HWCAP_CAPTUREFILE,
 	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_START,
+	SR_HWCAP_CAPTURE_PACKET_SIZE,
+	SR_HWCAP_CAPTURE_SPEED,
+	SR_HWCAP_CAPTURE_LOOP,
+	SR_HWCAP_LIMIT_SAMPLES,
 	0,
 };
 
@@ -52,23 +120,379 @@ static struct session_vdevice *get_vdevice_by_index(int device_index)
 	struct sr_device_instance *sdi;
 	struct session_vdevice *vdevice;
 
-	if (!(sdi = sr_get_device_instance(device_instances, device_index)))
-		return NULL;
-
-	vdevice = sdi->priv;
+	g_static_mutex_lock(&instances_mutex);
+	sdi = sr_get_device_instance(device_instances, device_index);
+	vdevice = sdi ? sdi->priv : NULL;
+	g_static_mutex_unlock(&instances_mutex);
 
 	return vdevice;
 }
 
-static int feed_chunk(int fd, int revents, void *session_data)
+static void capture_close(struct session_vdevice *vdevice)
+{
+	uint64_t i;
+
+	if (vdevice->capfile)
+		zip_fclose(vdevice->capfile);
+	vdevice->capfile = NULL;
+	for (i = 0; i < vdevice->num_chunks; i++)
+		g_free(vdevice->chunks[i].name);
+	g_free(vdevice->chunks);
+	vdevice->chunks = NULL;
+	vdevice->num_chunks = 0;
+}
+
+static void vdevice_close(struct session_vdevice *vdevice)
+{
+	capture_close(vdevice);
+	if (vdevice->archive)
+		zip_close(vdevice->archive);
+	vdevice->archive = NULL;
+}
+
+static void vdevice_free(struct session_vdevice *vdevice)
+{
+	vdevice_close(vdevice);
+	g_free(vdevice->sessionfile);
+	g_free(vdevice->capturefile);
+	g_free(vdevice);
+}
+
+/*
+ * Create a device which replays a capture from the given session file,
+ * written in the given version of the format. The capture to replay is
+ * set with SR_HWCAP_CAPTUREFILE.
+ *
+ * @return The new device's index, or -1 upon errors.
+ */
+int session_driver_device_new(const char *sessionfile, int version)
 {
 	struct sr_device_instance *sdi;
 	struct session_vdevice *vdevice;
+	int device_index;
+
+	if (!(vdevice = g_try_malloc0(sizeof(struct session_vdevice)))) {
+		sr_err("session: %s: vdevice malloc failed", __func__);
+		return -1;
+	}
+	vdevice->sessionfile = g_strdup(sessionfile);
+	vdevice->version = version;
+
+	g_static_mutex_lock(&instances_mutex);
+	device_index = next_device_index++;
+	sdi = sr_device_instance_new(device_index, SR_ST_INITIALIZING,
+		NULL, NULL, NULL);
+	if (sdi) {
+		sdi->priv = vdevice;
+		device_instances = g_slist_append(device_instances, sdi);
+	}
+	g_static_mutex_unlock(&instances_mutex);
+
+	if (!sdi) {
+		vdevice_free(vdevice);
+		return -1;
+	}
+
+	return device_index;
+}
+
+/*
+ * Read the index of a version 2 capture: one line per chunk, with the
+ * chunk's first sample, its number of samples and its name.
+ */
+static int load_index(struct session_vdevice *vdevice)
+{
+	struct zip_stat zs;
+	struct zip_file *zf;
+	struct session_chunk *chunk;
+	char *index, *name, **lines, *line, *end;
+	uint64_t chunk_samples, i;
+	int ret;
+
+	name = g_strdup_printf("%s-index", vdevice->capturefile);
+	ret = zip_stat(vdevice->archive, name, 0, &zs);
+	g_free(name);
+	if (ret == -1) {
+		sr_warn("session_driver: no index for capture file '%s'",
+			vdevice->capturefile);
+		return SR_ERR;
+	}
+
+	if (!(index = g_try_malloc(zs.size + 1))) {
+		sr_err("session_driver: %s: index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	if (!(zf = zip_fopen_index(vdevice->archive, zs.index, 0))
+	    || zip_fread(zf, index, zs.size) != (int)zs.size) {
+		sr_warn("session_driver: failed to read index of '%s'",
+			vdevice->capturefile);
+		if (zf)
+			zip_fclose(zf);
+		g_free(index);
+		return SR_ERR;
+	}
+	zip_fclose(zf);
+	index[zs.size] = 0;
+
+	lines = g_strsplit(index, "\n", 0);
+	g_free(index);
+	vdevice->num_chunks = 0;
+	vdevice->chunks = g_try_malloc0((g_strv_length(lines) + 1)
+					* sizeof(struct session_chunk));
+	if (!vdevice->chunks) {
+		sr_err("session_driver: %s: chunks malloc failed", __func__);
+		g_strfreev(lines);
+		return SR_ERR_MALLOC;
+	}
+
+	/*
+	 * All chunks but the last are the same size, which is what makes
+	 * finding a sample's chunk a division.
+	 */
+	ret = SR_OK;
+	chunk_samples = 0;
+	for (i = 0; lines[i] && ret == SR_OK; i++) {
+		line = g_strstrip(lines[i]);
+		if (!*line)
+			continue;
+		chunk = &vdevice->chunks[vdevice->num_chunks];
+		chunk->first_sample = strtoull(line, &end, 10);
+		chunk->num_samples = strtoull(end, &end, 10);
+		chunk->name = g_strdup(g_strstrip(end));
+		if (vdevice->num_chunks == 0)
+			chunk_samples = chunk->num_samples;
+		vdevice->num_chunks++;
+		if (chunk->first_sample != (vdevice->num_chunks - 1)
+		    * chunk_samples || chunk->num_samples == 0
+		    || chunk->num_samples > chunk_samples || !*chunk->name)
+			ret = SR_ERR;
+		else if (vdevice->num_chunks > 1 && (chunk - 1)->num_samples
+			 != chunk_samples)
+			ret = SR_ERR;
+	}
+	g_strfreev(lines);
+
+	if (ret != SR_OK)
+		sr_warn("session_driver: invalid index for capture file '%s'",
+			vdevice->capturefile);
+
+	return ret;
+}
+
+/* Read and drop the next length bytes of a member. */
+static int skip_bytes(struct zip_file *zf, uint64_t length)
+{
+	uint8_t *buf;
+	int ret;
+
+	if (length == 0)
+		return SR_OK;
+
+	if (!(buf = g_try_malloc(SKIP_BUFSIZE))) {
+		sr_err("session_driver: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	ret = SR_OK;
+	while (length > 0) {
+		ret = zip_fread(zf, buf, MIN(length, SKIP_BUFSIZE));
+		if (ret <= 0) {
+			ret = SR_ERR;
+			break;
+		}
+		length -= ret;
+		ret = SR_OK;
+	}
+	g_free(buf);
+
+	return ret;
+}
+
+static struct zip_file *open_member(struct session_vdevice *vdevice,
+				    const char *name)
+{
+	struct zip_file *zf;
+
+	if (!(zf = zip_fopen(vdevice->archive, name, 0)))
+		sr_warn("Failed to open capture file '%s' in session file '%s'.",
+			name, vdevice->sessionfile);
+
+	return zf;
+}
+
+/*
+ * Open the capture for reading at start_sample. In version 2 files, only
+ * the chunk holding that sample needs to be decompressed to get there;
+ * version 1 files have to be decompressed from the start.
+ */
+static int capture_open(struct session_vdevice *vdevice)
+{
+	struct session_chunk *chunk;
+	uint64_t skip;
+	int ret;
+
+	if (vdevice->version == 1) {
+		if (!(vdevice->capfile = open_member(vdevice,
+						     vdevice->capturefile)))
+			return SR_ERR;
+		skip = vdevice->start_sample * vdevice->unitsize;
+	} else {
+		if ((ret = load_index(vdevice)) != SR_OK)
+			return ret;
+		if (vdevice->num_chunks == 0)
+			return SR_OK;
+		vdevice->cur_chunk = vdevice->start_sample
+				     / vdevice->chunks[0].num_samples;
+		if (vdevice->cur_chunk >= vdevice->num_chunks)
+			return SR_OK;
+		chunk = &vdevice->chunks[vdevice->cur_chunk];
+		if (!(vdevice->capfile = open_member(vdevice, chunk->name)))
+			return SR_ERR;
+		skip = (vdevice->start_sample - chunk->first_sample)
+		       * vdevice->unitsize;
+	}
+
+	/* Past the end of the capture, there's nothing to replay. */
+	if (skip_bytes(vdevice->capfile, skip) != SR_OK) {
+		zip_fclose(vdevice->capfile);
+		vdevice->capfile = NULL;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Read up to len bytes of the capture, moving on to the next chunk as
+ * needed. Fewer are only returned at the end of the capture.
+ */
+static int capture_read(struct session_vdevice *vdevice, uint8_t *buf,
+			int len)
+{
+	int ret, total;
+
+	total = 0;
+	while (total < len && vdevice->capfile) {
+		ret = zip_fread(vdevice->capfile, buf + total, len - total);
+		if (ret < 0)
+			return -1;
+		total += ret;
+		if (ret > 0)
+			continue;
+		/* End of the member. */
+		zip_fclose(vdevice->capfile);
+		vdevice->capfile = NULL;
+		if (vdevice->version == 2
+		    && vdevice->cur_chunk + 1 < vdevice->num_chunks) {
+			vdevice->cur_chunk++;
+			if (!(vdevice->capfile = open_member(vdevice,
+					vdevice->chunks[vdevice->cur_chunk].name)))
+				return -1;
+		}
+	}
+
+	return total;
+}
+
+static gint64 now_usec(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (gint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+
+	return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * Send the next packet of the capture, of at most max_samples samples.
+ *
+ * @return The number of samples sent, 0 at the end of the capture, or -1
+ *         upon errors.
+ */
+static int64_t send_packet(struct sr_device *device,
+			   struct session_vdevice *vdevice,
+			   uint64_t max_samples)
+{
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
-	GSList *l;
-	void *buf;
-	int ret, got_data;
+	struct sr_buffer *buffer;
+	uint64_t len, num_samples;
+	int ret;
+
+	if (vdevice->limit_samples)
+		max_samples = MIN(max_samples, vdevice->samples_left);
+	if (!vdevice->capfile || max_samples == 0)
+		return 0;
+
+	len = max_samples * vdevice->unitsize;
+	if (!(buffer = sr_buffer_new(device->session, len)))
+		return -1;
+	ret = capture_read(vdevice, buffer->data, len);
+	/* A truncated capture may end in a partial sample. */
+	if (ret > 0)
+		ret -= ret % vdevice->unitsize;
+	if (ret <= 0) {
+		sr_buffer_unref(buffer);
+		return ret;
+	}
+
+	num_samples = ret / vdevice->unitsize;
+	packet.type = SR_DF_LOGIC;
+	packet.timeoffset = vdevice->samples_sent * vdevice->period_ps;
+	packet.duration = num_samples * vdevice->period_ps;
+	packet.payload = &logic;
+	logic.length = ret;
+	logic.unitsize = vdevice->unitsize;
+	logic.data = buffer->data;
+	logic.buffer = buffer;
+	sr_session_bus(device, &packet);
+	sr_buffer_unref(buffer);
+
+	vdevice->samples_sent += num_samples;
+	vdevice->pass_samples += num_samples;
+	if (vdevice->limit_samples)
+		vdevice->samples_left -= num_samples;
+
+	return num_samples;
+}
+
+/* Start over at start_sample, for another pass over the capture. */
+static int capture_rewind(struct session_vdevice *vdevice)
+{
+	capture_close(vdevice);
+	vdevice->samples_left = vdevice->limit_samples;
+	vdevice->pass_samples = 0;
+
+	return capture_open(vdevice);
+}
+
+static void acquisition_end(struct sr_device *device,
+			    struct session_vdevice *vdevice)
+{
+	struct sr_datafeed_packet packet;
+
+	vdevice_close(vdevice);
+	packet.type = SR_DF_END;
+	packet.timeoffset = vdevice->samples_sent * vdevice->period_ps;
+	packet.duration = 0;
+	packet.payload = NULL;
+	sr_session_bus(device, &packet);
+}
+
+static int feed_chunk(int fd, int revents, void *session_data)
+{
+	struct sr_device *device;
+	struct session_vdevice *vdevice;
+	uint64_t size, packet_samples, due, n;
+	int64_t ret;
+	int num_packets, i;
 
 	/* avoid compiler warning */
 	fd = fd;
@@ -76,91 +500,109 @@ static int feed_chunk(int fd, int revents, void *session_data)
 
 	sr_dbg("session_driver: feed chunk");
 
-	got_data = FALSE;
-	for (l = device_instances; l; l = l->next) {
-		sdi = l->data;
-		vdevice = sdi->priv;
-		if (!vdevice)
-			/* already done with this instance */
-			continue;
+	device = session_data;
+	if (!(vdevice = get_vdevice_by_index(device->plugin_index)))
+		return FALSE;
+
+	size = vdevice->packet_size ? vdevice->packet_size
+				    : DEFAULT_PACKET_SIZE;
+	packet_samples = MAX(size / vdevice->unitsize, 1);
+
+	/* Freewheeling, one packet per call; at speed, what's due. */
+	due = 0;
+	num_packets = 1;
+	if (vdevice->paced) {
+		due = (now_usec() - vdevice->replay_start) / 1000000.0
+		      * vdevice->samplerate * vdevice->speed;
+		num_packets = REPLAY_MAX_PACKETS;
+	}
 
-		if (!(buf = g_try_malloc(CHUNKSIZE))) {
-			sr_err("session: %s: buf malloc failed", __func__);
-			// return SR_ERR_MALLOC;
+	ret = 1;
+	for (i = 0; i < num_packets; i++) {
+		/* A datafeed callback may have stopped the acquisition. */
+		if (!vdevice->archive)
 			return FALSE;
+		n = packet_samples;
+		if (vdevice->paced) {
+			if (vdevice->samples_sent >= due)
+				break;
+			n = MIN(n, due - vdevice->samples_sent);
 		}
-
-		ret = zip_fread(vdevice->capfile, buf, CHUNKSIZE);
-		if (ret > 0) {
-			got_data = TRUE;
-			packet.type = SR_DF_LOGIC;
-			packet.timeoffset = 0;
-			packet.duration = 0;
-			packet.payload = &logic;
-			logic.length = ret;
-			logic.unitsize = vdevice->unitsize;
-			logic.data = buf;
-			sr_session_bus(session_data, &packet);
-		} else {
-			/* done with this capture file */
-			zip_fclose(vdevice->capfile);
-			g_free(vdevice->capturefile);
-			g_free(vdevice);
-			sdi->priv = NULL;
+		if ((ret = send_packet(device, vdevice, n)) > 0)
+			continue;
+		/* An empty pass would loop forever. */
+		if (ret == 0 && vdevice->loop && vdevice->pass_samples > 0) {
+			if (capture_rewind(vdevice) == SR_OK) {
+				ret = 1;
+				continue;
+			}
+			ret = -1;
 		}
+		break;
 	}
+	if (ret > 0)
+		return TRUE;
 
-	if (!got_data) {
-		packet.type = SR_DF_END;
-		sr_session_bus(session_data, &packet);
-	}
+	/* done with this capture file */
+	acquisition_end(device, vdevice);
 
-	return TRUE;
+	return FALSE;
 }
 
 /* driver callbacks */
-static void hw_cleanup(void);
 
 static int hw_init(const char *deviceinfo)
 {
-	hw_cleanup();
 
-	sessionfile = g_strdup(deviceinfo);
+	/* avoid compiler warning */
+	deviceinfo = deviceinfo;
 
+	/* Devices are created by sr_session_load(), not found. */
 	return 0;
 }
 
 static void hw_cleanup(void)
 {
+	struct sr_device_instance *sdi;
 	GSList *l;
 
-	for (l = device_instances; l; l = l->next)
-		sr_device_instance_free(l->data);
-
+	g_static_mutex_lock(&instances_mutex);
+	for (l = device_instances; l; l = l->next) {
+		sdi = l->data;
+		vdevice_free(sdi->priv);
+		sdi->priv = NULL;
+		sr_device_instance_free(sdi);
+	}
 	g_slist_free(device_instances);
 	device_instances = NULL;
+	g_static_mutex_unlock(&instances_mutex);
 
-	sr_session_source_remove(-1);
+}
 
-	g_free(sessionfile);
+static int hw_opendev(int device_index)
+{
 
+	if (!get_vdevice_by_index(device_index))
+		return SR_ERR;
+
+	return SR_OK;
 }
 
-static int hw_opendev(int device_index)
+static int hw_closedev(int device_index)
 {
 	struct sr_device_instance *sdi;
 
-	sdi = sr_device_instance_new(device_index, SR_ST_INITIALIZING,
-		NULL, NULL, NULL);
+	g_static_mutex_lock(&instances_mutex);
+	if ((sdi = sr_get_device_instance(device_instances, device_index)))
+		device_instances = g_slist_remove(device_instances, sdi);
+	g_static_mutex_unlock(&instances_mutex);
+
 	if (!sdi)
 		return SR_ERR;
 
-	if (!(sdi->priv = g_try_malloc0(sizeof(struct session_vdevice)))) {
-		sr_err("session: %s: sdi->priv malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	device_instances = g_slist_append(device_instances, sdi);
+	vdevice_free(sdi->priv);
+	sdi->priv = NULL;
+	sr_device_instance_free(sdi);
 
 	return SR_OK;
 }
@@ -203,6 +645,8 @@ static int hw_set_configuration(int device_index, int capability, void *value)
 {
 	struct session_vdevice *vdevice;
 	uint64_t *tmp_u64;
+	double speed;
+	char *end;
 
 	if (!(vdevice = get_vdevice_by_index(device_index)))
 		return SR_ERR;
@@ -223,6 +667,35 @@ static int hw_set_configuration(int device_index, int capability, void *value)
 		tmp_u64 = value;
 		vdevice->num_probes = *tmp_u64;
 		break;
+	case SR_HWCAP_CAPTURE_START:
+		tmp_u64 = value;
+		vdevice->start_sample = *tmp_u64;
+		break;
+	case SR_HWCAP_CAPTURE_PACKET_SIZE:
+		tmp_u64 = value;
+		if (*tmp_u64 == 0 || *tmp_u64 > MAX_PACKET_SIZE) {
+			sr_err("session_driver: invalid packet size %" PRIu64,
+			       *tmp_u64);
+			return SR_ERR_ARG;
+		}
+		vdevice->packet_size = *tmp_u64;
+		break;
+	case SR_HWCAP_CAPTURE_SPEED:
+		speed = g_ascii_strtod(value, &end);
+		if (end == value || *end || !(speed >= 0 && speed <= 1e6)) {
+			sr_err("session_driver: invalid replay speed '%s'",
+			       (char *)value);
+			return SR_ERR_ARG;
+		}
+		vdevice->speed = speed;
+		break;
+	case SR_HWCAP_CAPTURE_LOOP:
+		vdevice->loop = GPOINTER_TO_INT(value);
+		break;
+	case SR_HWCAP_LIMIT_SAMPLES:
+		tmp_u64 = value;
+		vdevice->limit_samples = *tmp_u64;
+		break;
 	default:
 		return SR_ERR;
 	}
@@ -232,41 +705,52 @@ static int hw_set_configuration(int device_index, int capability, void *value)
 
 static int hw_start_acquisition(int device_index, gpointer session_device_id)
 {
-	struct zip_stat zs;
 	struct session_vdevice *vdevice;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_packet *packet;
 	int err;
 
-	/* avoid compiler warning */
-	session_device_id = session_device_id;
-
 	if (!(vdevice = get_vdevice_by_index(device_index)))
 		return SR_ERR;
 
-	sr_info("session_driver: opening archive %s file %s", sessionfile,
-		vdevice->capturefile);
+	sr_info("session_driver: opening archive %s file %s",
+		vdevice->sessionfile, vdevice->capturefile);
 
-	if (!(vdevice->archive = zip_open(sessionfile, 0, &err))) {
-		sr_warn("Failed to open session file '%s': zip error %d\n",
-			sessionfile, err);
+	if (vdevice->unitsize <= 0) {
+		sr_warn("session_driver: no unitsize for capture file '%s'",
+			vdevice->capturefile);
 		return SR_ERR;
 	}
 
-	if (zip_stat(vdevice->archive, vdevice->capturefile, 0, &zs) == -1) {
-		sr_warn("Failed to check capture file '%s' in session file '%s'.",
-			vdevice->capturefile, sessionfile);
+	if (!(vdevice->archive = zip_open(vdevice->sessionfile, 0, &err))) {
+		sr_warn("Failed to open session file '%s': zip error %d\n",
+			vdevice->sessionfile, err);
 		return SR_ERR;
 	}
 
-	if (!(vdevice->capfile = zip_fopen(vdevice->archive, vdevice->capturefile, 0))) {
-		sr_warn("Failed to open capture file '%s' in session file '%s'.",
-			vdevice->capturefile, sessionfile);
+	if (capture_open(vdevice) != SR_OK) {
+		vdevice_close(vdevice);
 		return SR_ERR;
 	}
-
-	/* freewheeling source */
-	sr_session_source_add(-1, 0, 0, feed_chunk, session_device_id);
+	vdevice->samples_left = vdevice->limit_samples;
+	vdevice->samples_sent = 0;
+	vdevice->pass_samples = 0;
+	vdevice->period_ps = vdevice->samplerate ? 1000000000000ULL
+			     / vdevice->samplerate : 0;
+
+	vdevice->paced = vdevice->speed > 0 && vdevice->samplerate;
+	if (vdevice->speed > 0 && !vdevice->samplerate)
+		sr_warn("session_driver: no samplerate for capture file '%s', "
+			"replaying as fast as possible", vdevice->capturefile);
+	if (vdevice->paced) {
+		/* Paced by a timer source. */
+		vdevice->replay_start = now_usec();
+		sr_source_add(-1, 0, REPLAY_TICK_MS, feed_chunk,
+			      session_device_id);
+	} else {
+		/* freewheeling source */
+		sr_source_add(-1, 0, 0, feed_chunk, session_device_id);
+	}
 
 	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
 		sr_err("session: %s: packet malloc failed", __func__);
@@ -283,7 +767,7 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 	packet->payload = (unsigned char *)header;
 	header->feed_version = 1;
 	gettimeofday(&header->starttime, NULL);
-	header->samplerate = 0;
+	header->samplerate = vdevice->samplerate;
 	header->num_logic_probes = vdevice->num_probes;
 	header->num_analog_probes = 0;
 	sr_session_bus(session_device_id, packet);
@@ -293,6 +777,20 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 	return SR_OK;
 }
 
+static void hw_stop_acquisition(int device_index, gpointer session_device_id)
+{
+	struct session_vdevice *vdevice;
+
+	/* Unless the replay ended already. */
+	if (!(vdevice = get_vdevice_by_index(device_index))
+	    || !vdevice->archive)
+		return;
+
+	/* Only this device's replay source, others may still be running. */
+	sr_source_remove_callback(feed_chunk, session_device_id);
+	acquisition_end(session_device_id, vdevice);
+}
+
 struct sr_device_plugin session_driver = {
 	"session",
 	"Session-emulating driver",
@@ -300,11 +798,11 @@ struct sr_device_plugin session_driver = {
 	hw_init,
 	hw_cleanup,
 	hw_opendev,
-	NULL,
+	hw_closedev,
 	hw_get_device_info,
 	hw_get_status,
 	hw_get_capabilities,
 	hw_set_configuration,
 	hw_start_acquisition,
-	NULL,
+	hw_stop_acquisition,
 };
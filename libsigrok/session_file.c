@@ -18,29 +18,42 @@
  */
 
 #include "config.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <zip.h>
+#include <zlib.h>
 #include <glib.h>
-#include <glib/gstdio.h>
 #include <sigrok.h>
 #include <sigrok-internal.h>
 
-extern struct sr_session *session;
 extern struct sr_device_plugin session_driver;
 
-int sr_session_load(const char *filename)
+/**
+ * Load a session file into a new session.
+ *
+ * Each capture in the file becomes a device of the new session, which
+ * replays the capture when the session is run. Both version 1 files (one
+ * member per capture) and version 2 files (chunked captures, see the
+ * session writer below) can be loaded.
+ *
+ * @param filename The session file to load.
+ * @param session Where to store the new session, upon success.
+ * @return SR_OK upon success, SR_ERR or SR_ERR_MALLOC upon errors.
+ */
+int sr_session_load(const char *filename, struct sr_session **session)
 {
 	GKeyFile *kf;
 	GPtrArray *capturefiles;
 	struct zip *archive;
 	struct zip_file *zf;
 	struct zip_stat zs;
-	struct sr_session *session;
+	struct sr_session *new_session;
 	struct sr_device *device;
 	struct sr_probe *probe;
-	int ret, err, probenum, devcnt, i, j;
+	int ret, err, probenum, index, version, i, j;
 	uint64_t tmp_u64, total_probes, enabled_probes, p;
 	char **sections, **keys, *metafile, *val, c;
 
@@ -55,11 +68,12 @@ int sr_session_load(const char *filename)
 		return SR_ERR;
 	}
 	ret = zip_fread(zf, &c, 1);
-	if (ret != 1 || c != '1') {
+	if (ret != 1 || (c != '1' && c != '2')) {
 		sr_dbg("Not a valid sigrok session file.");
 		return SR_ERR;
 	}
 	zip_fclose(zf);
+	version = c - '0';
 
 	/* read "metadata" */
 	if (zip_stat(archive, "metadata", 0, &zs) == -1) {
@@ -82,9 +96,9 @@ int sr_session_load(const char *filename)
 		return SR_ERR;
 	}
 
-	session = sr_session_new();
+	if (!(new_session = sr_session_new()))
+		return SR_ERR_MALLOC;
 
-	devcnt = 0;
 	capturefiles = g_ptr_array_new_with_free_func(g_free);
 	sections = g_key_file_get_groups(kf, NULL);
 	for (i = 0; sections[i]; i++) {
@@ -99,22 +113,23 @@ int sr_session_load(const char *filename)
 			for (j = 0; keys[j]; j++) {
 				val = g_key_file_get_string(kf, sections[i], keys[j], NULL);
 				if (!strcmp(keys[j], "capturefile")) {
-					device = sr_device_new(&session_driver, devcnt, 0);
-					if (devcnt == 0)
-						/* first device, init the plugin */
-						device->plugin->init((char *)filename);
-					sr_session_device_add(device);
-					device->plugin->set_configuration(devcnt, SR_HWCAP_CAPTUREFILE, val);
+					if ((index = session_driver_device_new(filename, version)) < 0) {
+						sr_session_destroy(new_session);
+						return SR_ERR;
+					}
+					device = sr_device_new(&session_driver, index, 0);
+					sr_session_device_add(new_session, device);
+					device->plugin->set_configuration(index, SR_HWCAP_CAPTUREFILE, val);
 					g_ptr_array_add(capturefiles, val);
 				} else if (!strcmp(keys[j], "samplerate")) {
 					tmp_u64 = sr_parse_sizestring(val);
-					device->plugin->set_configuration(devcnt, SR_HWCAP_SAMPLERATE, &tmp_u64);
+					device->plugin->set_configuration(device->plugin_index, SR_HWCAP_SAMPLERATE, &tmp_u64);
 				} else if (!strcmp(keys[j], "unitsize")) {
 					tmp_u64 = strtoull(val, NULL, 10);
-					device->plugin->set_configuration(devcnt, SR_HWCAP_CAPTURE_UNITSIZE, &tmp_u64);
+					device->plugin->set_configuration(device->plugin_index, SR_HWCAP_CAPTURE_UNITSIZE, &tmp_u64);
 				} else if (!strcmp(keys[j], "total probes")) {
 					total_probes = strtoull(val, NULL, 10);
-					device->plugin->set_configuration(devcnt, SR_HWCAP_CAPTURE_NUM_PROBES, &total_probes);
+					device->plugin->set_configuration(device->plugin_index, SR_HWCAP_CAPTURE_NUM_PROBES, &total_probes);
 					for (p = 1; p <= total_probes; p++)
 						sr_device_probe_add(device, NULL);
 				} else if (!strncmp(keys[j], "probe", 5)) {
@@ -137,113 +152,603 @@ int sr_session_load(const char *filename)
 	}
 	g_strfreev(sections);
 	g_key_file_free(kf);
+	*session = new_session;
 
 	return SR_OK;
 }
 
-int sr_session_save(const char *filename)
+/* Add the [global] section of a session file's metadata. */
+static void metadata_global(GString *meta)
 {
-	GSList *l, *p, *d;
-	FILE *meta;
-	struct sr_device *device;
+	g_string_append(meta, "[global]\n");
+	g_string_append_printf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
+	/* TODO: save protocol decoders used */
+}
+
+/*
+ * Add the section of a session file's metadata about a device. If unitsize
+ * isn't 0, the device's samples are in the member logic-<devcnt>.
+ */
+static void metadata_device(GString *meta, struct sr_device *device,
+			    int devcnt, int unitsize)
+{
+	GSList *p;
 	struct sr_probe *probe;
-	struct sr_datastore *ds;
-	struct zip *zipfile;
-	struct zip_source *versrc, *metasrc, *logicsrc;
-	int bufcnt, devcnt, tmpfile, ret, error, probecnt;
+	int probecnt;
 	uint64_t samplerate;
-	char version[1], rawname[16], metafile[32], *buf, *s;
+	char *s;
 
-	/* Quietly delete it first, libzip wants replace ops otherwise. */
-	unlink(filename);
-	if (!(zipfile = zip_open(filename, ZIP_CREATE, &error)))
-		return SR_ERR;
+	g_string_append_printf(meta, "[device %d]\n", devcnt);
+	if (device->plugin)
+		g_string_append_printf(meta, "driver = %s\n",
+				       device->plugin->name);
 
-	/* "version" */
-	version[0] = '1';
-	if (!(versrc = zip_source_buffer(zipfile, version, 1, 0)))
-		return SR_ERR;
-	if (zip_add(zipfile, "version", versrc) == -1) {
-		sr_info("error saving version into zipfile: %s",
-			zip_strerror(zipfile));
-		return SR_ERR;
+	if (unitsize == 0)
+		return;
+
+	g_string_append_printf(meta, "capturefile = logic-%d\n", devcnt);
+	g_string_append_printf(meta, "unitsize = %d\n", unitsize);
+	g_string_append_printf(meta, "total probes = %d\n",
+			       g_slist_length(device->probes));
+	if (sr_device_has_hwcap(device, SR_HWCAP_SAMPLERATE)) {
+		samplerate = *((uint64_t *) device->plugin->get_device_info(
+				device->plugin_index, SR_DI_CUR_SAMPLERATE));
+		s = sr_samplerate_string(samplerate);
+		g_string_append_printf(meta, "samplerate = %s\n", s);
+		free(s);
+	}
+	probecnt = 1;
+	for (p = device->probes; p; p = p->next) {
+		probe = p->data;
+		if (probe->enabled) {
+			if (probe->name)
+				g_string_append_printf(meta, "probe%d = %s\n",
+						       probecnt, probe->name);
+			if (probe->trigger)
+				g_string_append_printf(meta, " trigger%d = %s\n",
+						       probecnt, probe->trigger);
+			probecnt++;
+		}
 	}
+}
 
-	/* init "metadata" */
-	strcpy(metafile, "sigrok-meta-XXXXXX");
-	if ((tmpfile = g_mkstemp(metafile)) == -1)
-		return SR_ERR;
-	close(tmpfile);
-	meta = g_fopen(metafile, "wb");
-	fprintf(meta, "[global]\n");
-	fprintf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
-	/* TODO: save protocol decoders used */
+/**
+ * Save a session's captures to a session file.
+ *
+ * The samples are taken from the devices' datastores; devices without one
+ * are only listed in the metadata.
+ *
+ * @param session The session.
+ * @param filename The session file to write.
+ * @return SR_OK upon success, SR_ERR, SR_ERR_ARG or SR_ERR_MALLOC upon
+ *         errors.
+ */
+int sr_session_save(struct sr_session *session, const char *filename)
+{
+	GSList *l;
+	struct sr_session_writer *writer;
+	struct sr_datastore_iter iter;
+	struct sr_device *device;
+	struct sr_datastore *ds;
+	const void *span;
+	uint64_t length;
+	int ret;
 
-	/* all datastores in all devices */
-	devcnt = 1;
-	for (l = session->devices; l; l = l->next) {
+	if ((ret = sr_session_writer_new(session, filename, &writer)) != SR_OK)
+		return ret;
+
+	for (l = session->devices; l && ret == SR_OK; l = l->next) {
 		device = l->data;
-		/* metadata */
-		fprintf(meta, "[device %d]\n", devcnt);
-		if (device->plugin)
-			fprintf(meta, "driver = %s\n", device->plugin->name);
-
-		ds = device->datastore;
-		if (ds) {
-			/* metadata */
-			fprintf(meta, "capturefile = logic-%d\n", devcnt);
-			fprintf(meta, "unitsize = %d\n", ds->ds_unitsize);
-			fprintf(meta, "total probes = %d\n", g_slist_length(device->probes));
-			if (sr_device_has_hwcap(device, SR_HWCAP_SAMPLERATE)) {
-				samplerate = *((uint64_t *) device->plugin->get_device_info(
-						device->plugin_index, SR_DI_CUR_SAMPLERATE));
-				s = sr_samplerate_string(samplerate);
-				fprintf(meta, "samplerate = %s\n", s);
-				free(s);
-			}
-			probecnt = 1;
-			for (p = device->probes; p; p = p->next) {
-				probe = p->data;
-				if (probe->enabled) {
-					if (probe->name)
-						fprintf(meta, "probe%d = %s\n", probecnt, probe->name);
-					if (probe->trigger)
-						fprintf(meta, " trigger%d = %s\n", probecnt, probe->trigger);
-					probecnt++;
-				}
-			}
+		if (!(ds = device->datastore))
+			continue;
+		if ((ret = sr_datastore_iter_begin(ds, 0, &iter)) != SR_OK)
+			break;
+		while ((ret = sr_datastore_iter_next(&iter, &span, &length,
+						     NULL)) == SR_OK
+		       && length > 0) {
+			ret = sr_session_writer_append(writer, device, span,
+						       length, ds->ds_unitsize);
+			if (ret != SR_OK)
+				break;
+		}
+		sr_datastore_iter_end(&iter);
+	}
 
-			/* dump datastore into logic-n */
-			buf = malloc(ds->num_units * ds->ds_unitsize +
-				   DATASTORE_CHUNKSIZE);
-			bufcnt = 0;
-			for (d = ds->chunklist; d; d = d->next) {
-				memcpy(buf + bufcnt, d->data,
-				       DATASTORE_CHUNKSIZE);
-				bufcnt += DATASTORE_CHUNKSIZE;
-			}
-			if (!(logicsrc = zip_source_buffer(zipfile, buf,
-				       ds->num_units * ds->ds_unitsize, TRUE)))
-				return SR_ERR;
-			snprintf(rawname, 15, "logic-%d", devcnt);
-			if (zip_add(zipfile, rawname, logicsrc) == -1)
-				return SR_ERR;
+	if (ret != SR_OK) {
+		sr_session_writer_finish(writer);
+		return ret;
+	}
+
+	return sr_session_writer_finish(writer);
+}
+
+/*
+ * Session writer: streams the samples into the session file while the
+ * session runs, instead of keeping them all in datastores to save at the
+ * end.
+ *
+ * Files are written in version 2 of the format: a device's samples are
+ * split into members of SESSION_CHUNK_BYTES each (logic-<n>-1,
+ * logic-<n>-2, ...), compressed independently of each other, so a reader
+ * can start anywhere in the capture by decompressing just one chunk. The
+ * member logic-<n>-index lists the chunks, one per line: the number of
+ * the chunk's first sample, the number of samples in it, and its name.
+ * Every chunk but the last holds the same number of samples.
+ *
+ * Since the chunks are independent, they're compressed on a pool of
+ * worker threads while the caller carries on acquiring; the writer only
+ * puts the compressed chunks into the archive, in order. At most
+ * SESSION_JOBS_PER_THREAD chunks per worker are in flight, beyond which
+ * sr_session_writer_append() waits for the oldest one.
+ */
+
+/* Size of the chunks of samples in a session file. */
+#define SESSION_CHUNK_BYTES	(4 * 1024 * 1024)
+#define SESSION_JOBS_PER_THREAD	2
+
+/* Compression settings for new writers. */
+static int writer_level = Z_DEFAULT_COMPRESSION;
+static int writer_threads = 0;
+
+/* A device whose samples are being written. */
+struct writer_capture {
+	struct sr_device *device;
+	/* The device's number in the session file. */
+	int devcnt;
+	int unitsize;
+	/* Size of a chunk in bytes, a multiple of unitsize. */
+	uint64_t chunk_size;
+	/* Samples not written yet, less than a chunk. */
+	uint8_t *chunk;
+	uint64_t chunk_len;
+	uint64_t num_chunks;
+	/* Number of samples in the chunks written so far. */
+	uint64_t num_samples;
+	GString *index;
+};
+
+/* A chunk being compressed. */
+struct writer_job {
+	char name[32];
+	uint8_t *data;
+	uint64_t length;
+	/* The compressed chunk, or NULL if it's stored. */
+	uint8_t *out;
+	uint64_t out_length;
+	uint32_t crc;
+	int method;
+	int ret;
+	gboolean done;
+};
+
+struct sr_session_writer {
+	struct sr_session *session;
+	struct zip_writer *zip;
+	int level;
+	/* List of struct writer_capture */
+	GSList *captures;
+	/* Compresses chunks; NULL to compress them in the caller's thread. */
+	GThreadPool *pool;
+	/* Chunks not written yet, in the order they go into the archive. */
+	GQueue *jobs;
+	guint max_jobs;
+	/* Protects the queued jobs' done flags. */
+	GMutex *mutex;
+	GCond *cond;
+};
+
+/**
+ * Set how sr_session_save() and the session writers created from now on
+ * compress session files.
+ *
+ * @param level The zlib compression level, from 1 (fastest) to 9 (best),
+ *              0 to store the samples uncompressed, or -1 for zlib's
+ *              default.
+ * @param num_threads The number of threads compressing chunks of samples,
+ *                    1 to compress them in the thread adding them, or 0
+ *                    for one per processor.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+int sr_session_save_set_compression(int level, int num_threads)
+{
+	if (level < -1 || level > 9 || num_threads < 0) {
+		sr_err("session file: %s: invalid compression level %d or "
+		       "number of threads %d", __func__, level, num_threads);
+		return SR_ERR_ARG;
+	}
+
+	writer_level = level;
+	writer_threads = num_threads;
+
+	return SR_OK;
+}
+
+static int num_processors(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+		return n;
+#endif
+
+	return 1;
+}
+
+static void job_free(struct writer_job *job)
+{
+	g_free(job->data);
+	g_free(job->out);
+	g_free(job);
+}
+
+/* Runs on a worker thread, or in the caller's thread without a pool. */
+static void job_compress(gpointer data, gpointer user_data)
+{
+	struct writer_job *job;
+	struct sr_session_writer *writer;
+
+	job = data;
+	writer = user_data;
+	job->ret = zip_compress(job->data, job->length, writer->level,
+				&job->out, &job->out_length, &job->crc,
+				&job->method);
+
+	g_mutex_lock(writer->mutex);
+	job->done = TRUE;
+	g_cond_signal(writer->cond);
+	g_mutex_unlock(writer->mutex);
+}
+
+/*
+ * Put the compressed chunks at the head of the queue into the archive.
+ * While more than max_pending chunks are left, wait for the oldest one to
+ * be compressed.
+ */
+static int write_jobs(struct sr_session_writer *writer, guint max_pending)
+{
+	struct writer_job *job;
+	int ret;
+
+	ret = SR_OK;
+	g_mutex_lock(writer->mutex);
+	while ((job = g_queue_peek_head(writer->jobs))) {
+		if (!job->done) {
+			if (g_queue_get_length(writer->jobs) <= max_pending)
+				break;
+			g_cond_wait(writer->cond, writer->mutex);
+			continue;
+		}
+		g_queue_pop_head(writer->jobs);
+		g_mutex_unlock(writer->mutex);
+
+		if (job->ret != SR_OK && ret == SR_OK)
+			ret = job->ret;
+		if (ret == SR_OK)
+			ret = zip_writer_add_compressed(writer->zip, job->name,
+					job->method, job->out ? job->out
+					: job->data, job->out_length,
+					job->length, job->crc);
+		job_free(job);
+
+		g_mutex_lock(writer->mutex);
+	}
+	g_mutex_unlock(writer->mutex);
+
+	return ret;
+}
+
+static void capture_free(struct writer_capture *capture)
+{
+	g_free(capture->chunk);
+	if (capture->index)
+		g_string_free(capture->index, TRUE);
+	g_free(capture);
+}
+
+static void writer_free(struct sr_session_writer *writer)
+{
+	struct writer_job *job;
+	GSList *l;
+
+	/* Let the workers finish what they're on. */
+	if (writer->pool)
+		g_thread_pool_free(writer->pool, FALSE, TRUE);
+	if (writer->jobs) {
+		while ((job = g_queue_pop_head(writer->jobs)))
+			job_free(job);
+		g_queue_free(writer->jobs);
+	}
+	if (writer->cond)
+		g_cond_free(writer->cond);
+	if (writer->mutex)
+		g_mutex_free(writer->mutex);
+
+	for (l = writer->captures; l; l = l->next)
+		capture_free(l->data);
+	g_slist_free(writer->captures);
+	g_free(writer);
+}
+
+static struct writer_capture *capture_new(struct sr_session_writer *writer,
+					  struct sr_device *device,
+					  int unitsize)
+{
+	struct writer_capture *capture;
+	int devcnt;
+
+	if ((devcnt = g_slist_index(writer->session->devices, device) + 1)
+	    == 0) {
+		sr_err("session file: %s: device isn't in the session",
+		       __func__);
+		return NULL;
+	}
+
+	if (!(capture = g_try_malloc0(sizeof(struct writer_capture)))) {
+		sr_err("session file: %s: capture malloc failed", __func__);
+		return NULL;
+	}
+	capture->device = device;
+	capture->devcnt = devcnt;
+	capture->unitsize = unitsize;
+	capture->chunk_size = SESSION_CHUNK_BYTES / unitsize * unitsize;
+	capture->index = g_string_sized_new(256);
+	writer->captures = g_slist_append(writer->captures, capture);
+
+	return capture;
+}
+
+/*
+ * Hand a chunk of a capture's samples, allocated with g_try_malloc(), over
+ * to be compressed and written, and add it to the index.
+ */
+static int write_chunk(struct sr_session_writer *writer,
+		       struct writer_capture *capture, uint8_t *data,
+		       uint64_t length)
+{
+	struct writer_job *job;
+	GError *error;
+	uint64_t num_samples;
+
+	if (!(job = g_try_malloc0(sizeof(struct writer_job)))) {
+		sr_err("session file: %s: job malloc failed", __func__);
+		g_free(data);
+		return SR_ERR_MALLOC;
+	}
+	snprintf(job->name, sizeof(job->name), "logic-%d-%" PRIu64,
+		 capture->devcnt, capture->num_chunks + 1);
+	job->data = data;
+	job->length = length;
+
+	num_samples = length / capture->unitsize;
+	g_string_append_printf(capture->index, "%" PRIu64 " %" PRIu64 " %s\n",
+			       capture->num_samples, num_samples, job->name);
+	capture->num_samples += num_samples;
+	capture->num_chunks++;
+
+	g_mutex_lock(writer->mutex);
+	g_queue_push_tail(writer->jobs, job);
+	g_mutex_unlock(writer->mutex);
+
+	if (!writer->pool) {
+		job_compress(job, writer);
+	} else {
+		error = NULL;
+		g_thread_pool_push(writer->pool, job, &error);
+		if (error) {
+			sr_err("session file: %s: %s", __func__, error->message);
+			g_error_free(error);
+			/* Compress it here instead. */
+			job_compress(job, writer);
+		}
+	}
+
+	return write_jobs(writer, writer->max_jobs);
+}
+
+/**
+ * Start writing a session file.
+ *
+ * The samples of the session's devices are added as they come in with
+ * sr_session_writer_append(), and the file is completed, with a
+ * description of the devices, by sr_session_writer_finish().
+ *
+ * @param session The session being saved.
+ * @param filename The session file to write. An existing file is
+ *                 replaced.
+ * @param writer Where to store the new writer.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+int sr_session_writer_new(struct sr_session *session, const char *filename,
+			  struct sr_session_writer **writer)
+{
+	struct sr_session_writer *w;
+	GError *error;
+	int num_threads;
+
+	if (!session || !filename || !writer)
+		return SR_ERR_ARG;
+
+	if (!(w = g_try_malloc0(sizeof(struct sr_session_writer)))) {
+		sr_err("session file: %s: writer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	w->session = session;
+	w->level = writer_level;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	w->mutex = g_mutex_new();
+	w->cond = g_cond_new();
+	w->jobs = g_queue_new();
+
+	num_threads = writer_threads ? writer_threads : num_processors();
+	if (num_threads > 1) {
+		error = NULL;
+		if (!(w->pool = g_thread_pool_new(job_compress, w, num_threads,
+						  FALSE, &error))) {
+			sr_err("session file: %s: %s", __func__,
+			       error->message);
+			g_error_free(error);
+			writer_free(w);
+			return SR_ERR;
 		}
-		devcnt++;
+		w->max_jobs = num_threads * SESSION_JOBS_PER_THREAD;
 	}
-	fclose(meta);
 
-	if (!(metasrc = zip_source_file(zipfile, metafile, 0, -1)))
+	if (!(w->zip = zip_writer_new(filename, w->level))) {
+		writer_free(w);
 		return SR_ERR;
-	if (zip_add(zipfile, "metadata", metasrc) == -1)
+	}
+	if (zip_writer_add(w->zip, "version", "2", 1) != SR_OK) {
+		zip_writer_close(w->zip);
+		writer_free(w);
 		return SR_ERR;
+	}
+	*writer = w;
 
-	if ((ret = zip_close(zipfile)) == -1) {
-		sr_info("error saving zipfile: %s", zip_strerror(zipfile));
+	return SR_OK;
+}
+
+/**
+ * Add samples from one of the session's devices to a session file.
+ *
+ * The samples are written out a chunk at a time, so up to a chunk's worth
+ * of them per device stays in memory until sr_session_writer_finish(),
+ * on top of the chunks being compressed.
+ *
+ * @param writer The writer.
+ * @param device The device which acquired the samples.
+ * @param data The samples.
+ * @param length The number of bytes of samples.
+ * @param unitsize The size of a sample, in bytes; the same for all of a
+ *                 device's samples.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+int sr_session_writer_append(struct sr_session_writer *writer,
+			     struct sr_device *device, const void *data,
+			     uint64_t length, int unitsize)
+{
+	struct writer_capture *capture;
+	const uint8_t *p;
+	uint64_t size;
+	GSList *l;
+	int ret;
+
+	if (!writer || !device || !data || unitsize <= 0)
+		return SR_ERR_ARG;
+
+	capture = NULL;
+	for (l = writer->captures; l; l = l->next) {
+		if (((struct writer_capture *)l->data)->device == device) {
+			capture = l->data;
+			break;
+		}
+	}
+	if (!capture && !(capture = capture_new(writer, device, unitsize)))
 		return SR_ERR;
+
+	if (unitsize != capture->unitsize) {
+		sr_err("session file: %s: unitsize changed from %d to %d",
+		       __func__, capture->unitsize, unitsize);
+		return SR_ERR_ARG;
 	}
 
-	unlink(metafile);
+	p = data;
+	while (length > 0) {
+		if (!capture->chunk
+		    && !(capture->chunk = g_try_malloc(capture->chunk_size))) {
+			sr_err("session file: %s: chunk malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+
+		size = MIN(length, capture->chunk_size - capture->chunk_len);
+		memcpy(capture->chunk + capture->chunk_len, p, size);
+		capture->chunk_len += size;
+		p += size;
+		length -= size;
+
+		if (capture->chunk_len == capture->chunk_size) {
+			/* The chunk goes with the job. */
+			ret = write_chunk(writer, capture, capture->chunk,
+					  capture->chunk_size);
+			capture->chunk = NULL;
+			capture->chunk_len = 0;
+			if (ret != SR_OK)
+				return ret;
+		}
+	}
 
 	return SR_OK;
 }
+
+/**
+ * Complete a session file: write out the samples still pending, the
+ * chunk indices and the description of the session's devices, and close
+ * the file. The writer is freed, whether this succeeds or not.
+ *
+ * @param writer The writer.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR if anything written to the file failed.
+ */
+int sr_session_writer_finish(struct sr_session_writer *writer)
+{
+	struct writer_capture *capture;
+	GString *meta;
+	GSList *l, *c;
+	char name[32];
+	int devcnt, unitsize, ret;
+
+	if (!writer)
+		return SR_ERR_ARG;
+
+	ret = SR_OK;
+	for (c = writer->captures; c; c = c->next) {
+		capture = c->data;
+		if (capture->chunk_len > 0) {
+			if (write_chunk(writer, capture, capture->chunk,
+					capture->chunk_len) != SR_OK)
+				ret = SR_ERR;
+			capture->chunk = NULL;
+			capture->chunk_len = 0;
+		}
+	}
+	/* All chunks must be in before the indices. */
+	if (write_jobs(writer, 0) != SR_OK)
+		ret = SR_ERR;
+
+	for (c = writer->captures; c; c = c->next) {
+		capture = c->data;
+		snprintf(name, sizeof(name), "logic-%d-index",
+			 capture->devcnt);
+		zip_writer_add(writer->zip, name, capture->index->str,
+			       capture->index->len);
+	}
+
+	meta = g_string_sized_new(1024);
+	metadata_global(meta);
+	devcnt = 1;
+	for (l = writer->session->devices; l; l = l->next) {
+		unitsize = 0;
+		for (c = writer->captures; c; c = c->next) {
+			capture = c->data;
+			if (capture->device == l->data)
+				unitsize = capture->unitsize;
+		}
+		metadata_device(meta, l->data, devcnt++, unitsize);
+	}
+	zip_writer_add(writer->zip, "metadata", meta->str, meta->len);
+	g_string_free(meta, TRUE);
+
+	/* Any other error on the way shows up here. */
+	if (zip_writer_close(writer->zip) != SR_OK)
+		ret = SR_ERR;
+	writer_free(writer);
+
+	return ret;
+}
@@ -35,6 +35,85 @@
 /* Size of a datastore chunk in units */
 #define DATASTORE_CHUNKSIZE 512000
 
+/* Default size in bytes above which a datastore is moved to disk */
+#define DATASTORE_MEMORY_LIMIT (1024 * 1024 * 1024ULL)
+
+/* Default number of bytes a disk-backed datastore keeps mapped */
+#define DATASTORE_MMAP_BUDGET (64 * 1024 * 1024ULL)
+
+/* Default number of bytes the buffer pool keeps around for reuse */
+#define POOL_CACHE_LIMIT (64 * 1024 * 1024ULL)
+
+/* Number of bytes each session's buffer pool keeps around for reuse */
+#define BUFFER_POOL_CACHE (16 * 1024 * 1024ULL)
+
+/*--- buffer.c --------------------------------------------------------------*/
+
+struct sr_buffer_pool *buffer_pool_new(void);
+void buffer_pool_unref(struct sr_buffer_pool *pool);
+
+/*--- datastore_summary.c ---------------------------------------------------*/
+
+struct sr_datastore_summary *ds_summary_new(int unitsize);
+void ds_summary_destroy(struct sr_datastore_summary *sum);
+void ds_summary_append(struct sr_datastore_summary *sum, int unitsize,
+		       const uint8_t *data, uint64_t num_units);
+
+/*--- datafeed_ring.c -------------------------------------------------------*/
+
+struct sr_datafeed_ring *datafeed_ring_new(struct sr_datafeed_ring *share);
+void datafeed_ring_destroy(struct sr_datafeed_ring *ring);
+int datafeed_ring_push(struct sr_datafeed_ring *ring,
+		       struct sr_device *device,
+		       struct sr_datafeed_packet *packet);
+struct sr_datafeed_packet *datafeed_ring_pop(struct sr_datafeed_ring *ring,
+					     struct sr_device **device);
+struct sr_datafeed_packet *datafeed_ring_pop_any(
+		struct sr_datafeed_ring **rings, int num_rings,
+		struct sr_device **device, int *index);
+void datafeed_ring_release(struct sr_datafeed_ring *ring);
+void datafeed_ring_close(struct sr_datafeed_ring *ring);
+gboolean datafeed_ring_congested(struct sr_datafeed_ring *ring);
+int datafeed_ring_depth(struct sr_datafeed_ring *ring);
+gboolean datafeed_ring_full(struct sr_datafeed_ring *ring);
+
+/*--- pool.c ----------------------------------------------------------------*/
+
+void *pool_alloc(uint64_t size);
+void pool_free(void *block);
+void pool_cleanup(void);
+
+/*--- session.c -------------------------------------------------------------*/
+
+struct sr_session *session_current(void);
+
+/*--- session_driver.c ------------------------------------------------------*/
+
+int session_driver_device_new(const char *sessionfile, int version);
+
+/*--- zip_writer.c ----------------------------------------------------------*/
+
+/* Compression methods of zip archive members */
+#define ZIP_METHOD_STORE	0
+#define ZIP_METHOD_DEFLATE	8
+
+struct zip_writer;
+
+struct zip_writer *zip_writer_new(const char *filename, int level);
+int zip_writer_begin(struct zip_writer *zw, const char *name);
+int zip_writer_write(struct zip_writer *zw, const void *data,
+		     uint64_t length);
+int zip_writer_end(struct zip_writer *zw);
+int zip_writer_add(struct zip_writer *zw, const char *name, const void *data,
+		   uint64_t length);
+int zip_compress(const void *data, uint64_t length, int level,
+		 uint8_t **out, uint64_t *out_length, uint32_t *crc,
+		 int *method);
+int zip_writer_add_compressed(struct zip_writer *zw, const char *name,
+			      int method, const void *data, uint64_t length,
+			      uint64_t size, uint32_t crc);
+int zip_writer_close(struct zip_writer *zw);
+
 /*--- hwplugin.c ------------------------------------------------------------*/
 
 int load_hwplugins(void);
@@ -48,6 +127,39 @@ int sr_info(const char *format, ...);
 int sr_warn(const char *format, ...);
 int sr_err(const char *format, ...);
 
+/*
+ * For hot paths: these check the loglevel before anything else, so the
+ * arguments aren't even evaluated unless the message is shown. Levels
+ * above SR_LOG_MAX_LEVEL aren't compiled in at all; e.g. build with
+ * CPPFLAGS=-DSR_LOG_MAX_LEVEL=SR_LOG_INFO to drop the debug messages.
+ */
+#ifndef SR_LOG_MAX_LEVEL
+#define SR_LOG_MAX_LEVEL SR_LOG_SPEW
+#endif
+
+extern int sr_loglevel;
+
+#define sr_log_enabled(l) ((l) <= SR_LOG_MAX_LEVEL && (l) <= sr_loglevel)
+
+#define sr_log_fast(l, ...) \
+	do { if (sr_log_enabled(l)) sr_log(l, __VA_ARGS__); } while (0)
+#define sr_spew_fast(...) sr_log_fast(SR_LOG_SPEW, __VA_ARGS__)
+#define sr_dbg_fast(...) sr_log_fast(SR_LOG_DBG, __VA_ARGS__)
+#define sr_info_fast(...) sr_log_fast(SR_LOG_INFO, __VA_ARGS__)
+
+/*--- trace.c ---------------------------------------------------------------*/
+
+extern volatile gint trace_enabled;
+
+void trace_record(int id, int phase, uint64_t arg);
+
+/* Record a trace event; this costs one test while the tracer is off. */
+#define sr_trace(id, phase, arg) \
+	do { \
+		if (G_UNLIKELY(trace_enabled)) \
+			trace_record(id, phase, arg); \
+	} while (0)
+
 /*--- hardware/common/serial.c ----------------------------------------------*/
 
 GSList *list_serial_ports(void);
@@ -32,10 +32,46 @@ int sr_get_loglevel(void);
 
 /*--- datastore.c -----------------------------------------------------------*/
 
+int sr_datastore_set_memory_limit(uint64_t limit);
+int sr_datastore_set_mmap_budget(uint64_t budget);
 int sr_datastore_new(int unitsize, struct sr_datastore **ds);
 int sr_datastore_destroy(struct sr_datastore *ds);
-void sr_datastore_put(struct sr_datastore *ds, void *data, unsigned int length,
-		      int in_unitsize, int *probelist);
+int sr_datastore_set_encoding(struct sr_datastore *ds, int encoding);
+int sr_datastore_set_summary(struct sr_datastore *ds, int enable);
+int sr_datastore_put(struct sr_datastore *ds, const void *data,
+		     uint64_t length, int in_unitsize, int *probelist);
+int sr_datastore_get(struct sr_datastore *ds, uint64_t start_unit,
+		     uint64_t count, void *data);
+int sr_datastore_iter_begin(struct sr_datastore *ds, uint64_t start_unit,
+			    struct sr_datastore_iter *iter);
+int sr_datastore_iter_next(struct sr_datastore_iter *iter, const void **data,
+			   uint64_t *length, uint64_t *first_unit);
+int sr_datastore_iter_next_plane(struct sr_datastore_iter *iter, int probe,
+				 const void **data, uint64_t *num_units,
+				 uint64_t *first_unit);
+void sr_datastore_iter_end(struct sr_datastore_iter *iter);
+int sr_datastore_get_probe(struct sr_datastore *ds, int probe,
+			   uint64_t start_unit, uint64_t count, void *bits);
+
+/*--- datastore_summary.c ---------------------------------------------------*/
+
+int sr_datastore_summary(struct sr_datastore *ds, int probe, uint64_t start,
+			 uint64_t count, int *state, uint64_t *edges);
+int sr_datastore_find_edge(struct sr_datastore *ds, int probe, uint64_t from,
+			   int direction, int type, uint64_t *edge);
+
+/*--- buffer.c --------------------------------------------------------------*/
+
+struct sr_buffer *sr_buffer_new(struct sr_session *session, uint64_t size);
+struct sr_buffer *sr_buffer_ref(struct sr_buffer *buffer);
+void sr_buffer_unref(struct sr_buffer *buffer);
+
+/*--- pool.c ----------------------------------------------------------------*/
+
+int sr_pool_set_hugepages(gboolean enable);
+int sr_pool_set_cache_limit(uint64_t limit);
+int sr_pool_trim(void);
+int sr_pool_get_stats(struct sr_pool_stats *pool_stats);
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -60,10 +96,29 @@ gboolean sr_device_has_hwcap(struct sr_device *device, int hwcap);
 
 /*--- filter.c --------------------------------------------------------------*/
 
+int sr_filter_new(int in_unitsize, int out_unitsize, const int *probelist,
+		  struct sr_filter **filter);
+int sr_filter_destroy(struct sr_filter *filter);
+int sr_filter_run(const struct sr_filter *filter, const void *data_in,
+		  uint64_t length_in, void *data_out, uint64_t *length_out);
+int sr_filter_probes_into(int in_unitsize, int out_unitsize,
+			  const int *probelist, const void *data_in,
+			  uint64_t length_in, void *data_out,
+			  uint64_t *length_out);
 int sr_filter_probes(int in_unitsize, int out_unitsize, int *probelist,
 		     const unsigned char *data_in, uint64_t length_in,
 		     char **data_out, uint64_t *length_out);
 
+/*--- trace.c ---------------------------------------------------------------*/
+
+int sr_trace_start(int num_events);
+void sr_trace_stop(void);
+void sr_trace_record(int id, int phase, uint64_t arg);
+int sr_trace_get_events(struct sr_trace_event **events, int *num_events);
+const char *sr_trace_event_name(int id);
+int sr_trace_dump(const char *filename);
+int sr_trace_dump_json(const char *filename);
+
 /*--- hwplugin.c ------------------------------------------------------------*/
 
 GSList *sr_list_hwplugins(void);
@@ -91,6 +146,8 @@ void sr_serial_device_instance_free(struct sr_serial_device_instance *serial);
 int sr_find_hwcap(int *capabilities, int hwcap);
 struct sr_hwcap_option *sr_find_hwcap_option(int hwcap);
 void sr_source_remove(int fd);
+void sr_source_remove_callback(sr_receive_data_callback rcv_cb,
+			       void *user_data);
 void sr_source_add(int fd, int events, int timeout,
 		   sr_receive_data_callback rcv_cb, void *user_data);
 
@@ -100,11 +157,12 @@ typedef void (*sr_datafeed_callback) (struct sr_device *device,
 				      struct sr_datafeed_packet *packet);
 
 /* Session setup */
-int sr_session_load(const char *filename);
+int sr_session_load(const char *filename, struct sr_session **session);
 struct sr_session *sr_session_new(void);
-void sr_session_destroy(void);
-void sr_session_device_clear(void);
-int sr_session_device_add(struct sr_device *device);
+void sr_session_destroy(struct sr_session *session);
+void sr_session_device_clear(struct sr_session *session);
+int sr_session_device_add(struct sr_session *session,
+			  struct sr_device *device);
 
 #if 0
 /* Protocol analyzers setup */
@@ -113,20 +171,40 @@ void sr_session_pa_add(struct sr_analyzer *pa);
 #endif
 
 /* Datafeed setup */
-void sr_session_datafeed_callback_clear(void);
-void sr_session_datafeed_callback_add(sr_datafeed_callback callback);
+void sr_session_datafeed_callback_clear(struct sr_session *session);
+void sr_session_datafeed_callback_add(struct sr_session *session,
+				      sr_datafeed_callback callback);
 
 /* Session control */
-int sr_session_start(void);
-void sr_session_run(void);
-void sr_session_halt(void);
-void sr_session_stop(void);
+int sr_session_set_async_datafeed(struct sr_session *session, gboolean async);
+int sr_session_set_threaded(struct sr_session *session, gboolean threaded);
+int sr_session_set_coalescing(struct sr_session *session, uint64_t max_bytes,
+			      int max_latency);
+int sr_session_get_overflows(struct sr_session *session, uint64_t *overflows,
+			     uint64_t *samples_lost);
+int sr_session_get_stats(struct sr_session *session,
+			 struct sr_session_stats **stats);
+void sr_session_stats_free(struct sr_session_stats *stats);
+int sr_session_start(struct sr_session *session);
+void sr_session_run(struct sr_session *session);
+void sr_session_halt(struct sr_session *session);
+void sr_session_stop(struct sr_session *session);
+gboolean sr_session_bus_congested(struct sr_device *device);
 void sr_session_bus(struct sr_device *device,
 		    struct sr_datafeed_packet *packet);
-int sr_session_save(const char *filename);
-void sr_session_source_add(int fd, int events, int timeout,
-	        sr_receive_data_callback callback, void *user_data);
-void sr_session_source_remove(int fd);
+int sr_session_save(struct sr_session *session, const char *filename);
+int sr_session_save_set_compression(int level, int num_threads);
+int sr_session_writer_new(struct sr_session *session, const char *filename,
+			  struct sr_session_writer **writer);
+int sr_session_writer_append(struct sr_session_writer *writer,
+			     struct sr_device *device, const void *data,
+			     uint64_t length, int unitsize);
+int sr_session_writer_finish(struct sr_session_writer *writer);
+void sr_session_source_add(struct sr_session *session, int fd, int events,
+		int timeout, sr_receive_data_callback callback, void *user_data);
+void sr_session_source_remove(struct sr_session *session, int fd);
+void sr_session_source_remove_callback(struct sr_session *session,
+		sr_receive_data_callback callback, void *user_data);
 
 /*--- input/input.c ---------------------------------------------------------*/
 
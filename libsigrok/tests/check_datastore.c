@@ -0,0 +1,328 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Round-trip checks for every datastore encoding: the data put into a
+ * datastore must come back unchanged from sr_datastore_get(), the
+ * iterators and sr_datastore_get_probe(), and sr_datastore_find_edge()
+ * must agree with a brute-force search over the same data.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/* A bit over two chunks, so every check crosses chunk boundaries. */
+#define NUM_UNITS	(2 * DATASTORE_CHUNKSIZE + 1234)
+#define NUM_QUERIES	20
+
+static const char *encoding_names[] = { "raw", "rle", "bitplane" };
+
+static uint32_t rand_state = 1;
+
+/* Deterministic, so failures can be reproduced. */
+static uint32_t next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+/*
+ * Long idle stretches with bursts of activity, like a typical bus
+ * capture. The top probe never changes, so there's a probe without
+ * any edges to search for.
+ */
+static void fill(uint8_t *data, int unitsize, uint64_t num_units)
+{
+	uint64_t i, n;
+	int b;
+
+	for (i = 0; i < num_units; i += n) {
+		n = next_rand() % 4096 + 1;
+		n = MIN(num_units - i, n);
+		if (next_rand() % 2) {
+			memset(data + i * unitsize, next_rand(), n * unitsize);
+			continue;
+		}
+		for (b = 0; b < (int)(n * unitsize); b++)
+			data[i * unitsize + b] = next_rand();
+	}
+	for (i = 0; i < num_units; i++)
+		data[i * unitsize + unitsize - 1] &= 0x7f;
+}
+
+static int get_bit(const uint8_t *data, int unitsize, int probe,
+		   uint64_t unit)
+{
+	return (data[unit * unitsize + probe / 8] >> (probe % 8)) & 1;
+}
+
+static int brute_find_edge(const uint8_t *data, int unitsize,
+			   uint64_t num_units, int probe, uint64_t from,
+			   int direction, int type, uint64_t *edge)
+{
+	uint64_t u;
+	int bit;
+
+	if (direction == SR_SEARCH_FORWARD) {
+		u = from + 1;
+	} else {
+		if (from > num_units)
+			from = num_units;
+		if (from < 2)
+			return SR_ERR;
+		u = from - 1;
+	}
+	while (u >= 1 && u < num_units) {
+		bit = get_bit(data, unitsize, probe, u);
+		if (bit != get_bit(data, unitsize, probe, u - 1)
+		    && (type == SR_EDGE_ANY || (type == SR_EDGE_RISING) == bit)) {
+			*edge = u;
+			return SR_OK;
+		}
+		if (direction == SR_SEARCH_FORWARD)
+			u++;
+		else
+			u--;
+	}
+
+	return SR_ERR;
+}
+
+static int check_get(struct sr_datastore *ds, const uint8_t *data,
+		     int unitsize)
+{
+	uint8_t *buf;
+	uint64_t start, count;
+	int i, ret;
+
+	if (!(buf = malloc(NUM_UNITS * unitsize)))
+		return SR_ERR_MALLOC;
+
+	ret = SR_OK;
+	for (i = 0; i < NUM_QUERIES && ret == SR_OK; i++) {
+		start = next_rand() % NUM_UNITS;
+		count = next_rand() % (NUM_UNITS - start + 1);
+		if (sr_datastore_get(ds, start, count, buf) != SR_OK
+		    || memcmp(buf, data + start * unitsize, count * unitsize)) {
+			fprintf(stderr, "get of %" PRIu64 " units at %" PRIu64
+				" failed\n", count, start);
+			ret = SR_ERR;
+		}
+	}
+	if (ret == SR_OK && sr_datastore_get(ds, NUM_UNITS, 1, buf) == SR_OK) {
+		fprintf(stderr, "get past the end succeeded\n");
+		ret = SR_ERR;
+	}
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Walk over the datastore with two iterators at once, to check that
+ * readers don't disturb each other.
+ */
+static int check_iter(struct sr_datastore *ds, const uint8_t *data,
+		      int unitsize)
+{
+	struct sr_datastore_iter iter[2];
+	const void *span;
+	uint64_t length, first, next[2];
+	int i, ret, done;
+
+	sr_datastore_iter_begin(ds, 0, &iter[0]);
+	sr_datastore_iter_begin(ds, NUM_UNITS / 3, &iter[1]);
+	next[0] = 0;
+	next[1] = NUM_UNITS / 3;
+
+	ret = SR_OK;
+	for (done = 0; done != 3 && ret == SR_OK; ) {
+		for (i = 0; i < 2 && ret == SR_OK; i++) {
+			if (done & (1 << i))
+				continue;
+			ret = sr_datastore_iter_next(&iter[i], &span, &length,
+						     &first);
+			if (ret != SR_OK)
+				break;
+			if (length == 0) {
+				if (next[i] != NUM_UNITS)
+					ret = SR_ERR;
+				done |= 1 << i;
+				continue;
+			}
+			if (first != next[i] || memcmp(span,
+			    data + first * unitsize, length))
+				ret = SR_ERR;
+			next[i] += length / unitsize;
+		}
+	}
+	if (ret != SR_OK)
+		fprintf(stderr, "iteration failed\n");
+	sr_datastore_iter_end(&iter[0]);
+	sr_datastore_iter_end(&iter[1]);
+
+	return ret;
+}
+
+static int check_probe(struct sr_datastore *ds, const uint8_t *data,
+		       int unitsize)
+{
+	uint8_t *bits;
+	uint64_t start, count, i;
+	int probe, ret;
+
+	if (!(bits = malloc(NUM_UNITS / 8 + 1)))
+		return SR_ERR_MALLOC;
+
+	ret = SR_OK;
+	for (probe = 0; probe < unitsize * 8 && ret == SR_OK; probe++) {
+		start = next_rand() % NUM_UNITS;
+		count = next_rand() % (NUM_UNITS - start + 1);
+		if (sr_datastore_get_probe(ds, probe, start, count, bits)
+		    != SR_OK) {
+			ret = SR_ERR;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (((bits[i / 8] >> (i % 8)) & 1)
+			    != get_bit(data, unitsize, probe, start + i)) {
+				ret = SR_ERR;
+				break;
+			}
+		}
+	}
+	if (ret != SR_OK)
+		fprintf(stderr, "get_probe of probe %d failed\n", probe);
+	free(bits);
+
+	return ret;
+}
+
+static int check_find_edge(struct sr_datastore *ds, const uint8_t *data,
+			   int unitsize)
+{
+	static const int types[] = {
+		SR_EDGE_RISING, SR_EDGE_FALLING, SR_EDGE_ANY,
+	};
+	uint64_t from, edge, expected;
+	int probe, direction, type, i, ret;
+
+	/* Every combination of direction and edge type, per probe. */
+	for (probe = 0; probe < unitsize * 8; probe++) {
+		for (i = 0; i < NUM_QUERIES * 6; i++) {
+			direction = i % 2 ? SR_SEARCH_BACKWARD
+					  : SR_SEARCH_FORWARD;
+			type = types[i / 2 % 3];
+			from = next_rand() % (NUM_UNITS + 2);
+			ret = sr_datastore_find_edge(ds, probe, from,
+						     direction, type, &edge);
+			if (ret != brute_find_edge(data, unitsize, NUM_UNITS,
+						   probe, from, direction,
+						   type, &expected)
+			    || (ret == SR_OK && edge != expected)) {
+				fprintf(stderr, "find_edge from %" PRIu64
+					" on probe %d failed\n", from, probe);
+				return SR_ERR;
+			}
+		}
+	}
+
+	return SR_OK;
+}
+
+static int check_encoding(int encoding, int unitsize, int summary)
+{
+	struct sr_datastore *ds;
+	uint8_t *data;
+	uint64_t offset, length;
+	int ret;
+
+	if (!(data = malloc(NUM_UNITS * unitsize)))
+		return SR_ERR_MALLOC;
+	fill(data, unitsize, NUM_UNITS);
+
+	if ((ret = sr_datastore_new(unitsize, &ds)) != SR_OK) {
+		free(data);
+		return ret;
+	}
+	sr_datastore_set_encoding(ds, encoding);
+	sr_datastore_set_summary(ds, summary);
+
+	/* Put the data in pieces of any size, including empty ones. */
+	for (offset = 0; offset < NUM_UNITS; offset += length) {
+		length = next_rand() % 70000;
+		length = MIN(NUM_UNITS - offset, length);
+		ret = sr_datastore_put(ds, data + offset * unitsize,
+				       length * unitsize, unitsize, NULL);
+		if (ret != SR_OK)
+			break;
+	}
+	if (ret == SR_OK && ds->num_units != NUM_UNITS) {
+		fprintf(stderr, "stored %" PRIu64 " units instead of %d\n",
+			ds->num_units, NUM_UNITS);
+		ret = SR_ERR;
+	}
+
+	if (ret == SR_OK)
+		ret = check_get(ds, data, unitsize);
+	if (ret == SR_OK)
+		ret = check_iter(ds, data, unitsize);
+	if (ret == SR_OK)
+		ret = check_probe(ds, data, unitsize);
+	if (ret == SR_OK)
+		ret = check_find_edge(ds, data, unitsize);
+
+	sr_datastore_destroy(ds);
+	free(data);
+
+	return ret;
+}
+
+int main(void)
+{
+	int encoding, unitsize, summary, ret;
+
+	ret = SR_OK;
+	for (encoding = SR_DS_ENCODING_RAW;
+	     encoding <= SR_DS_ENCODING_BITPLANE; encoding++) {
+		for (unitsize = 1; unitsize <= 3; unitsize++) {
+			for (summary = FALSE; summary <= TRUE; summary++) {
+				if (check_encoding(encoding, unitsize,
+						   summary) == SR_OK)
+					continue;
+				fprintf(stderr, "%s encoding, unitsize %d, "
+					"summary %s: FAILED\n",
+					encoding_names[encoding], unitsize,
+					summary ? "on" : "off");
+				ret = SR_ERR;
+			}
+		}
+	}
+
+	return ret == SR_OK ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Binary event tracer.
+ *
+ * Events are fixed-size records (a timestamp, an event id and an
+ * argument) in one ring shared by all threads. A thread takes the next
+ * sequence number with an atomic increment, marks the slot for it busy,
+ * fills it in, and then publishes it by storing the sequence number;
+ * nothing is formatted, and no lock is taken. Once the ring is full, the
+ * oldest events are overwritten, so it always holds the most recent
+ * ones. A thread which finds its slot busy, or already holding a newer
+ * event (it was preempted for a whole lap of the ring), drops its event
+ * rather than garble the other one.
+ *
+ * The ring is only read once tracing is over (or after a crash, from a
+ * debugger: trace_slots holds the events, and trace_next is the
+ * sequence number of the next one to be written).
+ */
+
+/* Marks a slot being written. */
+#define TRACE_SLOT_BUSY		-1
+
+struct trace_slot {
+	/* Sequence number + 1 of the event in the slot, 0 if none yet */
+	volatile gint seq;
+	struct sr_trace_event event;
+};
+
+/* Tested by sr_trace() before anything else. */
+volatile gint trace_enabled = FALSE;
+
+static struct trace_slot *trace_slots = NULL;
+static guint trace_mask;
+static volatile gint trace_next;
+static volatile gint trace_threads;
+static uint64_t trace_start_ns;
+static GStaticPrivate trace_thread = G_STATIC_PRIVATE_INIT;
+
+static const char *trace_event_names[] = {
+	"bus send",
+	"bus dispatch",
+	"callback",
+	"queue wait",
+	"source",
+	"transfer",
+	"filter",
+	"output",
+	"decoder",
+	"datastore",
+};
+
+static uint64_t trace_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+/**
+ * Start recording trace events.
+ *
+ * The tracer keeps the last num_events events (rounded up to a power of
+ * two) recorded by any thread. Events recorded earlier are discarded.
+ * This must not be called while a session is running.
+ *
+ * @param num_events The number of events to keep.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_trace_start(int num_events)
+{
+	guint size;
+
+	if (num_events <= 0 || num_events > (1 << 30)) {
+		sr_err("trace: %s: invalid number of events %d", __func__,
+		       num_events);
+		return SR_ERR_ARG;
+	}
+
+	g_atomic_int_set(&trace_enabled, FALSE);
+
+	for (size = 1; size < (guint)num_events; size <<= 1)
+		;
+	if (!trace_slots || trace_mask + 1 != size) {
+		g_free(trace_slots);
+		if (!(trace_slots = g_try_malloc(size
+						 * sizeof(struct trace_slot)))) {
+			sr_err("trace: %s: trace_slots malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		trace_mask = size - 1;
+	}
+	memset(trace_slots, 0, size * sizeof(struct trace_slot));
+	trace_next = 0;
+	trace_start_ns = trace_now();
+
+	g_atomic_int_set(&trace_enabled, TRUE);
+
+	return SR_OK;
+}
+
+/**
+ * Stop recording trace events. The events recorded so far are kept until
+ * the next sr_trace_start().
+ */
+void sr_trace_stop(void)
+{
+	g_atomic_int_set(&trace_enabled, FALSE);
+}
+
+/* The number of the calling thread, assigned on its first event. */
+static uint16_t trace_thread_number(void)
+{
+	gpointer number;
+
+	if (!(number = g_static_private_get(&trace_thread))) {
+		number = GINT_TO_POINTER(
+			g_atomic_int_exchange_and_add(&trace_threads, 1) + 1);
+		g_static_private_set(&trace_thread, number, NULL);
+	}
+
+	return GPOINTER_TO_INT(number);
+}
+
+void trace_record(int id, int phase, uint64_t arg)
+{
+	struct trace_slot *slot;
+	guint seq;
+	gint old;
+
+	seq = g_atomic_int_exchange_and_add(&trace_next, 1);
+	slot = &trace_slots[seq & trace_mask];
+
+	old = g_atomic_int_get(&slot->seq);
+	if (old == TRACE_SLOT_BUSY || (old && (gint)(old - (seq + 1)) > 0)
+	    || !g_atomic_int_compare_and_exchange(&slot->seq, old,
+						  TRACE_SLOT_BUSY))
+		return;
+
+	slot->event.timestamp = trace_now() - trace_start_ns;
+	slot->event.arg = arg;
+	slot->event.thread = trace_thread_number();
+	slot->event.id = id;
+	slot->event.phase = phase;
+	g_atomic_int_set(&slot->seq, seq + 1);
+}
+
+/**
+ * Record a trace event, if the tracer is running.
+ *
+ * Frontends can use this to put their own processing steps on the same
+ * timeline as libsigrok's. Spans are recorded as an SR_TRACE_BEGIN event
+ * and a matching SR_TRACE_END event from the same thread.
+ *
+ * @param id The event, one of the SR_TRACE_* ids.
+ * @param phase SR_TRACE_INSTANT, SR_TRACE_BEGIN or SR_TRACE_END.
+ * @param arg What the event is about; its meaning depends on the id.
+ */
+void sr_trace_record(int id, int phase, uint64_t arg)
+{
+	sr_trace(id, phase, arg);
+}
+
+static gint compare_seq(gconstpointer a, gconstpointer b)
+{
+	const struct trace_slot *sa = a, *sb = b;
+
+	/* Sequence numbers of live events are less than 2^31 apart. */
+	return (gint)((guint)sa->seq - (guint)sb->seq);
+}
+
+/**
+ * Get the recorded trace events.
+ *
+ * Events which were being written at the time are left out. This can be
+ * called while tracing, but events recorded meanwhile may be missing.
+ *
+ * @param events Where to store the events, oldest first. The caller must
+ *               g_free() them.
+ * @param num_events Where to store the number of events.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+int sr_trace_get_events(struct sr_trace_event **events, int *num_events)
+{
+	struct trace_slot *copy;
+	guint size, i, n;
+	gint seq;
+
+	if (!events || !num_events)
+		return SR_ERR_ARG;
+
+	*events = NULL;
+	*num_events = 0;
+	if (!trace_slots)
+		return SR_OK;
+
+	size = trace_mask + 1;
+	if (!(copy = g_try_malloc(size * sizeof(struct trace_slot)))) {
+		sr_err("trace: %s: copy malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (i = n = 0; i < size; i++) {
+		seq = g_atomic_int_get(&trace_slots[i].seq);
+		if (seq == 0 || seq == TRACE_SLOT_BUSY)
+			continue;
+		copy[n].event = trace_slots[i].event;
+		/* Skip the slot if it was reused while copying. */
+		if (g_atomic_int_get(&trace_slots[i].seq) != seq)
+			continue;
+		copy[n++].seq = seq;
+	}
+	qsort(copy, n, sizeof(struct trace_slot), compare_seq);
+
+	if (n > 0 && !(*events = g_try_malloc(n
+					* sizeof(struct sr_trace_event)))) {
+		sr_err("trace: %s: events malloc failed", __func__);
+		g_free(copy);
+		return SR_ERR_MALLOC;
+	}
+	for (i = 0; i < n; i++)
+		(*events)[i] = copy[i].event;
+	*num_events = n;
+	g_free(copy);
+
+	return SR_OK;
+}
+
+/**
+ * Get the name of a trace event id.
+ *
+ * @param id The event id.
+ * @return The name, or "unknown" if the id isn't valid.
+ */
+const char *sr_trace_event_name(int id)
+{
+	if (id < 0 || id >= (int)G_N_ELEMENTS(trace_event_names))
+		return "unknown";
+
+	return trace_event_names[id];
+}
+
+static FILE *trace_open(const char *filename)
+{
+	FILE *f;
+
+	if (!filename)
+		return stderr;
+
+	if (!(f = fopen(filename, "w")))
+		sr_err("trace: failed to open %s", filename);
+
+	return f;
+}
+
+static int trace_close(FILE *f)
+{
+	int ret;
+
+	ret = SR_OK;
+	if (ferror(f)) {
+		sr_err("trace: write failed");
+		ret = SR_ERR;
+	}
+	if (f != stderr && fclose(f) != 0 && ret == SR_OK) {
+		sr_err("trace: write failed");
+		ret = SR_ERR;
+	}
+
+	return ret;
+}
+
+/**
+ * Write the recorded trace events to a file, one per line, oldest first.
+ *
+ * @param filename The file to write, or NULL for stderr.
+ * @return SR_OK upon success, SR_ERR upon errors.
+ */
+int sr_trace_dump(const char *filename)
+{
+	struct sr_trace_event *events, *e;
+	FILE *f;
+	int num_events, i, ret;
+	static const char phases[] = { ' ', 'B', 'E' };
+
+	if ((ret = sr_trace_get_events(&events, &num_events)) != SR_OK)
+		return ret;
+
+	if (!(f = trace_open(filename))) {
+		g_free(events);
+		return SR_ERR;
+	}
+
+	for (i = 0; i < num_events; i++) {
+		e = &events[i];
+		fprintf(f, "%14.3f us  thread %-3d %c %-14s %" PRIu64 "\n",
+			e->timestamp / 1000.0, e->thread,
+			e->phase < sizeof(phases) ? phases[e->phase] : '?',
+			sr_trace_event_name(e->id), e->arg);
+	}
+	g_free(events);
+
+	return trace_close(f);
+}
+
+/**
+ * Write the recorded trace events to a file in the Chrome trace event
+ * format, which chrome://tracing and Perfetto can show as a timeline.
+ *
+ * Every thread which recorded events gets its own track. Spans whose
+ * beginning was already overwritten in the ring show up as ending at
+ * the start of the trace.
+ *
+ * @param filename The file to write, or NULL for stderr.
+ * @return SR_OK upon success, SR_ERR upon errors.
+ */
+int sr_trace_dump_json(const char *filename)
+{
+	struct sr_trace_event *events, *e;
+	FILE *f;
+	int num_events, i, ret;
+	static const char phases[] = { 'i', 'B', 'E' };
+
+	if ((ret = sr_trace_get_events(&events, &num_events)) != SR_OK)
+		return ret;
+
+	if (!(f = trace_open(filename))) {
+		g_free(events);
+		return SR_ERR;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < num_events; i++) {
+		e = &events[i];
+		if (e->phase >= sizeof(phases))
+			continue;
+		/* Timestamps are in us; keep the ns as decimals. */
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"sigrok\",\"ph\":\"%c\","
+			"\"ts\":%" PRIu64 ".%03u,\"pid\":1,\"tid\":%d,%s"
+			"\"args\":{\"arg\":%" PRIu64 "}},\n",
+			sr_trace_event_name(e->id), phases[e->phase],
+			e->timestamp / 1000, (unsigned)(e->timestamp % 1000),
+			e->thread,
+			e->phase == SR_TRACE_INSTANT ? "\"s\":\"t\"," : "",
+			e->arg);
+	}
+	/* Name the process, which also avoids a trailing comma. */
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"sigrok\"}}\n]}\n");
+	g_free(events);
+
+	return trace_close(f);
+}
@@ -0,0 +1,656 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <glib.h>
+#include <sigrok.h>
+#include <sigrok-internal.h>
+
+/*
+ * Streaming zip archive writer.
+ *
+ * libzip only writes an archive when it's closed, with the data of all
+ * its members at hand. This writes the members one after another, as
+ * their data comes in: each is raw deflated (or stored, at level 0)
+ * straight to the file, and since its CRC and sizes aren't known yet
+ * when its local header is written, they follow the data in a data
+ * descriptor. Members can also be compressed beforehand, on any thread,
+ * with zip_compress(), and then added with zip_writer_add_compressed().
+ * The central directory goes at the end. Zip64 records are used wherever
+ * sizes or offsets don't fit in 32 bits.
+ */
+
+/* Size of the buffer for deflate output. */
+#define ZIP_WRITER_BUFSIZE	(64 * 1024)
+/* zlib takes at most this many bytes per call. */
+#define ZIP_WRITER_MAX_INPUT	(1 << 30)
+
+#define ZIP_LOCAL_HEADER_SIG	0x04034b50
+#define ZIP_DESCRIPTOR_SIG	0x08074b50
+#define ZIP_CENTRAL_HEADER_SIG	0x02014b50
+#define ZIP64_END_SIG		0x06064b50
+#define ZIP64_LOCATOR_SIG	0x07064b50
+#define ZIP_END_SIG		0x06054b50
+
+/* General purpose flag: CRC and sizes are in the data descriptor. */
+#define ZIP_FLAG_DESCRIPTOR	0x0008
+/* Version needed to extract: 2.0 for deflate, 4.5 for zip64. */
+#define ZIP_VERSION		20
+#define ZIP64_VERSION		45
+/* Version made by: UNIX, spec 4.5. */
+#define ZIP_MADE_BY		((3 << 8) | ZIP64_VERSION)
+#define ZIP64_EXTRA_ID		0x0001
+#define ZIP32_MAX		0xffffffff
+
+struct zip_writer_entry {
+	char *name;
+	/* Offset of the local header in the archive. */
+	uint64_t offset;
+	int method;
+	int flags;
+	uint32_t crc;
+	uint64_t size;
+	uint64_t compressed_size;
+	uint16_t dos_time;
+	uint16_t dos_date;
+};
+
+struct zip_writer {
+	FILE *file;
+	/* Number of bytes written to the file so far. */
+	uint64_t offset;
+	/* List of struct zip_writer_entry */
+	GPtrArray *entries;
+	/* The member being written, or NULL. */
+	struct zip_writer_entry *current;
+	z_stream zs;
+	int level;
+	uint8_t *buf;
+	gboolean failed;
+};
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static void write_bytes(struct zip_writer *zw, const void *data, size_t len)
+{
+	if (zw->failed)
+		return;
+
+	if (fwrite(data, 1, len, zw->file) != len) {
+		sr_err("zip: %s: write failed", __func__);
+		zw->failed = TRUE;
+		return;
+	}
+	zw->offset += len;
+}
+
+static void dos_time(time_t t, uint16_t *dtime, uint16_t *ddate)
+{
+	struct tm *tm;
+
+	tm = localtime(&t);
+	if (!tm || tm->tm_year < 80) {
+		/* Earliest time DOS knows of: 1980-01-01 00:00. */
+		*dtime = 0;
+		*ddate = (1 << 5) | 1;
+		return;
+	}
+	*dtime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+	*ddate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5)
+		 | tm->tm_mday;
+}
+
+static void entry_free(gpointer data)
+{
+	struct zip_writer_entry *entry;
+
+	entry = data;
+	g_free(entry->name);
+	g_free(entry);
+}
+
+static gboolean entry_is_zip64(const struct zip_writer_entry *entry)
+{
+	return entry->size >= ZIP32_MAX || entry->compressed_size >= ZIP32_MAX
+	       || entry->offset >= ZIP32_MAX;
+}
+
+/**
+ * Create a new zip archive, replacing any existing file of that name.
+ *
+ * @param filename The file to write.
+ * @param level The zlib compression level for the members' data.
+ * @return The new writer, or NULL upon errors.
+ */
+struct zip_writer *zip_writer_new(const char *filename, int level)
+{
+	struct zip_writer *zw;
+
+	if (!(zw = g_try_malloc0(sizeof(struct zip_writer)))) {
+		sr_err("zip: %s: zw malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(zw->buf = g_try_malloc(ZIP_WRITER_BUFSIZE))) {
+		sr_err("zip: %s: buf malloc failed", __func__);
+		g_free(zw);
+		return NULL;
+	}
+
+	if (!(zw->file = fopen(filename, "wb"))) {
+		sr_err("zip: %s: failed to create %s", __func__, filename);
+		g_free(zw->buf);
+		g_free(zw);
+		return NULL;
+	}
+
+	zw->entries = g_ptr_array_new_with_free_func(entry_free);
+	zw->level = level;
+
+	return zw;
+}
+
+static struct zip_writer_entry *entry_new(struct zip_writer *zw,
+					  const char *name, int method,
+					  int flags)
+{
+	struct zip_writer_entry *entry;
+
+	if (!(entry = g_try_malloc0(sizeof(struct zip_writer_entry)))) {
+		sr_err("zip: %s: entry malloc failed", __func__);
+		return NULL;
+	}
+	entry->name = g_strdup(name);
+	entry->offset = zw->offset;
+	entry->method = method;
+	entry->flags = flags;
+	entry->crc = crc32(0, NULL, 0);
+	dos_time(time(NULL), &entry->dos_time, &entry->dos_date);
+
+	return entry;
+}
+
+/*
+ * Write an entry's local header. Unless the entry has a data descriptor,
+ * its CRC and sizes must be known by now.
+ */
+static void write_local_header(struct zip_writer *zw,
+			       const struct zip_writer_entry *entry)
+{
+	uint8_t header[30], extra[20];
+	size_t name_len;
+	gboolean zip64;
+
+	name_len = strlen(entry->name);
+	zip64 = !(entry->flags & ZIP_FLAG_DESCRIPTOR)
+		&& (entry->size >= ZIP32_MAX
+		    || entry->compressed_size >= ZIP32_MAX);
+
+	memset(header, 0, sizeof(header));
+	put32(header, ZIP_LOCAL_HEADER_SIG);
+	put16(header + 4, zip64 ? ZIP64_VERSION : ZIP_VERSION);
+	put16(header + 6, entry->flags);
+	put16(header + 8, entry->method);
+	put16(header + 10, entry->dos_time);
+	put16(header + 12, entry->dos_date);
+	put16(header + 26, name_len);
+	if (zip64) {
+		put32(header + 14, entry->crc);
+		put32(header + 18, ZIP32_MAX);
+		put32(header + 22, ZIP32_MAX);
+		put16(header + 28, sizeof(extra));
+		put16(extra, ZIP64_EXTRA_ID);
+		put16(extra + 2, sizeof(extra) - 4);
+		put64(extra + 4, entry->size);
+		put64(extra + 12, entry->compressed_size);
+	} else if (!(entry->flags & ZIP_FLAG_DESCRIPTOR)) {
+		put32(header + 14, entry->crc);
+		put32(header + 18, entry->compressed_size);
+		put32(header + 22, entry->size);
+	}
+	write_bytes(zw, header, sizeof(header));
+	write_bytes(zw, entry->name, name_len);
+	if (zip64)
+		write_bytes(zw, extra, sizeof(extra));
+}
+
+/**
+ * Start a new member of the archive. Its data is written with
+ * zip_writer_write(), and it's finished with zip_writer_end().
+ *
+ * @param zw The writer.
+ * @param name The member's name.
+ * @return SR_OK upon success, SR_ERR_ARG if a member was still being
+ *         written, SR_ERR or SR_ERR_MALLOC upon other errors.
+ */
+int zip_writer_begin(struct zip_writer *zw, const char *name)
+{
+	struct zip_writer_entry *entry;
+
+	if (!zw || !name || zw->current)
+		return SR_ERR_ARG;
+
+	if (zw->failed)
+		return SR_ERR;
+
+	if (!(entry = entry_new(zw, name, zw->level == 0 ? ZIP_METHOD_STORE
+				: ZIP_METHOD_DEFLATE, ZIP_FLAG_DESCRIPTOR)))
+		return SR_ERR_MALLOC;
+
+	if (entry->method == ZIP_METHOD_DEFLATE) {
+		memset(&zw->zs, 0, sizeof(z_stream));
+		if (deflateInit2(&zw->zs, zw->level, Z_DEFLATED, -MAX_WBITS,
+				 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			sr_err("zip: %s: deflateInit2 failed", __func__);
+			entry_free(entry);
+			return SR_ERR;
+		}
+		zw->zs.next_out = zw->buf;
+		zw->zs.avail_out = ZIP_WRITER_BUFSIZE;
+	}
+
+	write_local_header(zw, entry);
+	g_ptr_array_add(zw->entries, entry);
+	zw->current = entry;
+
+	return zw->failed ? SR_ERR : SR_OK;
+}
+
+/* Run deflate on the pending input, writing out every full buffer. */
+static int deflate_run(struct zip_writer *zw, int flush)
+{
+	int ret;
+
+	do {
+		ret = deflate(&zw->zs, flush);
+		if (ret == Z_STREAM_ERROR) {
+			sr_err("zip: %s: deflate failed", __func__);
+			zw->failed = TRUE;
+			return SR_ERR;
+		}
+		if (zw->zs.avail_out == 0 || ret == Z_STREAM_END) {
+			write_bytes(zw, zw->buf,
+				    ZIP_WRITER_BUFSIZE - zw->zs.avail_out);
+			zw->zs.next_out = zw->buf;
+			zw->zs.avail_out = ZIP_WRITER_BUFSIZE;
+		}
+	} while (zw->zs.avail_in > 0
+		 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return zw->failed ? SR_ERR : SR_OK;
+}
+
+/**
+ * Add data to the member being written.
+ *
+ * @param zw The writer.
+ * @param data The data.
+ * @param length The number of bytes of data.
+ * @return SR_OK upon success, SR_ERR_ARG if no member was being
+ *         written, SR_ERR upon other errors.
+ */
+int zip_writer_write(struct zip_writer *zw, const void *data,
+		     uint64_t length)
+{
+	const uint8_t *p;
+	uInt len;
+
+	if (!zw || !zw->current || (!data && length > 0))
+		return SR_ERR_ARG;
+
+	p = data;
+	while (length > 0 && !zw->failed) {
+		len = MIN(length, ZIP_WRITER_MAX_INPUT);
+		zw->current->crc = crc32(zw->current->crc, p, len);
+		zw->current->size += len;
+		if (zw->current->method == ZIP_METHOD_STORE) {
+			write_bytes(zw, p, len);
+		} else {
+			zw->zs.next_in = (Bytef *)p;
+			zw->zs.avail_in = len;
+			deflate_run(zw, Z_NO_FLUSH);
+		}
+		p += len;
+		length -= len;
+	}
+
+	return zw->failed ? SR_ERR : SR_OK;
+}
+
+/**
+ * Finish the member being written.
+ *
+ * @param zw The writer.
+ * @return SR_OK upon success, SR_ERR_ARG if no member was being
+ *         written, SR_ERR upon other errors.
+ */
+int zip_writer_end(struct zip_writer *zw)
+{
+	struct zip_writer_entry *entry;
+	uint8_t descriptor[24];
+	uint64_t data_offset;
+
+	if (!zw || !(entry = zw->current))
+		return SR_ERR_ARG;
+
+	data_offset = entry->offset + 30 + strlen(entry->name);
+	if (entry->method == ZIP_METHOD_DEFLATE) {
+		zw->zs.avail_in = 0;
+		deflate_run(zw, Z_FINISH);
+		deflateEnd(&zw->zs);
+	}
+	zw->current = NULL;
+	entry->compressed_size = zw->offset - data_offset;
+
+	put32(descriptor, ZIP_DESCRIPTOR_SIG);
+	put32(descriptor + 4, entry->crc);
+	if (entry->size >= ZIP32_MAX || entry->compressed_size >= ZIP32_MAX) {
+		put64(descriptor + 8, entry->compressed_size);
+		put64(descriptor + 16, entry->size);
+		write_bytes(zw, descriptor, 24);
+	} else {
+		put32(descriptor + 8, entry->compressed_size);
+		put32(descriptor + 12, entry->size);
+		write_bytes(zw, descriptor, 16);
+	}
+
+	return zw->failed ? SR_ERR : SR_OK;
+}
+
+/**
+ * Add a member to the archive, all in one go.
+ *
+ * @param zw The writer.
+ * @param name The member's name.
+ * @param data The member's data.
+ * @param length The number of bytes of data.
+ * @return SR_OK upon success, or an error code as zip_writer_begin().
+ */
+int zip_writer_add(struct zip_writer *zw, const char *name, const void *data,
+		   uint64_t length)
+{
+	int ret;
+
+	if ((ret = zip_writer_begin(zw, name)) != SR_OK)
+		return ret;
+	if ((ret = zip_writer_write(zw, data, length)) != SR_OK) {
+		zip_writer_end(zw);
+		return ret;
+	}
+
+	return zip_writer_end(zw);
+}
+
+/**
+ * Compress data for a member to be added with zip_writer_add_compressed().
+ * This doesn't touch any writer, so it can run on any thread.
+ *
+ * @param data The member's data.
+ * @param length The number of bytes of data, at most 1 GiB.
+ * @param level The zlib compression level. At level 0, or if deflate
+ *              doesn't make the data any smaller, it's stored as it is.
+ * @param out Set to the compressed data, which the caller must g_free(),
+ *            or to NULL if the data is stored.
+ * @param out_length Set to the size of the compressed data.
+ * @param crc Set to the CRC-32 of the data.
+ * @param method Set to the member's compression method.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+int zip_compress(const void *data, uint64_t length, int level,
+		 uint8_t **out, uint64_t *out_length, uint32_t *crc,
+		 int *method)
+{
+	z_stream zs;
+	uint8_t *buf;
+	uLong bound;
+	int ret;
+
+	if ((!data && length > 0) || length > ZIP_WRITER_MAX_INPUT || !out
+	    || !out_length || !crc || !method)
+		return SR_ERR_ARG;
+
+	*crc = crc32(crc32(0, NULL, 0), data, length);
+	*out = NULL;
+	*out_length = length;
+	*method = ZIP_METHOD_STORE;
+	if (level == 0 || length == 0)
+		return SR_OK;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		sr_err("zip: %s: deflateInit2 failed", __func__);
+		return SR_ERR;
+	}
+	bound = deflateBound(&zs, length);
+	if (!(buf = g_try_malloc(bound))) {
+		sr_err("zip: %s: buf malloc failed", __func__);
+		deflateEnd(&zs);
+		return SR_ERR_MALLOC;
+	}
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = length;
+	zs.next_out = buf;
+	zs.avail_out = bound;
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		sr_err("zip: %s: deflate failed", __func__);
+		g_free(buf);
+		return SR_ERR;
+	}
+
+	if (zs.total_out >= length) {
+		/* Incompressible: store it. */
+		g_free(buf);
+		return SR_OK;
+	}
+	*out = buf;
+	*out_length = zs.total_out;
+	*method = ZIP_METHOD_DEFLATE;
+
+	return SR_OK;
+}
+
+/**
+ * Add a member whose data was compressed with zip_compress().
+ *
+ * @param zw The writer.
+ * @param name The member's name.
+ * @param method The compression method, from zip_compress().
+ * @param data The compressed data.
+ * @param length The size of the compressed data.
+ * @param size The size of the data before compression.
+ * @param crc The CRC-32 of the data before compression.
+ * @return SR_OK upon success, SR_ERR_ARG if a member was still being
+ *         written, SR_ERR or SR_ERR_MALLOC upon other errors.
+ */
+int zip_writer_add_compressed(struct zip_writer *zw, const char *name,
+			      int method, const void *data, uint64_t length,
+			      uint64_t size, uint32_t crc)
+{
+	struct zip_writer_entry *entry;
+
+	if (!zw || !name || zw->current || (!data && length > 0))
+		return SR_ERR_ARG;
+
+	if (zw->failed)
+		return SR_ERR;
+
+	if (!(entry = entry_new(zw, name, method, 0)))
+		return SR_ERR_MALLOC;
+	entry->crc = crc;
+	entry->size = size;
+	entry->compressed_size = length;
+
+	write_local_header(zw, entry);
+	write_bytes(zw, data, length);
+	g_ptr_array_add(zw->entries, entry);
+
+	return zw->failed ? SR_ERR : SR_OK;
+}
+
+static void write_central_header(struct zip_writer *zw,
+				 const struct zip_writer_entry *entry)
+{
+	uint8_t header[46], extra[28];
+	size_t name_len;
+	gboolean zip64;
+
+	name_len = strlen(entry->name);
+	zip64 = entry_is_zip64(entry);
+
+	memset(header, 0, sizeof(header));
+	put32(header, ZIP_CENTRAL_HEADER_SIG);
+	put16(header + 4, ZIP_MADE_BY);
+	put16(header + 6, zip64 ? ZIP64_VERSION : ZIP_VERSION);
+	put16(header + 8, entry->flags);
+	put16(header + 10, entry->method);
+	put16(header + 12, entry->dos_time);
+	put16(header + 14, entry->dos_date);
+	put32(header + 16, entry->crc);
+	put16(header + 28, name_len);
+	/* External attributes: a regular file, mode 0644. */
+	put32(header + 38, 0100644 << 16);
+
+	if (zip64) {
+		/* All three in the zip64 extra field, in this order. */
+		put32(header + 20, ZIP32_MAX);
+		put32(header + 24, ZIP32_MAX);
+		put32(header + 42, ZIP32_MAX);
+		put16(header + 30, sizeof(extra));
+		put16(extra, ZIP64_EXTRA_ID);
+		put16(extra + 2, sizeof(extra) - 4);
+		put64(extra + 4, entry->size);
+		put64(extra + 12, entry->compressed_size);
+		put64(extra + 20, entry->offset);
+	} else {
+		put32(header + 20, entry->compressed_size);
+		put32(header + 24, entry->size);
+		put32(header + 42, entry->offset);
+	}
+
+	write_bytes(zw, header, sizeof(header));
+	write_bytes(zw, entry->name, name_len);
+	if (zip64)
+		write_bytes(zw, extra, sizeof(extra));
+}
+
+/**
+ * Finish the archive: end the member being written, if any, and write
+ * the central directory. The writer is freed, whether this succeeds or
+ * not.
+ *
+ * @param zw The writer.
+ * @return SR_OK upon success, SR_ERR if anything written to the archive
+ *         since it was created failed.
+ */
+int zip_writer_close(struct zip_writer *zw)
+{
+	struct zip_writer_entry *entry;
+	uint8_t end[56], locator[20];
+	uint64_t dir_offset, dir_size, num_entries, end64_offset;
+	gboolean zip64;
+	guint i;
+	int ret;
+
+	if (!zw)
+		return SR_ERR_ARG;
+
+	if (zw->current)
+		zip_writer_end(zw);
+
+	zip64 = FALSE;
+	dir_offset = zw->offset;
+	for (i = 0; i < zw->entries->len; i++) {
+		entry = g_ptr_array_index(zw->entries, i);
+		write_central_header(zw, entry);
+		zip64 |= entry_is_zip64(entry);
+	}
+	dir_size = zw->offset - dir_offset;
+	num_entries = zw->entries->len;
+
+	if (zip64 || dir_offset >= ZIP32_MAX || dir_size >= ZIP32_MAX
+	    || num_entries >= 0xffff) {
+		end64_offset = zw->offset;
+		memset(end, 0, sizeof(end));
+		put32(end, ZIP64_END_SIG);
+		put64(end + 4, sizeof(end) - 12);
+		put16(end + 12, ZIP_MADE_BY);
+		put16(end + 14, ZIP64_VERSION);
+		put64(end + 24, num_entries);
+		put64(end + 32, num_entries);
+		put64(end + 40, dir_size);
+		put64(end + 48, dir_offset);
+		write_bytes(zw, end, sizeof(end));
+
+		memset(locator, 0, sizeof(locator));
+		put32(locator, ZIP64_LOCATOR_SIG);
+		put64(locator + 8, end64_offset);
+		put32(locator + 16, 1);
+		write_bytes(zw, locator, sizeof(locator));
+
+		/* The zip64 end record has the real values. */
+		num_entries = MIN(num_entries, 0xffff);
+		dir_size = MIN(dir_size, ZIP32_MAX);
+		dir_offset = MIN(dir_offset, ZIP32_MAX);
+	}
+
+	memset(end, 0, 22);
+	put32(end, ZIP_END_SIG);
+	put16(end + 8, num_entries);
+	put16(end + 10, num_entries);
+	put32(end + 12, dir_size);
+	put32(end + 16, dir_offset);
+	write_bytes(zw, end, 22);
+
+	ret = zw->failed ? SR_ERR : SR_OK;
+	if (fclose(zw->file) != 0 && ret == SR_OK) {
+		sr_err("zip: %s: write failed", __func__);
+		ret = SR_ERR;
+	}
+	g_ptr_array_free(zw->entries, TRUE);
+	g_free(zw->buf);
+	g_free(zw);
+
+	return ret;
+}